@@ -0,0 +1,198 @@
+#include "can_bus_stats.hpp"
+#include "socketcan.hpp"
+
+#include <algorithm>
+
+CanBusStats::CanBusStats()
+    : m_firstSecond(NowSecond())
+{
+}
+
+void CanBusStats::SetBitrates(int bitrate, int dataBitrate)
+{
+    m_bitrate.store(std::max(bitrate, 0), std::memory_order_relaxed);
+    m_dataBitrate.store(std::max(dataBitrate, 0), std::memory_order_relaxed);
+}
+
+void CanBusStats::Record(Direction direction, const canfd_frame& frame, size_t mtu)
+{
+    const auto bits = SocketCAN::StuffedFrameBitLength(frame, mtu);
+    if (bits.arbitration == 0)
+        return;
+
+    // Data phase at the data bitrate only if the frame actually switched
+    const bool fd = (mtu == CANFD_MTU);
+    const bool brs = fd && (frame.flags & CANFD_BRS);
+    const uint64_t bitrate = m_bitrate.load(std::memory_order_relaxed);
+    const uint64_t dataBitrate = m_dataBitrate.load(std::memory_order_relaxed);
+    const auto dataPhaseBitrate = (brs && dataBitrate > 0) ? dataBitrate : bitrate;
+    const uint64_t busNs = bitrate
+        ? bits.arbitration * 1'000'000'000ULL / bitrate + bits.data * 1'000'000'000ULL / dataPhaseBitrate
+        : 0;
+
+    auto& totals = m_totals[static_cast<size_t>(direction)];
+    totals.frames.fetch_add(1, std::memory_order_relaxed);
+    totals.fdFrames.fetch_add(fd ? 1 : 0, std::memory_order_relaxed);
+    totals.brsFrames.fetch_add(brs ? 1 : 0, std::memory_order_relaxed);
+    totals.payloadBytes.fetch_add(frame.len, std::memory_order_relaxed);
+    totals.wireBits.fetch_add(bits.arbitration + bits.data, std::memory_order_relaxed);
+    totals.stuffBits.fetch_add(bits.stuff, std::memory_order_relaxed);
+    totals.busNs.fetch_add(busNs, std::memory_order_relaxed);
+
+    const auto second = NowSecond();
+    auto& slot = m_seconds[second % SecondSlotCount];
+    AddTagged(slot.busNs, second, busNs);
+    AddTagged(slot.frames, second, 1);
+
+    const bool id29Bit = frame.can_id & CAN_EFF_FLAG;
+    CountId(direction, frame.can_id & (id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK), id29Bit);
+}
+
+CanBusStats::Snapshot CanBusStats::Take() const
+{
+    Snapshot snap {};
+    snap.taken = Clock::now();
+    snap.rx = m_totals[static_cast<size_t>(Direction::Rx)].Load();
+    snap.tx = m_totals[static_cast<size_t>(Direction::Tx)].Load();
+    for (size_t window = 0; window < LoadWindows.size(); window++) {
+        snap.loadPct[window] = Load(window);
+        int64_t seconds = 0;
+        const auto frames = SumWindow(window, &SecondSlot::frames, seconds);
+        snap.framesPerSec[window] = seconds ? static_cast<double>(frames) / seconds : 0.;
+    }
+
+    const auto& stdRx = m_stdIds[static_cast<size_t>(Direction::Rx)];
+    const auto& stdTx = m_stdIds[static_cast<size_t>(Direction::Tx)];
+    for (size_t id = 0; id < StdIdCount; id++) {
+        const auto rx = stdRx[id].load(std::memory_order_relaxed);
+        const auto tx = stdTx[id].load(std::memory_order_relaxed);
+        if (rx || tx)
+            snap.ids.push_back({ static_cast<uint32_t>(id), false, rx, tx });
+    }
+    for (size_t slot = 0; slot < ExtIdSlotCount; slot++) {
+        const auto claimed = m_extIds[slot].load(std::memory_order_acquire);
+        if (claimed == 0)
+            break;
+        snap.ids.push_back({ claimed & CAN_EFF_MASK, true,
+            m_extIdFrames[static_cast<size_t>(Direction::Rx)][slot].load(std::memory_order_relaxed),
+            m_extIdFrames[static_cast<size_t>(Direction::Tx)][slot].load(std::memory_order_relaxed) });
+    }
+    snap.untracedExtFrames = m_untracedExtFrames.load(std::memory_order_relaxed);
+    return snap;
+}
+
+double CanBusStats::Load(size_t window) const
+{
+    int64_t seconds = 0;
+    const auto busNs = SumWindow(window, &SecondSlot::busNs, seconds);
+    return seconds ? busNs * 100. / (seconds * 1'000'000'000.) : 0.;
+}
+
+std::vector<CanBusStats::IdRate> CanBusStats::Rates(const Snapshot& before, const Snapshot& after)
+{
+    std::vector<IdRate> rates {};
+    const auto elapsed = std::chrono::duration<double>(after.taken - before.taken).count();
+    if (elapsed <= 0.)
+        return rates;
+
+    // Standard IDs come in ascending order in both lists. Extended ones follow in the order they claimed their slot,
+    // which they keep for good, so the earlier list holds a prefix of the later one's.
+    size_t prevStd = 0;
+    auto prevExt = static_cast<size_t>(std::find_if(before.ids.begin(), before.ids.end(),
+                                           [](const IdCount& count) { return count.id29Bit; })
+        - before.ids.begin());
+    for (const auto& count : after.ids) {
+        IdCount earlier { count.id, count.id29Bit };
+        if (!count.id29Bit) {
+            while (prevStd < before.ids.size() && !before.ids[prevStd].id29Bit && before.ids[prevStd].id < count.id)
+                prevStd++;
+            if (prevStd < before.ids.size() && !before.ids[prevStd].id29Bit && before.ids[prevStd].id == count.id)
+                earlier = before.ids[prevStd];
+        } else if (prevExt < before.ids.size() && before.ids[prevExt].id == count.id) {
+            earlier = before.ids[prevExt++];
+        }
+
+        if (count.rx == earlier.rx && count.tx == earlier.tx)
+            continue;
+        rates.push_back(
+            { count.id, count.id29Bit, (count.rx - earlier.rx) / elapsed, (count.tx - earlier.tx) / elapsed });
+    }
+
+    std::sort(rates.begin(), rates.end(), [](const IdRate& lhs, const IdRate& rhs) {
+        return lhs.rxPerSec + lhs.txPerSec > rhs.rxPerSec + rhs.txPerSec;
+    });
+    return rates;
+}
+
+CanBusStats::Totals CanBusStats::AtomicTotals::Load() const
+{
+    Totals totals {};
+    totals.frames = frames.load(std::memory_order_relaxed);
+    totals.fdFrames = fdFrames.load(std::memory_order_relaxed);
+    totals.brsFrames = brsFrames.load(std::memory_order_relaxed);
+    totals.payloadBytes = payloadBytes.load(std::memory_order_relaxed);
+    totals.wireBits = wireBits.load(std::memory_order_relaxed);
+    totals.stuffBits = stuffBits.load(std::memory_order_relaxed);
+    totals.busNs = busNs.load(std::memory_order_relaxed);
+    return totals;
+}
+
+int64_t CanBusStats::NowSecond()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(Clock::now().time_since_epoch()).count();
+}
+
+void CanBusStats::AddTagged(std::atomic<uint64_t>& slot, int64_t second, uint64_t value)
+{
+    const uint64_t tag = static_cast<uint64_t>(second) & TagMask;
+    auto current = slot.load(std::memory_order_relaxed);
+    while (true) {
+        const auto next = ((current >> ValueBits) == tag) ? current + value : (tag << ValueBits) | value;
+        if (slot.compare_exchange_weak(current, next, std::memory_order_relaxed))
+            return;
+    }
+}
+
+uint64_t CanBusStats::SumWindow(size_t window, std::atomic<uint64_t> SecondSlot::*counter, int64_t& seconds) const
+{
+    seconds = 0;
+    if (window >= LoadWindows.size())
+        return 0;
+
+    // Complete seconds only, and none from before this instance was around
+    const auto now = NowSecond();
+    const auto first = std::max<int64_t>(now - LoadWindows[window].count(), m_firstSecond);
+    uint64_t sum = 0;
+    for (auto second = first; second < now; second++)
+        sum += ReadTagged(m_seconds[second % SecondSlotCount].*counter, second);
+    seconds = std::max<int64_t>(now - first, 0);
+    return sum;
+}
+
+uint64_t CanBusStats::ReadTagged(const std::atomic<uint64_t>& slot, int64_t second)
+{
+    // Anything tagged with another second is a leftover from a lap ago
+    const auto current = slot.load(std::memory_order_relaxed);
+    return ((current >> ValueBits) == (static_cast<uint64_t>(second) & TagMask)) ? current & ValueMask : 0;
+}
+
+void CanBusStats::CountId(Direction direction, uint32_t id, bool id29Bit)
+{
+    if (!id29Bit) {
+        m_stdIds[static_cast<size_t>(direction)][id].fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // Slots are claimed once and for good, so a lookup only ever has to scan up to the first free one
+    const uint32_t claim = id | CAN_EFF_FLAG;
+    for (size_t slot = 0; slot < ExtIdSlotCount; slot++) {
+        auto claimed = m_extIds[slot].load(std::memory_order_acquire);
+        if (claimed == 0 && m_extIds[slot].compare_exchange_strong(claimed, claim, std::memory_order_acq_rel))
+            claimed = claim;
+        if (claimed == claim) {
+            m_extIdFrames[static_cast<size_t>(direction)][slot].fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    m_untracedExtFrames.fetch_add(1, std::memory_order_relaxed);
+}
@@ -0,0 +1,128 @@
+#ifndef CANOPEN_TIMERS_LIB_CAN_BUS_STATS_HPP_
+#define CANOPEN_TIMERS_LIB_CAN_BUS_STATS_HPP_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <linux/can.h>
+
+// Traffic of one interface in both directions: frame and bit counts with each frame's exact stuffing, bus load over
+// sliding windows and frame counts per COB-ID. Recording is lock-free and safe from any thread, and so is taking a
+// snapshot; every counter in it is exact, they just aren't all read at the very same instant.
+class CanBusStats {
+public:
+    enum class Direction : uint8_t {
+        Rx,
+        Tx,
+    };
+
+    static constexpr std::array<std::chrono::seconds, 3> LoadWindows {
+        std::chrono::seconds(1),
+        std::chrono::seconds(10),
+        std::chrono::seconds(60),
+    };
+    static constexpr size_t ExtIdSlotCount { 32 }; // distinct 29-bit IDs counted, later ones only go in the totals
+
+    struct Totals {
+        uint64_t frames { 0 };
+        uint64_t fdFrames { 0 };
+        uint64_t brsFrames { 0 };
+        uint64_t payloadBytes { 0 };
+        uint64_t wireBits { 0 }; // everything from SOF to the end of IFS, at whichever bitrate it went
+        uint64_t stuffBits { 0 }; // out of the above
+        uint64_t busNs { 0 }; // time on the wire
+    };
+
+    struct IdCount {
+        uint32_t id {};
+        bool id29Bit {};
+        uint64_t rx { 0 };
+        uint64_t tx { 0 };
+    };
+
+    struct Snapshot {
+        std::chrono::steady_clock::time_point taken {};
+        Totals rx {};
+        Totals tx {};
+        std::array<double, LoadWindows.size()> loadPct {}; // both directions, over the last complete seconds
+        std::array<double, LoadWindows.size()> framesPerSec {};
+        std::vector<IdCount> ids {}; // only the ones seen so far
+        uint64_t untracedExtFrames { 0 };
+    };
+
+    struct IdRate {
+        uint32_t id {};
+        bool id29Bit {};
+        double rxPerSec { 0. };
+        double txPerSec { 0. };
+    };
+
+    CanBusStats();
+    CanBusStats(const CanBusStats&) = delete;
+    CanBusStats& operator=(const CanBusStats&) = delete;
+
+    // Frames recorded from now on take as long as they would at these, 0 for the data bitrate means classic only
+    void SetBitrates(int bitrate, int dataBitrate);
+
+    // A complete data frame as read from or written to the socket, mtu telling classic from FD
+    void Record(Direction direction, const canfd_frame& frame, size_t mtu);
+
+    Snapshot Take() const;
+
+    // Share of the given LoadWindows entry the bus was busy, in percent
+    double Load(size_t window) const;
+
+    // Frames per second of every COB-ID in between two snapshots of the same instance, busiest first
+    static std::vector<IdRate> Rates(const Snapshot& before, const Snapshot& after);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Per-second slots tagged with the second they count, so that a writer landing in a new second restarts the slot
+    // with a single CAS instead of someone having to clear it ahead of time
+    static constexpr size_t SecondSlotCount { 64 }; // the longest window, plus the second being written
+    static constexpr unsigned TagBits { 24 };
+    static constexpr unsigned ValueBits { 64 - TagBits };
+    static constexpr uint64_t ValueMask { (1ULL << ValueBits) - 1 };
+    static constexpr uint64_t TagMask { (1ULL << TagBits) - 1 };
+    static constexpr size_t StdIdCount { CAN_SFF_MASK + 1 };
+
+    struct AtomicTotals {
+        std::atomic<uint64_t> frames { 0 };
+        std::atomic<uint64_t> fdFrames { 0 };
+        std::atomic<uint64_t> brsFrames { 0 };
+        std::atomic<uint64_t> payloadBytes { 0 };
+        std::atomic<uint64_t> wireBits { 0 };
+        std::atomic<uint64_t> stuffBits { 0 };
+        std::atomic<uint64_t> busNs { 0 };
+
+        Totals Load() const;
+    };
+
+    struct SecondSlot {
+        std::atomic<uint64_t> busNs { 0 };
+        std::atomic<uint64_t> frames { 0 };
+    };
+
+    std::atomic<int> m_bitrate { 0 };
+    std::atomic<int> m_dataBitrate { 0 };
+    const int64_t m_firstSecond;
+    std::array<AtomicTotals, 2> m_totals {};
+    std::array<SecondSlot, SecondSlotCount> m_seconds {};
+    std::array<std::array<std::atomic<uint64_t>, StdIdCount>, 2> m_stdIds {};
+    std::array<std::atomic<uint32_t>, ExtIdSlotCount> m_extIds {}; // claimed as ID | CAN_EFF_FLAG, 0 when free
+    std::array<std::array<std::atomic<uint64_t>, ExtIdSlotCount>, 2> m_extIdFrames {};
+    std::atomic<uint64_t> m_untracedExtFrames { 0 };
+
+    static int64_t NowSecond();
+    static void AddTagged(std::atomic<uint64_t>& slot, int64_t second, uint64_t value);
+    static uint64_t ReadTagged(const std::atomic<uint64_t>& slot, int64_t second);
+    uint64_t SumWindow(size_t window, std::atomic<uint64_t> SecondSlot::*counter, int64_t& seconds) const;
+    void CountId(Direction direction, uint32_t id, bool id29Bit);
+};
+
+#endif // CANOPEN_TIMERS_LIB_CAN_BUS_STATS_HPP_
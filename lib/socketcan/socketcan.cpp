@@ -1,28 +1,36 @@
 #include "socketcan.hpp"
+#include "can_bus_stats.hpp"
 
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <sstream>
 
 #include <dirent.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <linux/can.h>
 #include <linux/can/error.h>
 #include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <net/if.h>
 #include <netlink/netlink.h>
 #include <netlink/route/link.h>
 #include <netlink/route/link/can.h>
 #include <netlink/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 const std::string LOG_MARKER { "[SocketCAN] " };
 const std::string ERR_MARKER { "E: " };
@@ -210,7 +218,26 @@ static bool Netlink_BringDown(nl_sock*& sock, rtnl_link*& link)
     return rc == 0;
 }
 
-static bool Netlink_CANSetBitrate(nl_sock*& sock, rtnl_link*& link, const int bitrate)
+// Whether the link already runs at these, a data bitrate meaning CAN FD and none classic CAN
+static bool Netlink_CANBitrateMatches(rtnl_link*& link, const int bitrate, const int dataBitrate = 0)
+{
+    if (!link || bitrate <= 0)
+        return false;
+
+    const bool wantFd = dataBitrate > 0;
+    uint32_t currBitrate = 0;
+    uint32_t currCtrlMode = 0;
+    struct can_bittiming currDataTiming { };
+    const bool bitrateOk
+        = rtnl_link_can_get_bitrate(link, &currBitrate) == 0 && currBitrate == static_cast<uint32_t>(bitrate);
+    const bool currFd = rtnl_link_can_get_ctrlmode(link, &currCtrlMode) == 0 && (currCtrlMode & CAN_CTRLMODE_FD);
+    const bool dataBitrateOk = !wantFd
+        || (rtnl_link_can_get_data_bittiming(link, &currDataTiming) == 0
+            && currDataTiming.bitrate == static_cast<uint32_t>(dataBitrate));
+    return bitrateOk && currFd == wantFd && dataBitrateOk;
+}
+
+static bool Netlink_CANSetBitrate(nl_sock*& sock, rtnl_link*& link, const int bitrate, const int dataBitrate = 0)
 {
     if (!sock || !link)
         return false;
@@ -220,10 +247,21 @@ static bool Netlink_CANSetBitrate(nl_sock*& sock, rtnl_link*& link, const int bi
         return false;
     }
 
-    uint32_t currBitrate = 0;
-    if (rtnl_link_can_get_bitrate(link, &currBitrate) == 0 && currBitrate == bitrate)
+    if (bitrate <= 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "NL: invalid CAN bitrate " << bitrate << "!" << std::endl;
+        return false;
+    }
+
+    if (Netlink_CANBitrateMatches(link, bitrate, dataBitrate))
         return true;
 
+    // A data bitrate means CAN FD, none means the controller goes back to classic CAN
+    const bool wantFd = dataBitrate > 0;
+    const auto nominalBps = static_cast<uint32_t>(bitrate);
+    const auto dataBps = static_cast<uint32_t>(wantFd ? dataBitrate : 0);
+    uint32_t currCtrlMode = 0;
+    const bool currFd = rtnl_link_can_get_ctrlmode(link, &currCtrlMode) == 0 && (currCtrlMode & CAN_CTRLMODE_FD);
+
     auto change = rtnl_link_alloc();
     if (!change)
         return false;
@@ -232,12 +270,24 @@ static bool Netlink_CANSetBitrate(nl_sock*& sock, rtnl_link*& link, const int bi
     const auto ifname = rtnl_link_get_name(link);
     rtnl_link_set_ifindex(change, ifidx);
     rtnl_link_set_type(change, "can");
-    rtnl_link_can_set_bitrate(change, bitrate);
+    rtnl_link_can_set_bitrate(change, nominalBps);
+    if (wantFd) {
+        // Only the bitrate is given, the kernel works out the segments like it does for the nominal one
+        struct can_bittiming dataTiming { };
+        dataTiming.bitrate = dataBps;
+        rtnl_link_can_set_ctrlmode(change, CAN_CTRLMODE_FD);
+        rtnl_link_can_set_data_bittiming(change, &dataTiming);
+    } else if (currFd) {
+        rtnl_link_can_unset_ctrlmode(change, CAN_CTRLMODE_FD);
+    }
 
     // Apply the changes
     const auto rc = rtnl_link_change(sock, link, change, 0);
     if (rc < 0) {
         std::cerr << ERR_MARKER << LOG_MARKER << ifname << ": failed to set bitrate (code " << rc << ")!" << std::endl;
+    } else if (wantFd) {
+        std::cout << LOG_MARKER << ifname << ": bitrate set to " << bitrate << ", CAN FD data bitrate "
+                  << dataBitrate << std::endl;
     } else {
         std::cout << LOG_MARKER << ifname << ": bitrate set to " << bitrate << std::endl;
     }
@@ -274,16 +324,113 @@ static bool Netlink_SetTXQueueLen(nl_sock*& sock, rtnl_link*& link, const size_t
     return rc == 0;
 }
 
+static unsigned long long Netlink_GetRxPackets(rtnl_link*& link)
+{
+    if (!link)
+        return 0;
+
+    return rtnl_link_get_stat(link, RTNL_LINK_RX_PACKETS);
+}
+
+namespace {
+
+// Counts a frame's bits as a transmitter sends them: after five equal bits in a row comes one of the opposite level,
+// which itself counts towards the next run
+struct BitStuffer {
+    unsigned long long bits { 0 };
+    unsigned long long stuff { 0 };
+    int level { -1 };
+    int run { 0 };
+    bool stuffedLast { false }; // the last bit pushed got a stuff bit right after it
+
+    void Push(bool bit)
+    {
+        bits++;
+        run = (bit == level) ? run + 1 : 1;
+        level = bit;
+        stuffedLast = (run == 5);
+        if (stuffedLast) {
+            stuff++;
+            level = !bit;
+            run = 1;
+        }
+    }
+
+    void Push(uint32_t value, int width)
+    {
+        for (int shift = width - 1; shift >= 0; shift--)
+            Push((value >> shift) & 1);
+    }
+};
+
+// Classic CAN CRC-15, fed with the unstuffed bits from SOF to the end of the data field
+struct Crc15 {
+    uint16_t crc { 0 };
+    BitStuffer& stuffer;
+
+    void Push(uint32_t value, int width)
+    {
+        for (int shift = width - 1; shift >= 0; shift--) {
+            const bool bit = (value >> shift) & 1;
+            const bool feedback = bit ^ ((crc >> 14) & 1);
+            crc = (crc << 1) & 0x7FFF;
+            if (feedback)
+                crc ^= 0x4599;
+            stuffer.Push(bit);
+        }
+    }
+};
+
+}
+
+namespace {
+
+// Instances per interface name, several nodes may share one link and only the last one gone takes it down
+std::mutex s_linkUsersLock {};
+std::map<std::string, size_t> s_linkUsers {};
+
+size_t AddLinkUser(const std::string& ifaceName)
+{
+    std::scoped_lock lock(s_linkUsersLock);
+    return ++s_linkUsers[ifaceName];
+}
+
+size_t RemoveLinkUser(const std::string& ifaceName)
+{
+    std::scoped_lock lock(s_linkUsersLock);
+    const auto users = s_linkUsers.find(ifaceName);
+    if (users == s_linkUsers.end())
+        return 0;
+    if (--users->second > 0)
+        return users->second;
+    s_linkUsers.erase(users);
+    return 0;
+}
+
+size_t LinkUsers(const std::string& ifaceName)
+{
+    std::scoped_lock lock(s_linkUsersLock);
+    const auto users = s_linkUsers.find(ifaceName);
+    return (users != s_linkUsers.end()) ? users->second : 0;
+}
+
+}
+
 SocketCAN::SocketCAN(const std::string& ifaceName, const int bitrate)
     : m_ifaceName(ifaceName)
+    , m_busStats(std::make_unique<CanBusStats>())
     , m_bitrate(bitrate)
 {
+    m_busStats->SetBitrates(m_bitrate, m_dataBitrate);
+    AddLinkUser(m_ifaceName);
     // SetBitrate(m_bitrate);
 }
 
 SocketCAN::~SocketCAN()
 {
     Close();
+    if (RemoveLinkUser(m_ifaceName) > 0)
+        return;
 
     nl_sock* sock = nullptr;
     nl_cache* cache = nullptr;
@@ -311,7 +458,7 @@ bool SocketCAN::Open()
     Netlink_Connect(sock, cache);
     const auto ok = Netlink_GetInterface(sock, cache, link, m_ifaceName);
     if (ok) {
-        Netlink_CANSetBitrate(sock, link, m_bitrate);
+        Netlink_CANSetBitrate(sock, link, m_bitrate, m_dataBitrate);
         Netlink_SetTXQueueLen(sock, link, 1000);
         Netlink_BringUp(sock, link);
     }
@@ -364,6 +511,37 @@ bool SocketCAN::Open()
                 std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": failed to set socket TX timeout, error code "
                           << tempErrCode << std::endl;
             }
+            EnableFdFrames();
+            ApplyRxFilters();
+            EnableTimestamps();
+            if (m_txEcho)
+                EnableTxEcho();
+
+            // Anything left in the TX queue belongs to the previous session
+            m_txHead.store(m_txTail.load());
+            m_txHeap.clear();
+            m_txHeapDepth.store(0);
+            m_txInFlightHead = m_txInFlightTail;
+            m_txWaitWritable = false;
+
+            // Keep the kernel from building a FIFO backlog of its own, ordering is done in user space instead
+            if (m_txOrder == TxOrder::Priority) {
+                const int sndBuf = TxWindowBytes;
+                rc = setsockopt(m_socket, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+                if (rc != 0) {
+                    auto tempErrCode = errno;
+                    std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName
+                              << ": failed to shrink socket TX buffer, error code " << tempErrCode << std::endl;
+                }
+            }
+            m_txWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_txWakeFd < 0) {
+                auto tempErrCode = errno;
+                std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": failed to create TX wakeup, error code "
+                          << tempErrCode << std::endl;
+                m_txWakeFd = c_invalidSocket;
+            }
+
             std::cout << LOG_MARKER << m_ifaceName << ": ready!" << std::endl;
             return true;
         }
@@ -381,6 +559,11 @@ bool SocketCAN::Close()
         m_socket = c_invalidSocket;
     }
 
+    if (c_invalidSocket != m_txWakeFd) {
+        close(m_txWakeFd);
+        m_txWakeFd = c_invalidSocket;
+    }
+
     return true;
 }
 
@@ -389,19 +572,19 @@ bool SocketCAN::IsBusOff() const
     return m_busOff || m_txErrCnt > c_busOffThreshold;
 }
 
-bool SocketCAN::Send(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload& data)
+bool SocketCAN::Send(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload& data, uint8_t fdFlags)
+{
+    return Send(id, id29Bit, dlc, data.data(), fdFlags);
+}
+
+bool SocketCAN::Send(uint32_t id, bool id29Bit, uint8_t dlc, const uint8_t* data, uint8_t fdFlags)
 {
     bool result = false;
-    can_frame msg {};
+    canfd_frame msg {};
+    size_t mtu = CAN_MTU;
 
-    if ((c_invalidSocket != m_socket) && (dlc <= 8U) && !m_busOff) {
-        msg.can_id = id;
-        if (true == id29Bit) {
-            msg.can_id |= CAN_EFF_FLAG;
-        }
-        msg.can_dlc = dlc;
-        std::memcpy(msg.data, data.data(), dlc);
-        auto res = write(m_socket, &msg, sizeof(struct can_frame));
+    if ((c_invalidSocket != m_socket) && !m_busOff && BuildFrame(id, id29Bit, dlc, data, fdFlags, msg, mtu)) {
+        auto res = write(m_socket, &msg, mtu);
         if (res < 0) {
             auto tempErrCode = errno;
             std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": failed to write, error code " << tempErrCode
@@ -412,6 +595,7 @@ bool SocketCAN::Send(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload&
             }
         } else {
             m_txErrCnt = 0;
+            m_busStats->Record(CanBusStats::Direction::Tx, msg, mtu);
         }
         result = (res >= 0);
     }
@@ -419,12 +603,94 @@ bool SocketCAN::Send(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload&
     return result;
 }
 
+bool SocketCAN::Queue(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload& data, uint8_t fdFlags)
+{
+    return Queue(id, id29Bit, dlc, data.data(), fdFlags);
+}
+
+bool SocketCAN::Queue(uint32_t id, bool id29Bit, uint8_t dlc, const uint8_t* data, uint8_t fdFlags)
+{
+    if ((c_invalidSocket == m_socket) || m_busOff)
+        return false;
+
+    const auto tail = m_txTail.load(std::memory_order_relaxed);
+    const auto depth = tail - m_txHead.load(std::memory_order_acquire);
+    if (depth >= TxQueueSize) {
+        m_txDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Built in place, the payload is copied once from the caller's buffer into the queued frame
+    auto& entry = m_txQueue[tail % TxQueueSize];
+    if (!BuildFrame(id, id29Bit, dlc, data, fdFlags, entry.frame, entry.mtu))
+        return false;
+    entry.queuedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+                         .count();
+    entry.seq = tail;
+    entry.arbitrationKey = ArbitrationKey(entry.frame);
+    m_txTail.store(tail + 1);
+
+    m_txQueued.fetch_add(1, std::memory_order_relaxed);
+    const auto totalDepth = depth + 1 + m_txHeapDepth.load(std::memory_order_relaxed);
+    if (totalDepth > m_txHighWater.load(std::memory_order_relaxed))
+        m_txHighWater.store(totalDepth, std::memory_order_relaxed);
+
+    // One wakeup is enough until the polling thread gets around to flushing
+    if (!m_txWakePending.exchange(true) && m_txWakeFd != c_invalidSocket) {
+        const uint64_t one = 1;
+        [[maybe_unused]] const auto wr = write(m_txWakeFd, &one, sizeof(one));
+    }
+    return true;
+}
+
+SocketCAN::TxStats SocketCAN::TxStatistics() const
+{
+    TxStats stats {};
+    stats.queued = m_txQueued.load(std::memory_order_relaxed);
+    stats.sent = m_txSent.load(std::memory_order_relaxed);
+    stats.dropped = m_txDropped.load(std::memory_order_relaxed);
+    stats.failed = m_txFailed.load(std::memory_order_relaxed);
+    stats.retries = m_txRetries.load(std::memory_order_relaxed);
+    stats.syscalls = m_txSyscalls.load(std::memory_order_relaxed);
+    stats.echoes = m_txEchoes.load(std::memory_order_relaxed);
+    stats.unmatched = m_txUnmatched.load(std::memory_order_relaxed);
+    stats.depth = m_txTail.load() - m_txHead.load() + m_txHeapDepth.load(std::memory_order_relaxed);
+    stats.highWater = m_txHighWater.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void SocketCAN::SetTxOrder(TxOrder order)
+{
+    // Applied on the next Open(), as the socket window depends on it
+    m_txOrder = order;
+    if (order == TxOrder::Priority)
+        m_txHeap.reserve(TxQueueSize);
+}
+
+void SocketCAN::SetTxCallback(const OnTxCallback& txClbkFunc)
+{
+    m_txClbkFunc = txClbkFunc;
+}
+
+void SocketCAN::SetTxEcho(bool enable, const OnTxEchoCallback& echoClbkFunc)
+{
+    // Applied on the next Open(), only frames going through Queue() can be matched to their echo
+    m_txEcho = enable;
+    m_txEchoClbkFunc = echoClbkFunc;
+}
+
+void SocketCAN::SetErrorFrameCallback(const OnErrorFrameCallback& errClbkFunc)
+{
+    m_errClbkFunc = errClbkFunc;
+}
+
 bool SocketCAN::Receive(uint32_t& id, bool& id29Bit, uint8_t& dlc, FramePayload& data)
 {
     timeval timeout;
     int ret;
     fd_set rfds;
-    can_frame frame;
+    canfd_frame frame;
 
     timeout.tv_sec = 0;
     timeout.tv_usec = 100;
@@ -450,24 +716,21 @@ bool SocketCAN::Receive(uint32_t& id, bool& id29Bit, uint8_t& dlc, FramePayload&
         return false;
     }
 
+    // Classic frames come back CAN_MTU long even from an FD socket
     auto bytesRead = read(m_socket, &frame, sizeof(frame));
-    if (bytesRead == sizeof(frame)) {
+    if (bytesRead == CAN_MTU || bytesRead == CANFD_MTU) {
         id29Bit = ((frame.can_id & CAN_EFF_FLAG) > 0);
-        UpdateStats(frame.can_dlc, bytesRead, id29Bit);
         const bool error = frame.can_id & CAN_ERR_FLAG;
         id = frame.can_id & (id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK);
         if (!error) {
-            dlc = frame.can_dlc;
+            m_busStats->Record(CanBusStats::Direction::Rx, frame, bytesRead);
+            dlc = std::min<uint8_t>(frame.len, MaxFramePayloadLen);
             std::memcpy(data.data(), frame.data, dlc);
             m_txErrCnt = 0;
             m_busOff = false;
             return true;
         } else {
-            std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": frame error!\n"
-                      << TranslateErrorFrame(frame) << std::endl;
-            m_busOff = ((frame.can_id & CAN_ERR_BUSOFF)
-                || ((frame.can_id & CAN_ERR_CRTL)
-                    && (frame.data[1] & (CAN_ERR_CRTL_TX_PASSIVE | CAN_ERR_CRTL_RX_PASSIVE))));
+            HandleErrorFrame(frame);
         }
     } else if (bytesRead < 0) {
         auto tempErrCode = errno;
@@ -481,19 +744,207 @@ bool SocketCAN::Receive(uint32_t& id, bool& id29Bit, uint8_t& dlc, FramePayload&
 bool SocketCAN::Poll(const OnDataRXCallback& rxClbkFunc)
 {
     int tempErrCode = 0;
+    int epollFd = OpenPollingFd();
+    if (epollFd == c_invalidSocket)
+        return false;
+
+    std::array<struct epoll_event, 30> events {};
+    bool txBacklog = false;
+    while (!m_stopPolling.load()) {
+        int activeFds = epoll_wait(epollFd, events.data(), events.size(), txBacklog ? 1 : 5);
+        m_rxSyscalls.fetch_add(1, std::memory_order_relaxed);
+        if (activeFds == -1) {
+            tempErrCode = errno;
+            continue;
+        }
+
+        for (size_t idx = 0; idx < activeFds && idx < events.size(); idx++) {
+            if (events[idx].data.fd == m_txWakeFd)
+                HandleTxWake();
+            if (events[idx].data.fd != m_socket || !(events[idx].events & EPOLLIN))
+                continue;
+
+            m_rxWakeups.fetch_add(1, std::memory_order_relaxed);
+            struct canfd_frame rxFrame { };
+            struct iovec iov { &rxFrame, sizeof(rxFrame) };
+            alignas(struct cmsghdr) std::array<char, RxControlSize> control {};
+            struct msghdr msg { };
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            auto rxBytes = recvmsg(m_socket, &msg, 0);
+            m_rxSyscalls.fetch_add(1, std::memory_order_relaxed);
+            if (rxBytes == -1) {
+                tempErrCode = errno;
+                continue;
+            }
+
+            // Our own frame coming back from the bus, not something to hand over to the stack
+            if (msg.msg_flags & MSG_CONFIRM) {
+                if (rxBytes == CAN_MTU || rxBytes == CANFD_MTU)
+                    HandleTxEcho(rxFrame, msg, std::chrono::system_clock::now(), std::chrono::steady_clock::now());
+                continue;
+            }
+
+            RxFrame frame {};
+            if (DecodeFrame(rxFrame, rxBytes, frame)) {
+                const auto steadyNow = std::chrono::steady_clock::now();
+                frame.timestamp = steadyNow;
+                if (KernelTimestamp(msg, std::chrono::system_clock::now(), steadyNow, frame.timestamp))
+                    m_rxKernelTimestamps.fetch_add(1, std::memory_order_relaxed);
+                rxClbkFunc(frame);
+            }
+        }
+        txBacklog = FlushTx(epollFd);
+    }
+
+    close(epollFd);
+    return tempErrCode == 0;
+}
+
+bool SocketCAN::PollBatch(const OnBatchRXCallback& rxClbkFunc)
+{
+    // Frames get copied out of the receive buffers into RxFrames, those only have to last for the callback
+    struct CallbackSink {
+        const OnBatchRXCallback& callback;
+        std::array<struct canfd_frame, RxBatchSize> rawFrames {};
+        std::array<RxFrame, RxBatchSize> frames {};
+        size_t count { 0 };
+
+        size_t Reserve(canfd_frame** buffers, size_t max)
+        {
+            for (size_t idx = 0; idx < max; idx++)
+                buffers[idx] = &rawFrames[idx];
+            return max;
+        }
+
+        void Accept(size_t idx, const RxFrameInfo& info)
+        {
+            auto& frame = frames[count++];
+            frame.id = info.id;
+            frame.id29Bit = info.id29Bit;
+            frame.dlc = info.dlc;
+            frame.fdFlags = info.fdFlags;
+            frame.timestamp = info.timestamp;
+            const auto& data = rawFrames[idx].data;
+            std::copy(data, data + info.dlc, frame.data.begin());
+        }
+
+        void Discard(size_t) { }
+
+        void Publish(size_t)
+        {
+            if (count > 0)
+                callback(frames.data(), count);
+            count = 0;
+        }
+    };
+
+    CallbackSink sink { rxClbkFunc };
+    return PollInto(sink);
+}
+
+SocketCAN::RxStats SocketCAN::RxStatistics() const
+{
+    RxStats stats {};
+    stats.wakeups = m_rxWakeups.load(std::memory_order_relaxed);
+    stats.syscalls = m_rxSyscalls.load(std::memory_order_relaxed);
+    stats.frames = m_rxFrames.load(std::memory_order_relaxed);
+    stats.kernelTimestamps = m_rxKernelTimestamps.load(std::memory_order_relaxed);
+    stats.fdFrames = m_rxFdFrames.load(std::memory_order_relaxed);
+
+    struct timespec cpuTime { };
+    if (m_pollCpuClockValid.load() && clock_gettime(m_pollCpuClock.load(), &cpuTime) == 0)
+        stats.pollCpuNs = cpuTime.tv_sec * 1000000000ULL + cpuTime.tv_nsec;
+    return stats;
+}
+
+bool SocketCAN::SetRxFilters(const std::vector<RxFilter>& filters)
+{
+    if (filters == m_rxFilters)
+        return true;
+
+    m_rxFilters = filters;
+    return ApplyRxFilters();
+}
+
+SocketCAN::RxFilterStats SocketCAN::RxFilterStatistics() const
+{
+    RxFilterStats stats {};
+    stats.filters = m_rxFilters.size();
+
+    // Interface counters only move forward, unless the driver gets reloaded under our feet
+    const auto ifaceFrames = InterfaceRxFrames();
+    const auto delivered = m_rxFrames.load(std::memory_order_relaxed);
+    stats.ifaceFrames = (ifaceFrames > m_filterBaseIfaceFrames) ? ifaceFrames - m_filterBaseIfaceFrames : 0;
+    stats.delivered = delivered - m_filterBaseDelivered;
+    stats.dropped = (stats.ifaceFrames > stats.delivered) ? stats.ifaceFrames - stats.delivered : 0;
+    return stats;
+}
+
+bool SocketCAN::ApplyRxFilters()
+{
+    m_filterBaseIfaceFrames = InterfaceRxFrames();
+    m_filterBaseDelivered = m_rxFrames.load(std::memory_order_relaxed);
     if (m_socket == c_invalidSocket)
+        return true;
+
+    // No filters means no filtering at all, not an empty receive set
+    std::vector<can_filter> rawFilters {};
+    for (const auto& filter : m_rxFilters) {
+        can_filter rawFilter {};
+        rawFilter.can_id = filter.id | (filter.id29Bit ? CAN_EFF_FLAG : 0);
+        rawFilter.can_mask = (filter.id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK) | CAN_EFF_FLAG;
+        rawFilters.push_back(rawFilter);
+    }
+    if (rawFilters.empty())
+        rawFilters.push_back({ 0, 0 });
+
+    const auto rc = setsockopt(
+        m_socket, SOL_CAN_RAW, CAN_RAW_FILTER, rawFilters.data(), rawFilters.size() * sizeof(can_filter));
+    if (rc != 0) {
+        auto tempErrCode = errno;
+        std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": failed to set receive filter, error code "
+                  << tempErrCode << std::endl;
         return false;
+    }
+
+    std::cout << LOG_MARKER << m_ifaceName << ": receive filter set, "
+              << (m_rxFilters.empty() ? "accepting everything" : std::to_string(m_rxFilters.size()) + " identifiers")
+              << std::endl;
+    return true;
+}
+
+unsigned long long SocketCAN::InterfaceRxFrames() const
+{
+    nl_sock* sock = nullptr;
+    nl_cache* cache = nullptr;
+    rtnl_link* link = nullptr;
+    unsigned long long frames = 0;
+
+    Netlink_Connect(sock, cache);
+    if (Netlink_GetInterface(sock, cache, link, m_ifaceName))
+        frames = Netlink_GetRxPackets(link);
+    Netlink_DisposeInterface(link);
+    Netlink_Dispose(sock, cache);
+    return frames;
+}
+
+int SocketCAN::OpenPollingFd()
+{
+    int tempErrCode = 0;
+    if (m_socket == c_invalidSocket)
+        return c_invalidSocket;
 
     int epollFd = epoll_create1(0);
     if (epollFd == c_invalidSocket) {
         tempErrCode = errno;
         std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName
                   << ": failed to allocate polling file descriptor, error code " << tempErrCode << std::endl;
-        return false;
+        return c_invalidSocket;
     }
 
-    std::array<struct epoll_event, 30> events {};
-
     struct epoll_event ev { };
     ev.events = EPOLLIN;
     ev.data.fd = m_socket;
@@ -502,57 +953,332 @@ bool SocketCAN::Poll(const OnDataRXCallback& rxClbkFunc)
         std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName
                   << ": failed to configure polling file descriptor, error code " << tempErrCode << std::endl;
         close(epollFd);
-        return false;
+        return c_invalidSocket;
     }
 
-    m_stopPolling.store(false);
-    while (!m_stopPolling.load()) {
-        int activeFds = epoll_wait(epollFd, events.data(), events.size(), 5);
-        if (activeFds == -1) {
+    if (m_txWakeFd != c_invalidSocket) {
+        ev.events = EPOLLIN;
+        ev.data.fd = m_txWakeFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, m_txWakeFd, &ev) == -1) {
             tempErrCode = errno;
-            continue;
+            std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": failed to poll TX wakeups, error code "
+                      << tempErrCode << std::endl;
         }
+    }
+    m_txWaitWritable = false;
 
-        for (size_t idx = 0; idx < activeFds && idx < events.size(); idx++) {
-            if (events[idx].data.fd != m_socket)
-                continue;
+    // CPU time of the polling thread can then be sampled from any other thread
+    clockid_t cpuClock {};
+    if (pthread_getcpuclockid(pthread_self(), &cpuClock) == 0) {
+        m_pollCpuClock.store(cpuClock);
+        m_pollCpuClockValid.store(true);
+    }
 
-            struct can_frame rxFrame { };
-            auto rxBytes = read(m_socket, &rxFrame, sizeof(rxFrame));
-            if (rxBytes == -1) {
-                tempErrCode = errno;
-                continue;
-            }
+    m_stopPolling.store(false);
+    return epollFd;
+}
 
-            if (rxBytes != sizeof(rxFrame)) // incomplete frame!
-                continue;
+bool SocketCAN::HandleTxWake()
+{
+    uint64_t posted = 0;
+    const auto rd = read(m_txWakeFd, &posted, sizeof(posted));
+    m_txSyscalls.fetch_add(1, std::memory_order_relaxed);
+    m_txWakePending.store(false);
+    return rd == sizeof(posted);
+}
 
-            const bool error = rxFrame.can_id & CAN_ERR_FLAG;
-            const bool id29Bit = rxFrame.can_id & CAN_EFF_FLAG;
+bool SocketCAN::FlushTx(int epollFd)
+{
+    bool backlog = false;
+    bool waitWritable = false;
+    std::array<TxEntry, TxBatchSize> batch {};
+    std::array<struct iovec, TxBatchSize> iovecs {};
+    std::array<struct mmsghdr, TxBatchSize> msgs {};
+    const bool priority = (m_txOrder == TxOrder::Priority);
+
+    while (true) {
+        // Priority order pulls everything into the heap first, so a late low ID still overtakes what's waiting
+        const auto head = m_txHead.load(std::memory_order_relaxed);
+        auto pending = m_txTail.load() - head;
+        if (priority) {
+            const auto room = TxQueueSize - m_txHeap.size();
+            const auto moved = std::min(pending, room);
+            for (size_t idx = 0; idx < moved; idx++) {
+                m_txHeap.push_back(m_txQueue[(head + idx) % TxQueueSize]);
+                std::push_heap(m_txHeap.begin(), m_txHeap.end(), TxEntryLater);
+            }
+            m_txHead.store(head + moved, std::memory_order_release);
+            pending = m_txHeap.size();
+        }
+        if (pending == 0)
+            break;
 
-            UpdateStats(rxFrame.can_dlc, rxBytes, id29Bit);
-            if (!error) {
-                FramePayload data {};
-                std::copy(rxFrame.data, rxFrame.data + CAN_MAX_DLEN, data.begin());
-                rxClbkFunc(rxFrame.can_id & (id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK), id29Bit, rxFrame.can_dlc, data);
-                m_busOff = false;
+        const auto count = std::min(pending, TxBatchSize);
+        for (size_t idx = 0; idx < count; idx++) {
+            if (priority) {
+                std::pop_heap(m_txHeap.begin(), m_txHeap.end(), TxEntryLater);
+                batch[idx] = m_txHeap.back();
+                m_txHeap.pop_back();
             } else {
-                std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": frame error!\n"
-                          << TranslateErrorFrame(rxFrame) << std::endl;
-                m_busOff = ((rxFrame.can_id & CAN_ERR_BUSOFF)
-                    || ((rxFrame.can_id & CAN_ERR_CRTL)
-                        && (rxFrame.data[1] & (CAN_ERR_CRTL_TX_PASSIVE | CAN_ERR_CRTL_RX_PASSIVE))));
+                batch[idx] = m_txQueue[(head + idx) % TxQueueSize];
             }
+            iovecs[idx].iov_base = &batch[idx].frame;
+            iovecs[idx].iov_len = batch[idx].mtu;
+            msgs[idx] = {};
+            msgs[idx].msg_hdr.msg_iov = &iovecs[idx];
+            msgs[idx].msg_hdr.msg_iovlen = 1;
+        }
+
+        auto sent = sendmmsg(m_socket, msgs.data(), count, MSG_DONTWAIT);
+        m_txSyscalls.fetch_add(1, std::memory_order_relaxed);
+        bool failed = false;
+        if (sent < 0) {
+            const auto tempErrCode = errno;
+            if (tempErrCode == EAGAIN || tempErrCode == EWOULDBLOCK) {
+                // Socket buffer full, EPOLLOUT tells when there's room again
+                m_txRetries.fetch_add(1, std::memory_order_relaxed);
+                waitWritable = true;
+            } else if (tempErrCode == ENOBUFS) {
+                // Device queue full, the socket still looks writable: just retry on a short poll timeout
+                m_txRetries.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": failed to write, error code "
+                          << tempErrCode << std::endl;
+                m_txFailed.fetch_add(1, std::memory_order_relaxed);
+                failed = true;
+            }
+            sent = 0;
+        }
+
+        // Whatever didn't make it goes back where it came from, a failed frame is skipped
+        const size_t consumed = sent + (failed ? 1 : 0);
+        if (priority) {
+            for (size_t idx = consumed; idx < count; idx++) {
+                m_txHeap.push_back(batch[idx]);
+                std::push_heap(m_txHeap.begin(), m_txHeap.end(), TxEntryLater);
+            }
+        } else {
+            m_txHead.store(head + consumed, std::memory_order_release);
+        }
+        m_txHeapDepth.store(m_txHeap.size(), std::memory_order_relaxed);
+        m_txSent.fetch_add(sent, std::memory_order_relaxed);
+        for (int idx = 0; idx < sent; idx++)
+            m_busStats->Record(CanBusStats::Direction::Tx, batch[idx].frame, batch[idx].mtu);
+        if (m_txEcho) {
+            for (int idx = 0; idx < sent; idx++)
+                TrackInFlight(batch[idx]);
+        }
+
+        if (m_txClbkFunc && sent > 0) {
+            const auto nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                                   .count();
+            for (int idx = 0; idx < sent; idx++) {
+                const auto& frame = batch[idx].frame;
+                const bool id29Bit = frame.can_id & CAN_EFF_FLAG;
+                m_txClbkFunc(frame.can_id & (id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK), id29Bit,
+                    nowNs - batch[idx].queuedNs);
+            }
+        }
+
+        if (failed)
+            continue;
+        if (static_cast<size_t>(sent) < count) {
+            backlog = true;
+            waitWritable |= (sent > 0);
+            break;
         }
     }
-    return tempErrCode == 0;
+
+    if (waitWritable != m_txWaitWritable) {
+        struct epoll_event ev { };
+        ev.events = waitWritable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        ev.data.fd = m_socket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, m_socket, &ev) == 0)
+            m_txWaitWritable = waitWritable;
+    }
+    return backlog;
+}
+
+uint64_t SocketCAN::ArbitrationKey(const canfd_frame& frame)
+{
+    // Bits in the order they go on the wire, 0 is dominant: base ID, SRR/RTR, IDE, extended ID, RTR. FD frames carry
+    // a dominant RRS where the RTR bit would be, so they arbitrate like classic data frames.
+    const bool rtr = frame.can_id & CAN_RTR_FLAG;
+    if (frame.can_id & CAN_EFF_FLAG) {
+        const uint64_t id = frame.can_id & CAN_EFF_MASK;
+        return ((id >> 18) << 21) | (1ULL << 20) | (1ULL << 19) | ((id & 0x3FFFF) << 1) | (rtr ? 1 : 0);
+    }
+
+    const uint64_t id = frame.can_id & CAN_SFF_MASK;
+    return (id << 21) | (rtr ? (1ULL << 20) : 0);
+}
+
+bool SocketCAN::TxEntryLater(const TxEntry& lhs, const TxEntry& rhs)
+{
+    // Max-heap comparator, so "less" means "leaves later"; same ID keeps the queuing order
+    if (lhs.arbitrationKey != rhs.arbitrationKey)
+        return lhs.arbitrationKey > rhs.arbitrationKey;
+    return lhs.seq > rhs.seq;
+}
+
+void SocketCAN::EnableTimestamps()
+{
+    // Software RX timestamps are taken when the driver hands the frame to the stack, so they leave out the epoll,
+    // scheduling and callback delays. Hardware ones are requested too, but only software ones are used later on.
+    const int tsFlags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE
+        | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (setsockopt(m_socket, SOL_SOCKET, SO_TIMESTAMPING, &tsFlags, sizeof(tsFlags)) == 0)
+        return;
+
+    const int enable = 1;
+    if (setsockopt(m_socket, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) != 0) {
+        auto tempErrCode = errno;
+        std::cerr << "W: " << LOG_MARKER << m_ifaceName << ": no kernel RX timestamps, error code " << tempErrCode
+                  << std::endl;
+    }
+}
+
+void SocketCAN::EnableTxEcho()
+{
+    // Loopback is on by default, this additionally delivers the echo to the sending socket, flagged with MSG_CONFIRM.
+    // Drivers with IFF_ECHO generate it on TX completion, so its receive timestamp is when the frame left the wire.
+    const int enable = 1;
+    if (setsockopt(m_socket, SOL_CAN_RAW, CAN_RAW_LOOPBACK, &enable, sizeof(enable)) != 0
+        || setsockopt(m_socket, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &enable, sizeof(enable)) != 0) {
+        auto tempErrCode = errno;
+        std::cerr << "W: " << LOG_MARKER << m_ifaceName << ": no TX echo, error code " << tempErrCode << std::endl;
+    }
+}
+
+void SocketCAN::TrackInFlight(const TxEntry& entry)
+{
+    // Echoes that never came back must not block the ones that do, the oldest gets written off
+    if (m_txInFlightTail - m_txInFlightHead >= TxQueueSize) {
+        m_txInFlightHead++;
+        m_txUnmatched.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_txInFlight[m_txInFlightTail % TxQueueSize] = { entry.frame.can_id, entry.queuedNs };
+    m_txInFlightTail++;
+}
+
+void SocketCAN::HandleTxEcho(const canfd_frame& rawFrame, const struct msghdr& msg,
+    const std::chrono::system_clock::time_point& realNow, const RxTimestamp& steadyNow)
+{
+    // Echoes come back in the order the frames went out, whatever is older than the match was lost on the way
+    size_t match = m_txInFlightHead;
+    while (match != m_txInFlightTail && m_txInFlight[match % TxQueueSize].canId != rawFrame.can_id)
+        match++;
+    if (match == m_txInFlightTail) {
+        // Not sent through the queue, e.g. a direct Send()
+        m_txUnmatched.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    const auto entry = m_txInFlight[match % TxQueueSize];
+    m_txUnmatched.fetch_add(match - m_txInFlightHead, std::memory_order_relaxed);
+    m_txInFlightHead = match + 1;
+    m_txEchoes.fetch_add(1, std::memory_order_relaxed);
+    if (!m_txEchoClbkFunc)
+        return;
+
+    auto wireTime = steadyNow;
+    KernelTimestamp(msg, realNow, steadyNow, wireTime);
+    const auto wireNs = static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(wireTime.time_since_epoch()).count());
+    const bool id29Bit = rawFrame.can_id & CAN_EFF_FLAG;
+    m_txEchoClbkFunc(rawFrame.can_id & (id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK), id29Bit,
+        (wireNs > entry.queuedNs) ? wireNs - entry.queuedNs : 0, wireTime);
+}
+
+bool SocketCAN::KernelTimestamp(const struct msghdr& msg, const std::chrono::system_clock::time_point& realNow,
+    const RxTimestamp& steadyNow, RxTimestamp& output)
+{
+    const struct timespec* kernelTs = nullptr;
+    auto& hdr = const_cast<struct msghdr&>(msg);
+    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            const auto tss = reinterpret_cast<const struct scm_timestamping*>(CMSG_DATA(cmsg));
+            if (tss->ts[0].tv_sec != 0 || tss->ts[0].tv_nsec != 0)
+                kernelTs = &tss->ts[0];
+        } else if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            kernelTs = reinterpret_cast<const struct timespec*>(CMSG_DATA(cmsg));
+        }
+    }
+    if (!kernelTs)
+        return false;
+
+    // Kernel stamps with CLOCK_REALTIME: measure how long ago that was, then step back from the steady "now"
+    using namespace std::chrono;
+    const auto kernelSinceEpoch = seconds(kernelTs->tv_sec) + nanoseconds(kernelTs->tv_nsec);
+    const auto kernelReal = system_clock::time_point(duration_cast<system_clock::duration>(kernelSinceEpoch));
+    const auto age = realNow - kernelReal;
+    output = (age.count() > 0) ? steadyNow - duration_cast<RxTimestamp::duration>(age) : steadyNow;
+    return true;
 }
 
-int SocketCAN::BusLoad()
+bool SocketCAN::ParseFrame(const canfd_frame& rawFrame, size_t rxBytes, RxFrameInfo& output)
 {
-    int load = m_stats.Load(m_bitrate);
-    m_stats.Reset();
-    return load;
+    if (rxBytes != CAN_MTU && rxBytes != CANFD_MTU) // incomplete frame!
+        return false;
+    if (rawFrame.can_id & CAN_ERR_FLAG)
+        return false;
+
+    const bool fd = (rxBytes == CANFD_MTU);
+    output.id29Bit = rawFrame.can_id & CAN_EFF_FLAG;
+    output.id = rawFrame.can_id & (output.id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK);
+    output.dlc = std::min<uint8_t>(rawFrame.len, fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+    output.fdFlags = 0;
+    if (fd) {
+        output.fdFlags = FdFrame | ((rawFrame.flags & CANFD_BRS) ? FdBitRateSwitch : 0)
+            | ((rawFrame.flags & CANFD_ESI) ? FdErrorPassive : 0);
+    }
+    return true;
+}
+
+bool SocketCAN::DecodeHeader(const canfd_frame& rawFrame, size_t rxBytes, RxFrameInfo& output)
+{
+    if (rxBytes != CAN_MTU && rxBytes != CANFD_MTU) // incomplete frame!
+        return false;
+
+    if (!ParseFrame(rawFrame, rxBytes, output)) {
+        HandleErrorFrame(rawFrame);
+        return false;
+    }
+
+    m_busStats->Record(CanBusStats::Direction::Rx, rawFrame, rxBytes);
+    if (rxBytes == CANFD_MTU)
+        m_rxFdFrames.fetch_add(1, std::memory_order_relaxed);
+    m_rxFrames.fetch_add(1, std::memory_order_relaxed);
+    m_busOff = false;
+    return true;
+}
+
+bool SocketCAN::DecodeFrame(const canfd_frame& rawFrame, size_t rxBytes, RxFrame& output)
+{
+    RxFrameInfo info {};
+    if (!DecodeHeader(rawFrame, rxBytes, info))
+        return false;
+
+    output.id = info.id;
+    output.id29Bit = info.id29Bit;
+    output.dlc = info.dlc;
+    output.fdFlags = info.fdFlags;
+    std::copy(rawFrame.data, rawFrame.data + info.dlc, output.data.begin());
+    return true;
+}
+
+int SocketCAN::BusLoad() const
+{
+    return static_cast<int>(m_busStats->Load(0));
+}
+
+const CanBusStats& SocketCAN::BusStatistics() const
+{
+    return *m_busStats;
 }
 
 bool SocketCAN::SetBitrate(const int bitrate)
@@ -564,52 +1290,198 @@ bool SocketCAN::SetBitrate(const int bitrate)
 
     ok &= Netlink_Connect(sock, cache);
     ok &= Netlink_GetInterface(sock, cache, link, m_ifaceName);
-    ok &= Netlink_BringDown(sock, link);
-    ok &= Netlink_CANSetBitrate(sock, link, m_bitrate);
+
+    // The link is shared with every other instance on the interface: only take it down when it has to change
+    if (ok && !Netlink_CANBitrateMatches(link, bitrate, m_dataBitrate)) {
+        if (LinkUsers(m_ifaceName) > 1) {
+            std::cerr << "W: " << LOG_MARKER << m_ifaceName << ": reprogramming the link to " << bitrate
+                      << " bps under the other instances using it" << std::endl;
+        }
+        ok &= Netlink_BringDown(sock, link);
+        ok &= Netlink_CANSetBitrate(sock, link, bitrate, m_dataBitrate);
+    }
     ok &= Netlink_SetTXQueueLen(sock, link, 1000);
     Netlink_DisposeInterface(link);
     Netlink_Dispose(sock, cache);
 
-    if (ok)
+    if (ok) {
         m_bitrate = bitrate;
+        m_busStats->SetBitrates(m_bitrate, m_dataBitrate);
+    }
 
     return ok;
 }
 
-int SocketCAN::BusStats::Load(const int ifaceBitrate) const
+void SocketCAN::SetDataBitrate(const int dataBitrate)
 {
-    using namespace std::chrono;
-    const auto msTimeDiff = duration_cast<milliseconds>(steady_clock::now() - lastStat).count();
-    if (msTimeDiff <= 0)
-        return 0;
+    // Applied on the next Open(), together with the nominal one
+    m_dataBitrate = std::max(dataBitrate, 0);
+    m_busStats->SetBitrates(m_bitrate, m_dataBitrate);
+}
 
-    const auto msBitrate = ifaceBitrate / 1000.;
-    const auto maxXferBits = msBitrate * msTimeDiff;
-    if (maxXferBits <= 0)
-        return 0;
+uint8_t SocketCAN::FdPaddedLength(uint8_t len)
+{
+    // FD DLCs above 8 stand for 12, 16, 20, 24, 32, 48 and 64 bytes, anything in between is rounded up
+    static constexpr std::array<uint8_t, 7> FdLengths { 12, 16, 20, 24, 32, 48, 64 };
+    if (len <= CAN_MAX_DLEN)
+        return len;
+    for (const auto fdLen : FdLengths) {
+        if (len <= fdLen)
+            return fdLen;
+    }
+    return 0;
+}
 
-    return rxBitsTotal * 100 / maxXferBits;
+bool SocketCAN::BuildFrame(uint32_t id, bool id29Bit, uint8_t dlc, const uint8_t* data, uint8_t fdFlags,
+    canfd_frame& output, size_t& mtu)
+{
+    const bool fd = (fdFlags & (FdFrame | FdBitRateSwitch)) || dlc > CAN_MAX_DLEN;
+    if (fd && (!m_fdActive || dlc > CANFD_MAX_DLEN))
+        return false;
+    if (!fd && dlc > CAN_MAX_DLEN)
+        return false;
+
+    // Padding bytes go out as zeroes
+    output = {};
+    output.can_id = id;
+    if (id29Bit)
+        output.can_id |= CAN_EFF_FLAG;
+    output.len = fd ? FdPaddedLength(dlc) : dlc;
+    std::memcpy(output.data, data, dlc);
+    if (fd) {
+        // ESI is the controller's business, it never gets set from here
+        output.flags = CANFD_FDF | ((fdFlags & FdBitRateSwitch) ? CANFD_BRS : 0);
+    }
+    mtu = fd ? CANFD_MTU : CAN_MTU;
+    return true;
 }
 
-void SocketCAN::BusStats::Reset()
+void SocketCAN::EnableFdFrames()
 {
-    rxCount = 0;
-    rxBitsTotal = 0;
-    rxBitsPayload = 0;
-    lastStat = std::chrono::steady_clock::now();
+    m_fdActive = false;
+    if (m_dataBitrate <= 0)
+        return;
+
+    // Controllers without FD keep CAN_MTU, and the socket would then refuse every FD frame anyway
+    struct ifreq ifr { };
+    std::strncpy(ifr.ifr_name, m_ifaceName.c_str(), IFNAMSIZ - 1);
+    if (ioctl(m_socket, SIOCGIFMTU, &ifr) < 0 || ifr.ifr_mtu != static_cast<int>(CANFD_MTU)) {
+        std::cerr << "W: " << LOG_MARKER << m_ifaceName << ": interface isn't CAN FD capable, staying classic"
+                  << std::endl;
+        return;
+    }
+
+    const int enable = 1;
+    if (setsockopt(m_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable)) != 0) {
+        auto tempErrCode = errno;
+        std::cerr << "W: " << LOG_MARKER << m_ifaceName << ": failed to enable FD frames, error code " << tempErrCode
+                  << std::endl;
+        return;
+    }
+    m_fdActive = true;
 }
 
-unsigned long long SocketCAN::FrameBitLength(const bool id29Bit, const uint8_t dlc, const size_t mtu)
+SocketCAN::FrameBits SocketCAN::FrameBitLength(const bool id29Bit, const uint8_t dlc, const size_t mtu)
 {
     // Adapted from https://github.com/linux-can/can-utils/blob/master/canframelen.c, picked WORSTCASE mode
-    if (mtu == CANFD_MTU)
-        return (1 + (id29Bit ? 29 : 11) + ((dlc >= 16) ? 21 : 17)
-                   + 5 /* r1, ide, edl, r0, brs/crcdel, */ + 12 /* trail */ + dlc * 8)
-            * 5 / 4;
-    else if (mtu != CAN_MTU)
-        return 0; /* Only CAN2.0 and CANFD supported now */
+    FrameBits bits {};
+    if (mtu == CANFD_MTU) {
+        // Arbitration phase: SOF, ID (plus SRR, IDE and extension), RRS, IDE, FDF, res and BRS, dynamically stuffed;
+        // then CRC delimiter, ACK, ACK delimiter, EOF and IFS once switched back. Data phase: ESI, DLC and payload,
+        // dynamically stuffed, then stuff count and CRC with a fixed stuff bit every 4 bits.
+        bits.arbitration = (id29Bit ? 1 + 11 + 2 + 18 + 4 : 1 + 11 + 5) * 5 / 4 + 13;
+        bits.data = (1 + 4 + dlc * 8) * 5 / 4 + ((dlc > 16) ? 4 + 21 + 7 : 4 + 17 + 6);
+        return bits;
+    } else if (mtu != CAN_MTU) {
+        return bits; /* Only CAN2.0 and CANFD supported now */
+    }
 
-    return (id29Bit ? 80 : 55) + dlc * 10;
+    bits.arbitration = (id29Bit ? 80 : 55) + dlc * 10;
+    return bits;
+}
+
+SocketCAN::FrameBits SocketCAN::StuffedFrameBitLength(const canfd_frame& frame, const size_t mtu)
+{
+    // CRC delimiter, ACK slot, ACK delimiter, EOF and IFS, never stuffed and always at the nominal bitrate
+    static constexpr unsigned long long TrailerBits { 1 + 1 + 1 + 7 + 3 };
+
+    FrameBits bits {};
+    const bool id29Bit = frame.can_id & CAN_EFF_FLAG;
+    const uint32_t id = frame.can_id & (id29Bit ? CAN_EFF_MASK : CAN_SFF_MASK);
+    BitStuffer stuffer {};
+
+    if (mtu == CAN_MTU) {
+        // SOF, identifier, RTR, IDE and r0 (SRR, IDE, r1 in between for extended ones), DLC, data and CRC, all stuffed
+        const bool rtr = frame.can_id & CAN_RTR_FLAG;
+        const uint8_t len = std::min<uint8_t>(frame.len, CAN_MAX_DLEN);
+        Crc15 crc { 0, stuffer };
+        crc.Push(0, 1);
+        if (id29Bit) {
+            crc.Push(id >> 18, 11);
+            crc.Push(0b11, 2);
+            crc.Push(id & 0x3FFFF, 18);
+            crc.Push(rtr ? 0b100 : 0b000, 3);
+        } else {
+            crc.Push(id, 11);
+            crc.Push(rtr ? 0b100 : 0b000, 3);
+        }
+        crc.Push(len, 4);
+        for (uint8_t idx = 0; idx < len && !rtr; idx++)
+            crc.Push(frame.data[idx], 8);
+        stuffer.Push(crc.crc, 15);
+
+        bits.arbitration = stuffer.bits + stuffer.stuff + TrailerBits;
+        bits.stuff = stuffer.stuff;
+        return bits;
+    } else if (mtu != CANFD_MTU) {
+        return bits; /* Only CAN2.0 and CANFD supported now */
+    }
+
+    // Dynamically stuffed from SOF to the end of the data field; ESI onwards goes at the data bitrate once switched.
+    // Stuff count and CRC come with a fixed stuff bit ahead of every 4 bits instead, whatever the CRC turns out to be.
+    static constexpr std::array<uint8_t, 16> FdDlcLengths { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+    const uint8_t len = FdPaddedLength(std::min<uint8_t>(frame.len, CANFD_MAX_DLEN));
+    const auto dlcCode = std::find(FdDlcLengths.begin(), FdDlcLengths.end(), len) - FdDlcLengths.begin();
+    const bool brs = frame.flags & CANFD_BRS;
+    stuffer.Push(0, 1);
+    if (id29Bit) {
+        stuffer.Push(id >> 18, 11);
+        stuffer.Push(0b11, 2);
+        stuffer.Push(id & 0x3FFFF, 18);
+        stuffer.Push(0b0100 | brs, 4); // RRS, FDF, res, BRS
+    } else {
+        stuffer.Push(id, 11);
+        stuffer.Push(0b00100 | brs, 5); // RRS, IDE, FDF, res, BRS
+    }
+    // A stuff bit right after BRS already goes at the data bitrate
+    const auto arbitrationBits = stuffer.bits + stuffer.stuff - (stuffer.stuffedLast ? 1 : 0);
+
+    stuffer.Push((frame.flags & CANFD_ESI) ? 1 : 0, 1);
+    stuffer.Push(static_cast<uint32_t>(dlcCode), 4);
+    for (uint8_t idx = 0; idx < len; idx++)
+        stuffer.Push(frame.data[idx], 8);
+
+    const unsigned long long crcBits = (len > 16) ? 21 : 17;
+    const auto fixedStuff = (4 + crcBits + 3) / 4;
+    bits.arbitration = arbitrationBits + TrailerBits;
+    bits.data = stuffer.bits + stuffer.stuff - arbitrationBits + 4 + crcBits + fixedStuff;
+    bits.stuff = stuffer.stuff + fixedStuff;
+    return bits;
+}
+
+void SocketCAN::HandleErrorFrame(const canfd_frame& rawFrame)
+{
+    // Error frames always come in the classic layout
+    const auto& errFrame = reinterpret_cast<const can_frame&>(rawFrame);
+    if (m_errClbkFunc) {
+        m_errClbkFunc(errFrame);
+    } else {
+        std::cerr << ERR_MARKER << LOG_MARKER << m_ifaceName << ": frame error!\n"
+                  << TranslateErrorFrame(errFrame) << std::endl;
+    }
+    m_busOff = ((rawFrame.can_id & CAN_ERR_BUSOFF)
+        || ((rawFrame.can_id & CAN_ERR_CRTL)
+            && (rawFrame.data[1] & (CAN_ERR_CRTL_TX_PASSIVE | CAN_ERR_CRTL_RX_PASSIVE))));
 }
 
 std::string SocketCAN::TranslateErrorFrame(const can_frame& frame)
@@ -709,10 +1581,3 @@ std::string SocketCAN::TranslateErrorFrame(const can_frame& frame)
     }
     return builder.str();
 }
-
-void SocketCAN::UpdateStats(uint8_t dlc, size_t mtu, bool id29Bit)
-{
-    m_stats.rxCount++;
-    m_stats.rxBitsPayload += dlc * 8;
-    m_stats.rxBitsTotal += FrameBitLength(id29Bit, dlc, mtu);
-}
@@ -1,21 +1,123 @@
 #ifndef CANOPEN_TIMERS_LIB_SOCKETCAN_HPP_
 #define CANOPEN_TIMERS_LIB_SOCKETCAN_HPP_
 
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
+#include <ctime>
 #include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <linux/can.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class CanBusStats;
 
 class SocketCAN {
 public:
-    static constexpr size_t MaxFramePayloadLen { 8 };
+    static constexpr size_t MaxClassicPayloadLen { CAN_MAX_DLEN };
+    static constexpr size_t MaxFramePayloadLen { CANFD_MAX_DLEN };
+
+    // Per-frame CAN FD options, none of them set means a classic CAN 2.0 frame
+    enum FdFlags : uint8_t {
+        FdFrame = 0x01, // FD format, implied by any payload longer than 8 bytes
+        FdBitRateSwitch = 0x02, // data phase at the data bitrate
+        FdErrorPassive = 0x04, // ESI, the transmitter was error passive; set by the controller, RX only
+    };
 
     using FramePayload = std::array<uint8_t, MaxFramePayloadLen>;
-    using OnDataRXCallback = std::function<void(uint32_t, bool, uint8_t, const FramePayload&)>;
+    using RxTimestamp = std::chrono::steady_clock::time_point;
+
+    struct RxFrame {
+        uint32_t id {};
+        bool id29Bit {};
+        uint8_t dlc {}; // payload length in bytes, up to 64 for FD frames
+        uint8_t fdFlags {};
+        FramePayload data {};
+        RxTimestamp timestamp {}; // kernel receive time when available, poller read time otherwise
+    };
+
+    // What PollInto() decoded from a frame the kernel received into caller-provided storage, the payload stays there
+    struct RxFrameInfo {
+        uint32_t id {};
+        bool id29Bit {};
+        uint8_t dlc {};
+        uint8_t fdFlags {};
+        RxTimestamp timestamp {};
+    };
+
+    // One frame per call, only valid for the duration of the call
+    using OnDataRXCallback = std::function<void(const RxFrame&)>;
+
+    // Whole batch in one go, frames are only valid for the duration of the call
+    using OnBatchRXCallback = std::function<void(const RxFrame*, size_t)>;
+
+    struct RxStats {
+        unsigned long long wakeups { 0 };
+        unsigned long long syscalls { 0 };
+        unsigned long long frames { 0 };
+        unsigned long long pollCpuNs { 0 };
+        unsigned long long kernelTimestamps { 0 }; // frames carrying a kernel receive timestamp
+        unsigned long long fdFrames { 0 };
+    };
+
+    enum class TxOrder {
+        Fifo, // frames leave in the order they were queued
+        Priority, // lowest arbitration ID first, like the bus would, with a small socket window
+    };
+
+    // Called from the polling thread for every frame handed over to the kernel, with the time it spent queued
+    using OnTxCallback = std::function<void(uint32_t, bool, unsigned long long)>;
+
+    // Called from the polling thread when a queued frame comes back as its own echo, that is once it made it onto the
+    // bus, with the time from Queue() to the wire and the wire time itself
+    using OnTxEchoCallback = std::function<void(uint32_t, bool, unsigned long long, RxTimestamp)>;
+
+    // Called from the receiving thread for every error frame, instead of translating and printing it right there
+    using OnErrorFrameCallback = std::function<void(const can_frame&)>;
+
+    struct TxStats {
+        unsigned long long queued { 0 };
+        unsigned long long sent { 0 };
+        unsigned long long dropped { 0 }; // queue full
+        unsigned long long failed { 0 }; // rejected by the kernel for good
+        unsigned long long retries { 0 }; // kernel queue full, tried again later
+        unsigned long long syscalls { 0 };
+        unsigned long long echoes { 0 }; // own frames seen back from the bus and matched to the queue
+        unsigned long long unmatched { 0 }; // echoes without a queued frame, or queued frames never echoed
+        size_t depth { 0 };
+        size_t highWater { 0 };
+    };
+
+    struct RxFilter {
+        uint32_t id {};
+        bool id29Bit {};
+
+        inline bool operator==(const RxFilter& that) const
+        {
+            return id == that.id && id29Bit == that.id29Bit;
+        }
+    };
+
+    struct RxFilterStats {
+        size_t filters { 0 }; // 0 means everything gets through
+        unsigned long long ifaceFrames { 0 }; // seen by the interface since the filter was applied
+        unsigned long long delivered { 0 }; // made it to this socket meanwhile
+        unsigned long long dropped { 0 }; // rejected by the kernel on our behalf
+    };
+
+    static constexpr size_t RxBatchSize { 64 };
+    static constexpr size_t RxControlSize { 128 }; // room for SCM_TIMESTAMPING or SCM_TIMESTAMPNS
+    static constexpr size_t TxBatchSize { 32 };
+    static constexpr size_t TxQueueSize { 256 };
+    static constexpr int TxWindowBytes { 1 }; // kernel clamps it to its minimum, a handful of frames
 
     explicit SocketCAN(const std::string& ifaceName, const int bitrate = 250000);
     ~SocketCAN();
@@ -23,11 +125,39 @@ public:
     bool Open();
     bool Close();
     bool IsBusOff() const;
-    bool Send(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload& data);
+    bool Send(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload& data, uint8_t fdFlags = 0);
+    bool Queue(uint32_t id, bool id29Bit, uint8_t dlc, const FramePayload& data, uint8_t fdFlags = 0);
+
+    // Same as above, built straight from the caller's buffer holding at least dlc bytes
+    bool Send(uint32_t id, bool id29Bit, uint8_t dlc, const uint8_t* data, uint8_t fdFlags = 0);
+    bool Queue(uint32_t id, bool id29Bit, uint8_t dlc, const uint8_t* data, uint8_t fdFlags = 0);
+    TxStats TxStatistics() const;
+    void SetTxOrder(TxOrder order);
+    void SetTxCallback(const OnTxCallback& txClbkFunc);
+    void SetTxEcho(bool enable, const OnTxEchoCallback& echoClbkFunc = {});
+    void SetErrorFrameCallback(const OnErrorFrameCallback& errClbkFunc);
     bool Receive(uint32_t& id, bool& id29Bit, uint8_t& dlc, FramePayload& data);
     bool Poll(const OnDataRXCallback& rxClbkFunc);
-    int BusLoad();
+    bool PollBatch(const OnBatchRXCallback& rxClbkFunc);
+
+    // Batched like PollBatch(), but the kernel receives straight into buffers owned by `sink', which only gets the
+    // decoded header on top: no intermediate copy, no std::function. Sink is anything providing
+    //   size_t Reserve(canfd_frame** buffers, size_t max); // at least one and at most max buffers to receive into
+    //   void Accept(size_t idx, const RxFrameInfo& info);  // buffers[idx] holds a frame for the caller
+    //   void Discard(size_t idx);                          // buffers[idx] holds nothing for it (error frame, echo)
+    //   void Publish(size_t count);                        // done with the first count buffers, in order
+    // all of them called from the polling thread.
+    template <typename Sink>
+    bool PollInto(Sink& sink);
+
+    RxStats RxStatistics() const;
+    bool SetRxFilters(const std::vector<RxFilter>& filters);
+    RxFilterStats RxFilterStatistics() const;
+    int BusLoad() const; // over the last complete second, both directions
+    const CanBusStats& BusStatistics() const;
     bool SetBitrate(const int bitrate);
+    void SetDataBitrate(const int dataBitrate);
+    static uint8_t FdPaddedLength(uint8_t len);
 
     inline std::string Name() const
     {
@@ -39,32 +169,225 @@ public:
         return m_bitrate;
     }
 
-private:
-    const int c_invalidSocket { -1 };
-    const int c_busOffThreshold { 10 };
+    inline int DataBitrate() const
+    {
+        return m_dataBitrate;
+    }
 
-    struct BusStats {
-        unsigned long long rxCount { 0 };
-        unsigned long long rxBitsTotal { 0 };
-        unsigned long long rxBitsPayload { 0 };
-        std::chrono::steady_clock::time_point lastStat { std::chrono::steady_clock::now() };
+    // FD frames can only be sent or received once the interface actually came up in FD mode
+    inline bool IsFd() const
+    {
+        return m_fdActive;
+    }
 
-        int Load(const int ifaceBitrate) const;
-        void Reset();
+    // Bit times of a frame on the wire, worst case stuffing
+    struct FrameBits {
+        unsigned long long arbitration { 0 }; // always at the nominal bitrate
+        unsigned long long data { 0 }; // at the data bitrate when the frame switches, nominal otherwise
+        unsigned long long stuff { 0 }; // out of the above, exact lengths only
     };
 
+    static FrameBits FrameBitLength(const bool id29Bit, const uint8_t dlc, const size_t mtu);
+
+    // Same, with the stuff bits this very frame gets (CRC included for classic frames) instead of the worst case
+    static FrameBits StuffedFrameBitLength(const canfd_frame& frame, const size_t mtu);
+
+    // Lower wins arbitration on the bus
+    static uint64_t ArbitrationKey(const canfd_frame& frame);
+
+    // Header of a complete data frame read with rxBytes, false for error frames and anything incomplete
+    static bool ParseFrame(const canfd_frame& rawFrame, size_t rxBytes, RxFrameInfo& output);
+
+    // Human readable, one line per problem the error frame reports
+    static std::string TranslateErrorFrame(const can_frame& frame);
+
+private:
+    const int c_invalidSocket { -1 };
+    const int c_busOffThreshold { 10 };
+
     int m_socket { c_invalidSocket };
     std::string m_ifaceName { "" };
     int m_txErrCnt { 0 };
-    bool m_busOff { false };
-    BusStats m_stats {};
+    std::atomic_bool m_busOff { false };
+    std::unique_ptr<CanBusStats> m_busStats {}; // RX from the polling thread, TX from wherever it's written
     std::atomic_bool m_stopPolling { false };
     int m_bitrate { 0 };
+    int m_dataBitrate { 0 }; // 0 keeps the interface classic CAN only
+    bool m_fdActive { false };
 
-    static unsigned long long FrameBitLength(const bool id29Bit, const uint8_t dlc, const size_t mtu);
-    static std::string TranslateErrorFrame(const can_frame& frame);
+    // Written by the polling thread only, read from anywhere
+    std::atomic<unsigned long long> m_rxWakeups { 0 };
+    std::atomic<unsigned long long> m_rxSyscalls { 0 };
+    std::atomic<unsigned long long> m_rxFrames { 0 };
+    std::atomic<unsigned long long> m_rxKernelTimestamps { 0 };
+    std::atomic<unsigned long long> m_rxFdFrames { 0 };
+    std::atomic<clockid_t> m_pollCpuClock { CLOCK_MONOTONIC };
+    std::atomic_bool m_pollCpuClockValid { false };
+
+    struct TxEntry {
+        canfd_frame frame {};
+        size_t mtu { CAN_MTU }; // CANFD_MTU for FD frames
+        unsigned long long queuedNs { 0 };
+        unsigned long long seq { 0 };
+        uint64_t arbitrationKey { 0 };
+    };
+
+    // Kept around so that they survive a Close()/Open() cycle
+    std::vector<RxFilter> m_rxFilters {};
+    unsigned long long m_filterBaseIfaceFrames { 0 };
+    unsigned long long m_filterBaseDelivered { 0 };
+
+    // TX queue, Queue() is the single producer and the polling thread the single consumer
+    std::array<TxEntry, TxQueueSize> m_txQueue {};
+    alignas(64) std::atomic<size_t> m_txTail { 0 };
+    alignas(64) std::atomic<size_t> m_txHead { 0 };
+    std::atomic_bool m_txWakePending { false };
+    int m_txWakeFd { c_invalidSocket };
+    bool m_txWaitWritable { false };
+    std::atomic<unsigned long long> m_txQueued { 0 };
+    std::atomic<unsigned long long> m_txSent { 0 };
+    std::atomic<unsigned long long> m_txDropped { 0 };
+    std::atomic<unsigned long long> m_txFailed { 0 };
+    std::atomic<unsigned long long> m_txRetries { 0 };
+    std::atomic<unsigned long long> m_txSyscalls { 0 };
+    std::atomic<size_t> m_txHighWater { 0 };
+    TxOrder m_txOrder { TxOrder::Fifo };
+    OnTxCallback m_txClbkFunc {};
 
-    void UpdateStats(uint8_t dlc, size_t mtu, bool id29Bit);
+    // Frames handed to the kernel and waiting for their echo, owned by the polling thread
+    struct TxInFlight {
+        canid_t canId {};
+        unsigned long long queuedNs { 0 };
+    };
+
+    bool m_txEcho { false };
+    OnTxEchoCallback m_txEchoClbkFunc {};
+    OnErrorFrameCallback m_errClbkFunc {};
+    std::array<TxInFlight, TxQueueSize> m_txInFlight {};
+    size_t m_txInFlightHead { 0 };
+    size_t m_txInFlightTail { 0 };
+    std::atomic<unsigned long long> m_txEchoes { 0 };
+    std::atomic<unsigned long long> m_txUnmatched { 0 };
+
+    // Priority order only, owned by the polling thread
+    std::vector<TxEntry> m_txHeap {};
+    std::atomic<size_t> m_txHeapDepth { 0 };
+
+    static bool KernelTimestamp(const struct msghdr& msg, const std::chrono::system_clock::time_point& realNow,
+        const RxTimestamp& steadyNow, RxTimestamp& output);
+    static bool TxEntryLater(const TxEntry& lhs, const TxEntry& rhs);
+
+    bool BuildFrame(uint32_t id, bool id29Bit, uint8_t dlc, const uint8_t* data, uint8_t fdFlags,
+        canfd_frame& output, size_t& mtu);
+    void EnableFdFrames();
+    int OpenPollingFd();
+    bool ApplyRxFilters();
+    unsigned long long InterfaceRxFrames() const;
+    bool HandleTxWake();
+    bool FlushTx(int epollFd);
+    bool DecodeHeader(const canfd_frame& rawFrame, size_t rxBytes, RxFrameInfo& output);
+    bool DecodeFrame(const canfd_frame& rawFrame, size_t rxBytes, RxFrame& output);
+    void HandleErrorFrame(const canfd_frame& rawFrame);
+    void EnableTimestamps();
+    void EnableTxEcho();
+    void TrackInFlight(const TxEntry& entry);
+    void HandleTxEcho(const canfd_frame& rawFrame, const struct msghdr& msg,
+        const std::chrono::system_clock::time_point& realNow, const RxTimestamp& steadyNow);
 };
 
+template <typename Sink>
+bool SocketCAN::PollInto(Sink& sink)
+{
+    int tempErrCode = 0;
+    int epollFd = OpenPollingFd();
+    if (epollFd == c_invalidSocket)
+        return false;
+
+    // Buffers come from the sink with every batch, the rest of what recvmmsg() needs is set up once
+    std::array<canfd_frame*, RxBatchSize> buffers {};
+    std::array<struct iovec, RxBatchSize> iovecs {};
+    std::array<struct mmsghdr, RxBatchSize> msgs {};
+    alignas(struct cmsghdr) std::array<std::array<char, RxControlSize>, RxBatchSize> controls {};
+    for (size_t idx = 0; idx < RxBatchSize; idx++) {
+        msgs[idx].msg_hdr.msg_iov = &iovecs[idx];
+        msgs[idx].msg_hdr.msg_iovlen = 1;
+        msgs[idx].msg_hdr.msg_control = controls[idx].data();
+    }
+
+    std::array<struct epoll_event, 2> events {};
+    bool txBacklog = false;
+    while (!m_stopPolling.load()) {
+        int activeFds = epoll_wait(epollFd, events.data(), events.size(), txBacklog ? 1 : 5);
+        m_rxSyscalls.fetch_add(1, std::memory_order_relaxed);
+        if (activeFds == -1) {
+            tempErrCode = errno;
+            continue;
+        }
+
+        bool readable = false;
+        for (int idx = 0; idx < activeFds; idx++) {
+            if (events[idx].data.fd == m_txWakeFd)
+                HandleTxWake();
+            else if (events[idx].data.fd == m_socket && (events[idx].events & EPOLLIN))
+                readable = true;
+        }
+        if (!readable) {
+            txBacklog = FlushTx(epollFd);
+            continue;
+        }
+
+        // Keep draining while batches come back full, a short one means the socket queue is empty
+        m_rxWakeups.fetch_add(1, std::memory_order_relaxed);
+        int received = 0;
+        size_t reserved = 0;
+        do {
+            reserved = std::min(sink.Reserve(buffers.data(), RxBatchSize), RxBatchSize);
+            if (reserved == 0)
+                break;
+            for (size_t idx = 0; idx < reserved; idx++) {
+                iovecs[idx].iov_base = buffers[idx];
+                iovecs[idx].iov_len = sizeof(canfd_frame);
+                msgs[idx].msg_hdr.msg_controllen = RxControlSize; // kernel shrinks it to what it actually wrote
+            }
+
+            received = recvmmsg(m_socket, msgs.data(), reserved, MSG_DONTWAIT, nullptr);
+            m_rxSyscalls.fetch_add(1, std::memory_order_relaxed);
+            if (received < 0) {
+                tempErrCode = errno;
+                if (tempErrCode == EAGAIN || tempErrCode == EWOULDBLOCK)
+                    tempErrCode = 0;
+                break;
+            }
+
+            // One clock pair per batch is enough to move kernel timestamps into the steady clock domain
+            const auto realNow = std::chrono::system_clock::now();
+            const auto steadyNow = std::chrono::steady_clock::now();
+            for (int idx = 0; idx < received; idx++) {
+                const auto& msg = msgs[idx];
+                if (msg.msg_hdr.msg_flags & MSG_CONFIRM) {
+                    if (msg.msg_len == CAN_MTU || msg.msg_len == CANFD_MTU)
+                        HandleTxEcho(*buffers[idx], msg.msg_hdr, realNow, steadyNow);
+                    sink.Discard(idx);
+                    continue;
+                }
+
+                RxFrameInfo info {};
+                if (!DecodeHeader(*buffers[idx], msg.msg_len, info)) {
+                    sink.Discard(idx);
+                    continue;
+                }
+                info.timestamp = steadyNow;
+                if (KernelTimestamp(msg.msg_hdr, realNow, steadyNow, info.timestamp))
+                    m_rxKernelTimestamps.fetch_add(1, std::memory_order_relaxed);
+                sink.Accept(idx, info);
+            }
+            sink.Publish(received);
+        } while (static_cast<size_t>(received) == reserved && !m_stopPolling.load());
+        txBacklog = FlushTx(epollFd);
+    }
+
+    close(epollFd);
+    return tempErrCode == 0;
+}
+
 #endif // CANOPEN_TIMERS_LIB_SOCKETCAN_HPP_
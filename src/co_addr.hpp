@@ -46,6 +46,8 @@ private:
 namespace Addresses {
 static const ObjectAddress Std_DeviceType { 0x1000, 0x00 }; // RO u32
 static const ObjectAddress Std_ErrorRegister { 0x1001, 0x00 }; // RO u8
+static const ObjectAddress Std_SyncCOBID { 0x1005, 0x00 }; // RW u32
+static const ObjectAddress Std_HeartbeatConsumerCount { 0x1016, 0x00 }; // RO u8
 static const ObjectAddress Std_HeartbeatProducerTime { 0x1017, 0x00 }; // RW CO_OBJ_HB_PROD
 static const ObjectAddress Std_IdentityMaxSubindex { 0x1018, 0x00 }; // RO u8
 static const ObjectAddress Std_IdentityVendorID { 0x1018, 0x01 }; // RO u32
@@ -76,6 +78,18 @@ inline static ObjectAddress Std_SDOServerResponseCOBID(int num) // RO u32
     return { static_cast<uint16_t>(0x1200 + num), 0x02 };
 }
 
+inline static ObjectAddress Std_HeartbeatConsumer(int num) // RW u32
+{
+    num = std::clamp(num, 0, 126);
+    return { 0x1016, static_cast<uint8_t>(0x01 + num) };
+}
+
+inline static ObjectAddress Std_RPDOCommCOBID(int num) // RO u32
+{
+    num = std::clamp(num, 0, 511);
+    return { static_cast<uint16_t>(0x1400 + num), 0x01 };
+}
+
 inline static ObjectAddress Std_TPDOCommParam(int num) // RO u8
 {
     num = std::clamp(num, 0, 511);
@@ -2,69 +2,173 @@
 #define CANOPEN_TIMERS_SRC_CO_CAN_LINUX_HPP_
 
 #include "co_if_can.h"
+#include "driver_slots.hpp"
+#include "latency_histogram.hpp"
+#include "socketcan/can_bus_stats.hpp"
 #include "socketcan/socketcan.hpp"
+#include "spsc_ring.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
-#include <list>
 #include <memory>
-#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
+// One instance per node, several of them can share an interface. Reception and transmission settings are
+// process-wide and picked up by instances created afterwards.
 class co_can_linux {
 public:
-    static const CO_IF_CAN_DRV& CANDriver();
-    static void SetCANInterface(const std::string& ifName);
+    static constexpr size_t MaxInstances { 128 };
+
+    explicit co_can_linux(const std::string& ifName);
+    ~co_can_linux();
+    co_can_linux(const co_can_linux&) = delete;
+    co_can_linux& operator=(const co_can_linux&) = delete;
+
+    // Only with a driver slot of its own, nullptr once all MaxInstances are taken
+    const CO_IF_CAN_DRV* CANDriver() const;
+
+    enum class RxMode {
+        Single, // one frame per recvmmsg(), handed over to the stack right away
+        Batch, // up to a batch per recvmmsg(), handed over together
+    };
+
+    enum class TxMode {
+        Direct, // blocking write() from the stack's processing path
+        Queue, // bounded queue, flushed with sendmmsg() by the polling thread
+        Priority, // same as above, but lowest CAN ID first and only a small window handed to the kernel
+    };
+
+    static void SetRxMode(RxMode mode);
+    static bool SetRxMode(const std::string& name);
+    static std::string RxModeName(RxMode mode);
+    static void SetTxMode(TxMode mode);
+    static bool SetTxMode(const std::string& name);
+    static std::string TxModeName(TxMode mode);
+
+    // CAN FD as `<data bitrate>[:fd|:brs]`, picked up by the next Enable(). The suffix sends the stack's own frames in
+    // FD format (with the data phase at the data bitrate for `brs'), without one they stay classic for CAN 2.0 nodes.
+    static bool SetFdMode(const std::string& spec);
+
+    // Matches own frames echoed back by the bus to the TX queue, for queue-to-wire latency per COB-ID. Queued TX modes
+    // only, picked up by the next Init(). The echoes have to get past the receive filter too.
+    static void SetTxEcho(bool enable);
+    static bool TxEchoEnabled();
+
+    // Only frames matching these get past the kernel, an empty set lets everything through
+    void SetReceiveFilter(const std::vector<SocketCAN::RxFilter>& filters);
+
+    // Readable once frames are queued for the stack, a blocked node thread acknowledges it before draining the queue
+    int RxNotifyFd();
+    void AcknowledgeRx();
+
+    size_t RxQueueDepth() const;
+    uint64_t RxOverflows() const;
+    void DumpStatistics();
+
+    // Compares the RX ring against the former list+mutex queue, paced at full 1 Mbit/s bus load
+    static void BenchmarkRxQueue(std::chrono::milliseconds duration);
+
+    // CPU cycles per frame from the poller's receive buffer to the stack's CO_IF_FRM, in place against the former
+    // RxFrame/std::function/copying path
+    static void BenchmarkRxPath(size_t frames);
 
 private:
+    // Ring element, the kernel receives straight into `raw' and the poller only fills in the rest
     struct RawCANFrame {
+        canfd_frame raw {};
         uint32_t canId {};
         bool isExtCanId {};
         uint8_t dlc {};
-        SocketCAN::FramePayload data {};
-        const std::chrono::steady_clock::time_point timestamp { std::chrono::steady_clock::now() };
+        uint8_t fdFlags {};
+        bool valid {}; // false for buffers published along with a batch without a frame for the stack
+        std::chrono::steady_clock::time_point timestamp { std::chrono::steady_clock::now() };
 
         RawCANFrame() = default;
-        RawCANFrame(uint32_t _canId, bool _is29Bit, uint8_t _dlc, const SocketCAN::FramePayload& _data)
+        RawCANFrame(uint32_t _canId, bool _is29Bit, uint8_t _dlc, const SocketCAN::FramePayload& _data,
+            std::chrono::steady_clock::time_point _timestamp = std::chrono::steady_clock::now())
             : canId(_canId)
             , isExtCanId(_is29Bit)
             , dlc(_dlc)
-            , data(_data) {};
+            , valid(true)
+            , timestamp(_timestamp)
+        {
+            std::copy(_data.begin(), _data.end(), std::begin(raw.data));
+        };
 
         inline operator bool() const
         {
-            if (canId == 0 && dlc == 0)
-                return false;
-            return true;
+            return valid;
         }
     };
 
+    // Hands ring slots to SocketCAN::PollInto() to receive into, scratch buffers to drop frames into once it's full
+    struct RxSink;
+
     static constexpr std::chrono::microseconds PollingRate { 500 };
     static constexpr size_t ReasonableFrameCount { 100 };
+    static constexpr size_t RxQueueCapacity { 1024 };
+    static constexpr size_t CobIdClassCount { 17 }; // one per CANopen function code, plus extended IDs
+    static constexpr size_t TxEchoSlotCount { 32 }; // distinct COB-IDs traced, later ones are only counted
+    static constexpr size_t BusiestIdCount { 8 }; // COB-IDs listed in the statistics
+
+    // Claimed by the poller thread only, readers see the slots below s_txEchoSlotsUsed
+    struct TxEchoSlot {
+        uint32_t canId {};
+        bool isExtCanId {};
+        LatencyHistogram queueToWireNs {};
+        LatencyHistogram wirePeriodUs {}; // between two consecutive frames of this COB-ID on the wire
+        std::chrono::steady_clock::time_point lastWire {};
+    };
+
+    using Slots = DriverSlots<co_can_linux, MaxInstances>;
+
+    template <size_t Slot>
+    struct Trampolines;
+
+    static RxMode s_rxMode;
+    static TxMode s_txMode;
+    static int s_dataBitrate;
+    static uint8_t s_fdTxFlags;
+    static bool s_txEcho;
+
+    int m_slot { Slots::InvalidSlot };
+    std::string m_ifName {};
+    std::unique_ptr<SocketCAN> m_canIf {};
+    std::unique_ptr<std::thread> m_rxPolling {};
+    std::atomic<uint64_t> m_rxOversize { 0 };
+    std::atomic<int> m_rxNotifyFd { -1 };
+    std::atomic_bool m_rxNotifyPending { false };
+    bool m_warnedBacklog { false }; // poller thread only
+    bool m_warnedOverflow { false };
+    std::array<LatencyHistogram, CobIdClassCount> m_txQueuingNs {};
+    LatencyHistogram m_rxLatencyNs {};
+    SpscRing<RawCANFrame, RxQueueCapacity> m_rxQueue {};
+    std::array<TxEchoSlot, TxEchoSlotCount> m_txEchoSlots {};
+    std::atomic<size_t> m_txEchoSlotsUsed { 0 };
+    std::atomic<uint64_t> m_txEchoUntraced { 0 };
+    CanBusStats::Snapshot m_lastBusStats {}; // DumpStatistics() only, for per-COB-ID rates since the last one
+
+    void Init();
+    void Enable(uint32_t baudRate);
+    int16_t Send(CO_IF_FRM* frame);
+    int16_t Read(CO_IF_FRM* frame);
+    void Reset();
+    void Close();
 
-    static const CO_IF_CAN_DRV s_coCanDrv;
-
-    static std::string s_ifName;
-    static std::unique_ptr<SocketCAN> s_canIf;
-    static std::unique_ptr<std::thread> s_rxPolling;
-    static std::mutex s_rxMutex;
-    static std::list<RawCANFrame> s_rxQueue;
-
-    static void Init();
-    static void Enable(uint32_t baudRate);
-    static int16_t Send(CO_IF_FRM* frame);
-    static int16_t Read(CO_IF_FRM* frame);
-    static void Reset();
-    static void Close();
-
-    static void StartPolling();
-    static void PushFrame(uint32_t canId, bool is29Bit, uint8_t dlc, const SocketCAN::FramePayload& data);
-    static RawCANFrame PopFrame();
-    static void ResetQueue();
-
-    // Make it purely static
-    co_can_linux() = delete;
-    ~co_can_linux() = delete;
+    void StartPolling();
+    void CheckRxQueue(bool overflowed);
+    void NotifyRx();
+    int16_t PopFrame(CO_IF_FRM* frame); // copies and records latency, Read() adds the tracing
+    void ResetQueue();
+    void RecordTxQueuing(uint32_t canId, bool is29Bit, unsigned long long queuedNs);
+    void RecordTxEcho(uint32_t canId, bool is29Bit, unsigned long long queueToWireNs, SocketCAN::RxTimestamp wireTime);
+    static size_t CobIdClass(uint32_t canId, bool is29Bit);
+    static std::string CobIdClassName(size_t cobIdClass);
 };
 
 #endif // CANOPEN_TIMERS_SRC_CO_CAN_LINUX_HPP_
@@ -0,0 +1,329 @@
+#include "co_can_virtual.hpp"
+#include "tracelog.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <poll.h>
+
+static const std::string LOG_MARKER { "[HAL::VCAN] " };
+static const std::string ERR_MARKER { "E: " };
+static const std::string DBG_MARKER { "D: " };
+static const tracelog::Origin TRACE_ORIGIN { tracelog::RegisterOrigin(LOG_MARKER) };
+
+// Forwards the stack's calls for one slot to the instance that claimed it
+template <size_t Slot>
+struct co_can_virtual::Trampolines {
+    static void Init() { Slots::At(Slot)->Init(); }
+    static void Enable(uint32_t baudRate) { Slots::At(Slot)->Enable(baudRate); }
+    static int16_t Read(CO_IF_FRM* frame) { return Slots::At(Slot)->Read(frame); }
+    static int16_t Send(CO_IF_FRM* frame) { return Slots::At(Slot)->Send(frame); }
+    static void Reset() { Slots::At(Slot)->Reset(); }
+    static void Close() { Slots::At(Slot)->Close(); }
+
+    static constexpr CO_IF_CAN_DRV Table { Init, Enable, Read, Send, Reset, Close };
+};
+
+bool co_can_virtual::IsVirtualInterface(const std::string& ifName)
+{
+    return ifName.rfind(InterfacePrefix, 0) == 0;
+}
+
+bool co_can_virtual::IsValidInterface(const std::string& ifName)
+{
+    std::string busName {};
+    int bitrate = 0;
+    return ParseInterface(ifName, busName, bitrate);
+}
+
+bool co_can_virtual::ParseInterface(const std::string& ifName, std::string& busName, int& bitrate)
+{
+    if (!IsVirtualInterface(ifName))
+        return false;
+
+    const auto parts = utils::Split(ifName.substr(std::strlen(InterfacePrefix)), ":");
+    if (parts.empty() || parts.size() > 2 || parts[0].empty())
+        return false;
+
+    long bps = 0;
+    if (parts.size() == 2) {
+        char* end = nullptr;
+        bps = std::strtol(parts[1].c_str(), &end, 10);
+        if (parts[1].empty() || end == nullptr || *end != '\0' || bps <= 0)
+            return false;
+    }
+
+    busName = parts[0];
+    bitrate = static_cast<int>(bps);
+    return true;
+}
+
+co_can_virtual::co_can_virtual(const std::string& ifName)
+    : m_slot(Slots::Claim(this))
+{
+    if (!ParseInterface(ifName, m_busName, m_bitrate))
+        std::cerr << ERR_MARKER << LOG_MARKER << "Invalid virtual interface " << ifName << std::endl;
+    if (m_slot == Slots::InvalidSlot)
+        std::cerr << ERR_MARKER << LOG_MARKER << "More than " << MaxInstances << " CAN drivers, " << ifName
+                  << " won't get a driver table" << std::endl;
+}
+
+co_can_virtual::~co_can_virtual()
+{
+    Close();
+    Slots::Release(m_slot);
+}
+
+const CO_IF_CAN_DRV* co_can_virtual::CANDriver() const
+{
+    if (m_slot == Slots::InvalidSlot)
+        return nullptr;
+    return &Slots::TableFor<CO_IF_CAN_DRV, Trampolines>(m_slot);
+}
+
+void co_can_virtual::Init()
+{
+    if (!m_bus)
+        m_bus = VirtualCanBus::Get(m_busName, m_bitrate);
+    if (m_port == VirtualCanBus::InvalidPort)
+        m_port = m_bus->Attach();
+
+    if (m_port == VirtualCanBus::InvalidPort) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Failed to attach to virtual bus " << m_busName << std::endl;
+        return;
+    }
+
+    m_bus->SetFilters(m_port, m_rxFilters);
+    std::cout << LOG_MARKER << "Initialized on virtual bus " << m_bus->Name() << ", port " << m_port << std::endl;
+}
+
+void co_can_virtual::Enable(uint32_t baudRate)
+{
+    if (!m_bus)
+        return;
+
+    // The bus speed belongs to the bus, whoever created it picked it
+    if (m_bus->Bitrate() == 0)
+        std::cout << LOG_MARKER << "Now running at unlimited speed, " << baudRate << " bps requested" << std::endl;
+    else
+        std::cout << LOG_MARKER << "Now running at " << m_bus->Bitrate() << " bps (simulated), " << baudRate
+                  << " bps requested" << std::endl;
+}
+
+int16_t co_can_virtual::Send(CO_IF_FRM* frame)
+{
+    if (!m_bus)
+        return -1;
+
+    VirtualCanBus::Frame busFrame {};
+    busFrame.id = frame->Identifier;
+    busFrame.dlc = frame->DLC;
+    std::copy(std::begin(frame->Data), std::end(frame->Data), busFrame.data.begin());
+    if (!m_bus->Send(m_port, busFrame))
+        return -1;
+    tracelog::Log(tracelog::Level::Trace, TRACE_ORIGIN, tracelog::Event::CanTx, m_busName, frame->Identifier, 0,
+        frame->Data, frame->DLC);
+    return 0;
+}
+
+int16_t co_can_virtual::Read(CO_IF_FRM* frame)
+{
+    if (!m_bus)
+        return -1;
+
+    VirtualCanBus::Frame busFrame {};
+    if (!m_bus->Receive(m_port, busFrame))
+        return 0;
+
+    // From the end of frame on the bus to the stack picking it up
+    const auto rxLatency = std::chrono::steady_clock::now() - busFrame.timestamp;
+    m_rxLatencyNs.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(rxLatency).count());
+
+    frame->Identifier = busFrame.id;
+    frame->DLC = busFrame.dlc;
+    std::memcpy(frame->Data, busFrame.data.data(), sizeof(frame->Data));
+    tracelog::Log(tracelog::Level::Trace, TRACE_ORIGIN, tracelog::Event::CanRx, m_busName, frame->Identifier, 0,
+        frame->Data, frame->DLC);
+    return frame->DLC;
+}
+
+void co_can_virtual::Reset()
+{
+    if (!m_bus)
+        return;
+
+    std::cout << LOG_MARKER << "Resetting..." << std::endl;
+}
+
+void co_can_virtual::Close()
+{
+    if (!m_bus)
+        return;
+
+    std::cout << LOG_MARKER << "Closing..." << std::endl;
+    m_bus->Detach(m_port);
+    m_port = VirtualCanBus::InvalidPort;
+    m_bus.reset();
+}
+
+void co_can_virtual::SetReceiveFilter(const std::vector<SocketCAN::RxFilter>& filters)
+{
+    // Same thread as Read(), the bus has nothing to synchronize
+    m_rxFilters = filters;
+    if (m_bus)
+        m_bus->SetFilters(m_port, m_rxFilters);
+}
+
+int co_can_virtual::RxNotifyFd()
+{
+    return m_bus ? m_bus->NotifyFd(m_port) : -1;
+}
+
+void co_can_virtual::AcknowledgeRx()
+{
+    if (m_bus)
+        m_bus->Acknowledge(m_port);
+}
+
+size_t co_can_virtual::RxQueueDepth() const
+{
+    return m_bus ? m_bus->Pending(m_port) : 0;
+}
+
+void co_can_virtual::DumpStatistics()
+{
+    if (!m_bus)
+        return;
+
+    const auto bus = m_bus->Statistics();
+    const auto port = m_bus->PortStatistics(m_port);
+    std::cout << LOG_MARKER << m_bus->Name() << ": " << bus.ports << " ports, " << bus.frames << " frames at "
+              << (bus.bitrate ? std::to_string(bus.bitrate) + " bps" : "unlimited speed") << std::endl;
+    std::cout << LOG_MARKER << "RX " << port.received << " frames, " << port.filtered << " filtered out, "
+              << port.overruns << " overruns, bus to Read() [ns] " << m_rxLatencyNs.Take() << std::endl;
+    std::cout << LOG_MARKER << "TX " << port.sent << " frames, " << port.txDropped << " dropped";
+    if (bus.bitrate)
+        std::cout << ", arbitration delay [ns] " << port.txDelayNs;
+    std::cout << std::endl;
+}
+
+namespace {
+
+struct BusBenchResult {
+    std::vector<VirtualCanBus::PortStats> senders {};
+    VirtualCanBus::PortStats receiver {};
+    VirtualCanBus::BusStats bus {};
+    LatencyHistogram::Snapshot deliveryNs {};
+    uint64_t wallNs { 0 };
+};
+
+// Every sender is a node pushing its TPDO1, a single receiver port blocks on its notification like an event loop would
+BusBenchResult RunBusBench(int bitrate, size_t senderCount, std::chrono::microseconds framePeriod,
+    std::chrono::milliseconds duration)
+{
+    using Clock = std::chrono::steady_clock;
+
+    auto bus = VirtualCanBus::Get("bench-" + std::to_string(bitrate), bitrate);
+    const int rxPort = bus->Attach();
+    const int rxFd = bus->NotifyFd(rxPort);
+    std::vector<int> txPorts {};
+    for (size_t idx = 0; idx < senderCount; idx++)
+        txPorts.push_back(bus->Attach());
+
+    std::atomic_bool running { true };
+    LatencyHistogram deliveryNs {};
+    std::thread receiver([&]() {
+        VirtualCanBus::Frame frame {};
+        struct pollfd wake { rxFd, POLLIN, 0 };
+        while (running.load()) {
+            if (poll(&wake, 1, 10) > 0)
+                bus->Acknowledge(rxPort);
+            while (bus->Receive(rxPort, frame))
+                deliveryNs.Record(std::chrono::nanoseconds(Clock::now() - frame.timestamp).count());
+        }
+    });
+
+    const auto start = Clock::now();
+    const auto end = start + duration;
+    std::vector<std::thread> senders {};
+    for (size_t idx = 0; idx < senderCount; idx++) {
+        senders.emplace_back([&, idx]() {
+            VirtualCanBus::Frame frame {};
+            frame.id = 0x181 + static_cast<uint32_t>(idx);
+            frame.dlc = 8;
+            auto next = Clock::now();
+            for (uint64_t count = 0; Clock::now() < end; count++) {
+                if (framePeriod.count() > 0) {
+                    next += framePeriod;
+                    std::this_thread::sleep_until(next);
+                }
+                std::memcpy(frame.data.data(), &count, sizeof(count));
+                bus->Send(txPorts[idx], frame);
+            }
+        });
+    }
+    for (auto& sender : senders)
+        sender.join();
+    const auto busAtEnd = bus->Statistics();
+
+    // Whatever is still queued or on the wire gets there before the receiver stops
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    running.store(false);
+    receiver.join();
+
+    BusBenchResult result {};
+    for (const auto port : txPorts)
+        result.senders.push_back(bus->PortStatistics(port));
+    result.receiver = bus->PortStatistics(rxPort);
+    result.bus = busAtEnd;
+    result.deliveryNs = deliveryNs.Take();
+    result.wallNs = std::chrono::nanoseconds(end - start).count();
+
+    for (const auto port : txPorts)
+        bus->Detach(port);
+    bus->Detach(rxPort);
+    return result;
+}
+
+}
+
+void co_can_virtual::Benchmark(std::chrono::milliseconds duration)
+{
+    static constexpr size_t SenderCount { 4 };
+    static constexpr int SimulatedBitrate { 1'000'000 };
+    // 10 kHz of 8-byte frames in total, where 1 Mbit/s only fits one every 135 bit times (7.4 kHz)
+    static constexpr std::chrono::microseconds SaturatingPeriod { 400 };
+
+    const auto print = [](const std::string& label, const BusBenchResult& res) {
+        const auto perSec = [&res](uint64_t count) { return res.wallNs ? count * 1'000'000'000ULL / res.wallNs : 0; };
+        std::cout << LOG_MARKER << label << ": " << perSec(res.bus.frames) << " frames/s on the bus";
+        if (res.bus.bitrate)
+            std::cout << ", load " << std::fixed << std::setprecision(1) << res.bus.busyNs * 100. / res.wallNs
+                      << std::defaultfloat << "%";
+        std::cout << ", receiver got " << res.receiver.received << " (" << res.receiver.overruns << " overruns)\n"
+                  << LOG_MARKER << label << ": end of frame to Receive() [ns] " << res.deliveryNs << std::endl;
+        for (size_t idx = 0; idx < res.senders.size(); idx++) {
+            const auto& sender = res.senders[idx];
+            const auto cobId = static_cast<uint16_t>(0x181 + idx);
+            std::cout << LOG_MARKER << label << ": " << utils::ToHex(cobId, true) << " sent " << sender.sent
+                      << ", dropped " << sender.txDropped;
+            if (res.bus.bitrate)
+                std::cout << ", arbitration delay [ns] " << sender.txDelayNs;
+            std::cout << std::endl;
+        }
+    };
+
+    std::cout << LOG_MARKER << "Virtual bus benchmark, " << SenderCount << " senders and one receiver, "
+              << duration.count() << " ms per run" << std::endl;
+    print("unlimited", RunBusBench(0, SenderCount, std::chrono::microseconds(0), duration));
+    print(std::to_string(SimulatedBitrate / 1000) + " kbps",
+        RunBusBench(SimulatedBitrate, SenderCount, SaturatingPeriod, duration));
+}
@@ -0,0 +1,73 @@
+#ifndef CANOPEN_TIMERS_SRC_CO_CAN_VIRTUAL_HPP_
+#define CANOPEN_TIMERS_SRC_CO_CAN_VIRTUAL_HPP_
+
+#include "co_if_can.h"
+#include "driver_slots.hpp"
+#include "latency_histogram.hpp"
+#include "socketcan/socketcan.hpp"
+#include "virtual_can_bus.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Same contract as co_can_linux, on an in-process VirtualCanBus instead of a SocketCAN interface: no netlink, no root
+class co_can_virtual {
+public:
+    static constexpr size_t MaxInstances { 128 };
+
+    // `virtual:<name>[:<bps>]', nodes naming the same bus see each other's frames. The bitrate puts them on a
+    // simulated wire, without one frames are delivered as soon as they're sent.
+    static bool IsVirtualInterface(const std::string& ifName);
+    static bool IsValidInterface(const std::string& ifName);
+
+    explicit co_can_virtual(const std::string& ifName);
+    ~co_can_virtual();
+    co_can_virtual(const co_can_virtual&) = delete;
+    co_can_virtual& operator=(const co_can_virtual&) = delete;
+
+    // Only with a driver slot of its own, nullptr once all MaxInstances are taken
+    const CO_IF_CAN_DRV* CANDriver() const;
+
+    // Only frames matching these get through, an empty set lets everything through
+    void SetReceiveFilter(const std::vector<SocketCAN::RxFilter>& filters);
+
+    // Readable once frames are pending for the stack, a blocked node thread acknowledges it before draining them
+    int RxNotifyFd();
+    void AcknowledgeRx();
+
+    size_t RxQueueDepth() const;
+    void DumpStatistics();
+
+    // Throughput and latency of an unlimited bus, then arbitration delays of a saturated 1 Mbit/s one
+    static void Benchmark(std::chrono::milliseconds duration);
+
+private:
+    static constexpr const char* InterfacePrefix { "virtual:" };
+
+    using Slots = DriverSlots<co_can_virtual, MaxInstances>;
+
+    template <size_t Slot>
+    struct Trampolines;
+
+    int m_slot { Slots::InvalidSlot };
+    std::string m_busName {};
+    int m_bitrate { 0 };
+    std::shared_ptr<VirtualCanBus> m_bus {};
+    int m_port { VirtualCanBus::InvalidPort };
+    std::vector<SocketCAN::RxFilter> m_rxFilters {};
+    LatencyHistogram m_rxLatencyNs {};
+
+    static bool ParseInterface(const std::string& ifName, std::string& busName, int& bitrate);
+
+    void Init();
+    void Enable(uint32_t baudRate);
+    int16_t Send(CO_IF_FRM* frame);
+    int16_t Read(CO_IF_FRM* frame);
+    void Reset();
+    void Close();
+};
+
+#endif // CANOPEN_TIMERS_SRC_CO_CAN_VIRTUAL_HPP_
@@ -1,6 +1,7 @@
 #include "co_nvm_linux.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <vector>
@@ -9,44 +10,73 @@ static const std::string LOG_MARKER { "[HAL::NVM] " };
 static const std::string ERR_MARKER { "E: " };
 static const std::string DBG_MARKER { "D: " };
 
-const CO_IF_NVM_DRV& co_nvm_linux::NVMDriver()
+const std::string co_nvm_linux::c_nvmFilePath { "./kconvm.dat" };
+
+co_nvm_linux::co_nvm_linux()
+    : m_slot(Slots::Claim(this))
 {
-    return s_coNvmDrv;
+    // Slot 0 keeps the single node file, nodes created in the same order get their own files back on the next run
+    m_filePath = (m_slot <= 0) ? c_nvmFilePath : "./kconvm-" + std::to_string(m_slot) + ".dat";
+    if (m_slot == Slots::InvalidSlot)
+        std::cerr << ERR_MARKER << LOG_MARKER << "More than " << MaxInstances << " NVM drivers, this one can't be used"
+                  << std::endl;
 }
 
-const CO_IF_NVM_DRV co_nvm_linux::s_coNvmDrv {
-    co_nvm_linux::Init,
-    co_nvm_linux::Read,
-    co_nvm_linux::Write,
-};
+co_nvm_linux::~co_nvm_linux()
+{
+    Slots::Release(m_slot);
+}
 
-const std::string co_nvm_linux::c_nvmFilePath { "./kconvm.dat" };
+template <size_t Slot>
+struct co_nvm_linux::Trampolines {
+    static void Init()
+    {
+        Slots::At(Slot)->Init();
+    }
 
-std::fstream co_nvm_linux::s_nvmFile {};
+    static uint32_t Read(uint32_t start, uint8_t* buffer, uint32_t size)
+    {
+        return Slots::At(Slot)->Read(start, buffer, size);
+    }
+
+    static uint32_t Write(uint32_t start, uint8_t* buffer, uint32_t size)
+    {
+        return Slots::At(Slot)->Write(start, buffer, size);
+    }
+
+    static constexpr CO_IF_NVM_DRV Table { Init, Read, Write };
+};
+
+const CO_IF_NVM_DRV* co_nvm_linux::NVMDriver() const
+{
+    if (m_slot == Slots::InvalidSlot)
+        return nullptr;
+    return &Slots::TableFor<CO_IF_NVM_DRV, Trampolines>(m_slot);
+}
 
 void co_nvm_linux::Init()
 {
-    std::cout << LOG_MARKER << "Using " << std::quoted(c_nvmFilePath) << std::endl;
-    s_nvmFile.open(c_nvmFilePath, std::ios::binary | std::ios::in | std::ios::out);
+    std::cout << LOG_MARKER << "Using " << std::quoted(m_filePath) << std::endl;
+    m_nvmFile.open(m_filePath, std::ios::binary | std::ios::in | std::ios::out);
 }
 
 uint32_t co_nvm_linux::Read(uint32_t start, uint8_t* buffer, uint32_t size)
 {
     // File not open
-    if (!s_nvmFile) {
+    if (!m_nvmFile) {
         std::cerr << ERR_MARKER << LOG_MARKER << "Failed to read, file not ready" << std::endl;
         return 0;
     }
 
-    s_nvmFile.seekg(start, std::ios::beg);
+    m_nvmFile.seekg(start, std::ios::beg);
     // Failed to seek
-    if (!s_nvmFile) {
+    if (!m_nvmFile) {
         std::cerr << ERR_MARKER << LOG_MARKER << "Failed to read, seek failed for offset " << start << std::endl;
         return 0;
     }
 
-    s_nvmFile.read(reinterpret_cast<char*>(buffer), size);
-    const auto readBytes = s_nvmFile.gcount();
+    m_nvmFile.read(reinterpret_cast<char*>(buffer), size);
+    const auto readBytes = m_nvmFile.gcount();
 #ifndef NDEBUG
     std::cout << DBG_MARKER << LOG_MARKER << "Read: off " << start << ", req " << size << ", read " << readBytes
               << std::endl;
@@ -57,33 +87,33 @@ uint32_t co_nvm_linux::Read(uint32_t start, uint8_t* buffer, uint32_t size)
 uint32_t co_nvm_linux::Write(uint32_t start, uint8_t* buffer, uint32_t size)
 {
     // File not open
-    if (!s_nvmFile) {
+    if (!m_nvmFile) {
         std::cerr << ERR_MARKER << LOG_MARKER << "Failed to write, file not ready" << std::endl;
         return 0;
     }
 
-    const auto currSize = utils::GetFileSize(c_nvmFilePath);
+    const auto currSize = utils::GetFileSize(m_filePath);
     if (currSize < start) {
 #ifndef NDEBUG
         std::cout << DBG_MARKER << LOG_MARKER << "Write: filling " << start - currSize << " bytes first" << std::endl;
 #endif
-        s_nvmFile.seekp(0, std::ios::end);
+        m_nvmFile.seekp(0, std::ios::end);
         std::vector<char> filler {};
         filler.resize(start - currSize, 0x00);
-        s_nvmFile.write(filler.data(), filler.size());
+        m_nvmFile.write(filler.data(), filler.size());
     }
 
-    s_nvmFile.seekp(start, std::ios::beg);
+    m_nvmFile.seekp(start, std::ios::beg);
     // Failed to seek
-    if (!s_nvmFile) {
+    if (!m_nvmFile) {
         std::cerr << ERR_MARKER << LOG_MARKER << "Failed to write, seek failed for offset " << start << std::endl;
         return 0;
     }
 
-    s_nvmFile.write(reinterpret_cast<char*>(buffer), size);
-    const auto writeOff = (uint)s_nvmFile.tellp();
+    m_nvmFile.write(reinterpret_cast<char*>(buffer), size);
+    const auto writeOff = (uint)m_nvmFile.tellp();
     const auto writeBytes = writeOff - start;
-    s_nvmFile.flush();
+    m_nvmFile.flush();
 #ifndef NDEBUG
     std::cout << DBG_MARKER << LOG_MARKER << "Write: off " << start << ", req " << size << ", written " << writeBytes
               << std::endl;
@@ -2,27 +2,39 @@
 #define CANOPEN_TIMERS_SRC_CO_NVM_LINUX_HPP_
 
 #include "co_if_nvm.h"
+#include "driver_slots.hpp"
 
 #include <fstream>
 #include <string>
 
 class co_nvm_linux {
 public:
-    static const CO_IF_NVM_DRV& NVMDriver();
+    static constexpr size_t MaxInstances { 128 }; // one per node
+
+    // Every node needs a file of its own, the first one gets the usual `./kconvm.dat'
+    co_nvm_linux();
+    ~co_nvm_linux();
+    co_nvm_linux(const co_nvm_linux&) = delete;
+    co_nvm_linux& operator=(const co_nvm_linux&) = delete;
+
+    // Only with a driver slot of its own, nullptr once all MaxInstances are taken
+    const CO_IF_NVM_DRV* NVMDriver() const;
 
 private:
-    static const CO_IF_NVM_DRV s_coNvmDrv;
-    static const std::string c_nvmFilePath;
+    using Slots = DriverSlots<co_nvm_linux, MaxInstances>;
 
-    static std::fstream s_nvmFile;
+    template <size_t Slot>
+    struct Trampolines;
+
+    static const std::string c_nvmFilePath;
 
-    static void Init();
-    static uint32_t Read(uint32_t start, uint8_t* buffer, uint32_t size);
-    static uint32_t Write(uint32_t start, uint8_t* buffer, uint32_t size);
+    int m_slot { Slots::InvalidSlot };
+    std::string m_filePath {};
+    std::fstream m_nvmFile {};
 
-    // Make it purely static
-    co_nvm_linux() = delete;
-    ~co_nvm_linux() = delete;
+    void Init();
+    uint32_t Read(uint32_t start, uint8_t* buffer, uint32_t size);
+    uint32_t Write(uint32_t start, uint8_t* buffer, uint32_t size);
 };
 
 #endif // CANOPEN_TIMERS_SRC_CO_NVM_LINUX_HPP_
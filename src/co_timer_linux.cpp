@@ -1,26 +1,38 @@
 #include "co_timer_linux.hpp"
 #include "co_core.h"
 #include "co_tmr.h"
+#include "tracelog.hpp"
 
 #include <algorithm>
+#include <array>
 #include <csignal>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <thread>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
 #define CO_TIMER_OS_SOURCE (CLOCK_MONOTONIC)
 
 static const std::string LOG_MARKER { "[HAL::TMR] " };
 static const std::string ERR_MARKER { "E: " };
 static const std::string DBG_MARKER { "D: " };
+static const tracelog::Origin TRACE_ORIGIN { tracelog::RegisterOrigin(LOG_MARKER) };
 
 // Quick constants for nanoseconds handling
 static constexpr co_timer_linux::TimeUnit T1000ms { 1'000'000'000 };
 static constexpr co_timer_linux::TimeUnit T1ms { T1000ms / 1000 };
 
-// Overriding weak linking for internal stack timer locks
+// Overriding weak linking for internal stack timer locks. They carry no context, so they go to the timer of the node
+// the calling thread is working for; a thread that never said so gets a lock of its own, still serialized but shared
+// with every other such thread.
 extern "C" {
 void COTmrLock()
 {
@@ -33,42 +45,552 @@ void COTmrUnlock()
 }
 };
 
-const CO_IF_TIMER_DRV& co_timer_linux::TimerDriver()
+co_timer_linux::Scope::Scope(co_timer_linux& timer)
+    : m_previous(s_current)
+{
+    s_current = &timer;
+}
+
+co_timer_linux::Scope::~Scope()
+{
+    s_current = m_previous;
+}
+
+co_timer_linux::co_timer_linux()
+    : m_slot(Slots::Claim(this))
+{
+    if (m_slot == Slots::InvalidSlot)
+        std::cerr << ERR_MARKER << LOG_MARKER << "More than " << MaxInstances << " timers, this one can't be driven"
+                  << std::endl;
+}
+
+co_timer_linux::~co_timer_linux()
+{
+    Release();
+    Slots::Release(m_slot);
+}
+
+template <size_t Slot>
+struct co_timer_linux::Trampolines {
+    static void Init(uint32_t freq)
+    {
+        Slots::At(Slot)->Init(freq);
+    }
+
+    static void Reload(uint32_t reload)
+    {
+        Slots::At(Slot)->Reload(reload);
+    }
+
+    static uint32_t Delay()
+    {
+        return Slots::At(Slot)->Delay();
+    }
+
+    static void Stop()
+    {
+        Slots::At(Slot)->Stop();
+    }
+
+    static void Start()
+    {
+        Slots::At(Slot)->Start();
+    }
+
+    static uint8_t Update()
+    {
+        return Slots::At(Slot)->Update();
+    }
+
+    static constexpr CO_IF_TIMER_DRV Table { Init, Reload, Delay, Stop, Start, Update };
+};
+
+const CO_IF_TIMER_DRV* co_timer_linux::TimerDriver() const
 {
-    return s_coTmrDrv;
+    if (m_slot == Slots::InvalidSlot)
+        return nullptr;
+    return &Slots::TableFor<CO_IF_TIMER_DRV, Trampolines>(m_slot);
 }
 
 void co_timer_linux::LinkTimer(CO_TMR* tmr)
 {
-    s_tmr = tmr;
+    m_tmr = tmr;
+}
+
+void co_timer_linux::SetBackend(Backend backend)
+{
+    // Backend can be swapped only before any OS timer gets allocated by Init()
+    if (s_liveTimers.load() == 0)
+        s_backend = backend;
+}
+
+bool co_timer_linux::SetBackend(const std::string& backendName)
+{
+    for (const auto backend : { Backend::SigevThread, Backend::TimerFd, Backend::Virtual }) {
+        if (backendName == BackendName(backend)) {
+            SetBackend(backend);
+            return true;
+        }
+    }
+    return false;
+}
+
+co_timer_linux::Backend co_timer_linux::ActiveBackend()
+{
+    return s_backend;
+}
+
+std::string co_timer_linux::BackendName(Backend backend)
+{
+    switch (backend) {
+    case Backend::SigevThread:
+        return "sigev";
+    case Backend::TimerFd:
+        return "timerfd";
+    case Backend::Virtual:
+        return "virtual";
+    default:
+        return "unknown";
+    }
+}
+
+void co_timer_linux::SetVirtualTimeScale(double scale)
+{
+    s_timeScale = std::max(scale, 0.);
+}
+
+bool co_timer_linux::SetVirtualTimeScale(const std::string& scaleName)
+{
+    if (scaleName == "jump") {
+        SetVirtualTimeScale(0.);
+        return true;
+    }
+
+    char* end = nullptr;
+    const auto scale = std::strtod(scaleName.c_str(), &end);
+    if (scaleName.empty() || end == nullptr || *end != '\0' || scale <= 0.)
+        return false;
+    SetVirtualTimeScale(scale);
+    return true;
+}
+
+bool co_timer_linux::IsVirtual()
+{
+    return s_backend == Backend::Virtual;
+}
+
+std::chrono::steady_clock::time_point co_timer_linux::Now()
+{
+    if (s_backend != Backend::Virtual || !IsOSTimerValid())
+        return std::chrono::steady_clock::now();
+    return std::chrono::steady_clock::time_point(std::chrono::nanoseconds(m_virtualNow.load()));
+}
+
+co_timer_linux::TimeUnit co_timer_linux::StepVirtual(TimeUnit idleStepNs)
+{
+    if (s_backend != Backend::Virtual || !IsOSTimerValid())
+        return idleStepNs;
+
+    struct timespec realNow { };
+    clock_gettime(CO_TIMER_OS_SOURCE, &realNow);
+    const auto real = static_cast<TimeUnit>(realNow.tv_sec) * T1000ms + static_cast<TimeUnit>(realNow.tv_nsec);
+    const auto realElapsed = real - m_lastStepReal;
+    m_lastStepReal = real;
+
+    // Jump mode targets the next deadline (or an idle step if there's none), scaled mode follows the real clock
+    const auto now = m_virtualNow.load();
+    const auto deadline = m_armedDeadline.load();
+    if (s_timeScale <= 0.)
+        m_virtualTarget = (deadline != 0) ? std::max(now, deadline) : now + idleStepNs;
+    else
+        m_virtualTarget = std::max(m_virtualTarget, now) + static_cast<TimeUnit>(realElapsed * s_timeScale);
+
+    // At most one expiry per step, so that the node gets to process it before time moves on again
+    if (deadline != 0 && deadline <= m_virtualTarget) {
+        m_virtualNow = std::max(now, deadline);
+        ServiceExpiry();
+        auto consumed = deadline;
+        m_armedDeadline.compare_exchange_strong(consumed, 0); // nobody re-armed it
+        return 0;
+    }
+
+    m_virtualNow = m_virtualTarget;
+    if (s_timeScale <= 0.)
+        return 0;
+
+    // Nothing due yet: caller can idle until the next deadline, as seen through the time scale
+    auto idle = idleStepNs;
+    if (deadline != 0)
+        idle = std::min(idle, static_cast<TimeUnit>((deadline - m_virtualTarget) / s_timeScale));
+    return idle;
+}
+
+void co_timer_linux::SetArmMode(ArmMode mode)
+{
+    s_armMode = mode;
+}
+
+bool co_timer_linux::SetArmMode(const std::string& modeName)
+{
+    for (const auto mode : { ArmMode::Relative, ArmMode::Absolute }) {
+        if (modeName == ArmModeName(mode)) {
+            SetArmMode(mode);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string co_timer_linux::ArmModeName(ArmMode mode)
+{
+    switch (mode) {
+    case ArmMode::Relative:
+        return "relative";
+    case ArmMode::Absolute:
+        return "absolute";
+    default:
+        return "unknown";
+    }
+}
+
+void co_timer_linux::SetServiceMode(ServiceMode mode)
+{
+    // Dropping the stack lock is only safe if nothing is running yet
+    if (s_liveTimers.load() == 0)
+        s_serviceMode = mode;
+}
+
+bool co_timer_linux::SetServiceMode(const std::string& modeName)
+{
+    for (const auto mode : { ServiceMode::Thread, ServiceMode::Deferred }) {
+        if (modeName == ServiceModeName(mode)) {
+            SetServiceMode(mode);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string co_timer_linux::ServiceModeName(ServiceMode mode)
+{
+    switch (mode) {
+    case ServiceMode::Thread:
+        return "thread";
+    case ServiceMode::Deferred:
+        return "deferred";
+    default:
+        return "unknown";
+    }
+}
+
+void co_timer_linux::SetDelaySource(DelaySource source)
+{
+    s_delaySource = source;
+}
+
+bool co_timer_linux::SetDelaySource(const std::string& sourceName)
+{
+    for (const auto source : { DelaySource::Syscall, DelaySource::Vdso }) {
+        if (sourceName == DelaySourceName(source)) {
+            SetDelaySource(source);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string co_timer_linux::DelaySourceName(DelaySource source)
+{
+    switch (source) {
+    case DelaySource::Syscall:
+        return "syscall";
+    case DelaySource::Vdso:
+        return "vdso";
+    default:
+        return "unknown";
+    }
+}
+
+void co_timer_linux::BenchmarkDelay(size_t iterations)
+{
+    // Runs on a private timer that is not linked to any stack, expiries are simply dropped
+    const auto prevSource = s_delaySource;
+    co_timer_linux bench {};
+    bench.Init(500000);
+
+    std::cout << LOG_MARKER << "Benchmarking Delay() on " << BackendName(s_backend) << " backend, " << iterations
+              << " iterations" << std::endl;
+    for (const auto source : { DelaySource::Syscall, DelaySource::Vdso }) {
+        s_delaySource = source;
+        bench.Reload(500000); // 1s ahead, never expires during the run
+        bench.Start();
+
+        // Delay() alone, then the full sequence COTmrCreate() goes through when inserting a new head soft-timer
+        uint64_t sink = 0;
+        auto start = bench.MonotonicNow();
+        for (size_t idx = 0; idx < iterations; idx++)
+            sink += bench.Delay();
+        const auto delayNs = bench.MonotonicNow() - start;
+
+        start = bench.MonotonicNow();
+        for (size_t idx = 0; idx < iterations; idx++) {
+            const auto remaining = bench.Delay();
+            bench.Stop();
+            bench.Reload(std::max(remaining, 2U) - 1);
+            bench.Start();
+        }
+        const auto insertNs = bench.MonotonicNow() - start;
+
+        std::cout << LOG_MARKER << DelaySourceName(source) << ": Delay() " << (delayNs * 1000 / iterations) / 1000.
+                  << " ns/call, insert sequence " << (insertNs * 1000 / iterations) / 1000. << " ns/call"
+                  << ((sink == 0) ? " (timer not armed?)" : "") << std::endl;
+    }
+
+    bench.DisarmOSTimer();
+    s_delaySource = prevSource;
+}
+
+bool co_timer_linux::ServicePending()
+{
+    if (!m_servicePending.exchange(false))
+        return false;
+
+    uint64_t posted = 0;
+    [[maybe_unused]] const auto rd = read(m_notifyFd, &posted, sizeof(posted));
+    ServiceExpiry();
+    return true;
+}
+
+void co_timer_linux::MarkProcessed()
+{
+    const auto deadline = m_unprocessedDeadline.exchange(0);
+    if (deadline == 0)
+        return;
+
+    const auto now = MonotonicNow();
+    if (now >= deadline)
+        m_processLatency.Record(now - deadline);
+}
+
+int co_timer_linux::NotifyFd()
+{
+    return m_notifyFd;
+}
+
+void co_timer_linux::SetNotifyOnService(bool enable)
+{
+    // A node thread blocking on NotifyFd() still has to run COTmrProcess after the expiry was serviced elsewhere
+    m_notifyOnService = enable;
+}
+
+void co_timer_linux::SetCoalescingSlack(TimeUnit slackNs)
+{
+    s_coalesceSlackNs = slackNs;
+}
+
+co_timer_linux::CoalescingStats co_timer_linux::Coalescing()
+{
+    CoalescingStats stats {};
+    stats.slackNs = s_coalesceSlackNs;
+    stats.wakeups = m_wakeups.load();
+    stats.coalescedExpiries = m_coalescedExpiries.load();
+    stats.maxAddedNs = m_maxSlackAddedNs.load();
+    return stats;
+}
+
+co_timer_linux::DriftStats co_timer_linux::Drift()
+{
+    DriftStats stats {};
+    stats.anchoredArms = m_anchoredArms.load();
+    stats.driftAvoidedNs = m_driftAvoidedNs.load();
+    stats.maxDriftNs = m_maxDriftNs.load();
+    return stats;
+}
+
+co_timer_linux::ExpiryStats co_timer_linux::Statistics()
+{
+    ExpiryStats stats {};
+    stats.latenessNs = m_lateness.Take();
+    stats.processLatencyNs = m_processLatency.Take();
+    stats.arms = m_arms.load();
+    stats.services = m_services.load();
+    stats.missedDeadlines = m_missedDeadlines.load();
+    stats.earlyServices = m_earlyServices.load();
+    stats.unservicedExpiries = m_unservicedExpiries.load();
+    stats.lastArmNs = m_lastArmNs.load();
+    stats.lastServiceNs = m_lastServiceNs.load();
+    return stats;
+}
+
+void co_timer_linux::DumpStatistics()
+{
+    const auto stats = Statistics();
+    const auto now = MonotonicNow();
+    std::cout << LOG_MARKER << "Expiry lateness [ns] " << stats.latenessNs << "\n"
+              << LOG_MARKER << "Expiry to process [ns] " << stats.processLatencyNs << "\n"
+              << LOG_MARKER << "Arms " << stats.arms << ", services " << stats.services << ", missed (>"
+              << DeadlineMissNs << " ns) " << stats.missedDeadlines << ", early " << stats.earlyServices
+              << ", never serviced " << stats.unservicedExpiries << "\n"
+              << LOG_MARKER << "Last arm " << (stats.lastArmNs ? (now - stats.lastArmNs) / T1ms : 0)
+              << " ms ago, last service " << (stats.lastServiceNs ? (now - stats.lastServiceNs) / T1ms : 0)
+              << " ms ago" << std::endl;
+
+    const auto coal = Coalescing();
+    if (coal.slackNs > 0) {
+        const auto expiries = coal.wakeups + coal.coalescedExpiries;
+        std::cout << LOG_MARKER << "Coalescing slack " << coal.slackNs << " ns: " << expiries << " expiries in "
+                  << coal.wakeups << " wakeups (-" << (expiries ? coal.coalescedExpiries * 100 / expiries : 0)
+                  << "%), worst added latency " << coal.maxAddedNs << " ns" << std::endl;
+    }
+
+    const auto wd = WatchdogStatistics();
+    std::cout << LOG_MARKER << "Watchdog checks " << wd.checks << ", stalls " << wd.stalls << " (re-armed "
+              << wd.rearms << ", serviced " << wd.directServices << "), stalled " << wd.totalStallNs / T1ms
+              << " ms total, worst " << wd.maxStallNs / T1ms << " ms" << std::endl;
+}
+
+void co_timer_linux::Watchdog()
+{
+    if (!m_tmr)
+        return;
+
+    m_wdChecks++;
+    const auto now = MonotonicNow();
+
+    // Peek at the stack's pending soft-timer list with the same lock the stack itself uses
+    bool pending = false;
+    {
+        std::scoped_lock tmrGuard(m_lock);
+        pending = (m_tmr->Use != nullptr);
+    }
+
+    // Nothing armed means either disarmed, or a deadline that expired long enough ago that its service would have
+    // already re-armed the OS timer. With coalescing the OS timer only fires once the slack it got is over
+    const auto requested = m_armedDeadline.load();
+    const auto deadline = (requested != 0) ? requested + m_armedSlackNs.load() : 0;
+    const bool armed = (deadline != 0) && (now < deadline + WatchdogGraceNs);
+    if (!pending || armed) {
+        m_stallSince = 0;
+        return;
+    }
+
+    // The stack might be in the middle of a legit Stop/Reload/Start sequence: only act if it lasts over the grace time
+    // Stall is counted from the missed deadline, unless a recovery already happened after it
+    if (m_stallSince == 0) {
+        m_stallSince = (deadline != 0) ? std::max(deadline, m_wdLastRecoveryNs.load()) : now;
+        return;
+    }
+    if (now < m_stallSince + WatchdogGraceNs)
+        return;
+
+    // Confirm the stall and re-arm in one critical section, the timer thread could have serviced the list and armed
+    // the OS timer since the peek above, and a stale delta must not replace that
+    bool rearmed = false;
+    {
+        std::scoped_lock tmrGuard(m_lock);
+        const auto current = m_armedDeadline.load();
+        const bool stillArmed
+            = (current != 0) && (MonotonicNow() < current + m_armedSlackNs.load() + WatchdogGraceNs);
+        if (m_tmr->Use == nullptr || stillArmed) {
+            m_stallSince = 0;
+            return;
+        }
+        if (m_tmr->Use->Delta > 0) {
+            Reload(m_tmr->Use->Delta);
+            Start();
+            rearmed = true;
+        }
+    }
+
+    const auto stall = now - m_stallSince;
+    m_stallSince = 0;
+    m_wdStalls++;
+    m_wdTotalStallNs += stall;
+    auto prevMax = m_wdMaxStallNs.load();
+    while (stall > prevMax && !m_wdMaxStallNs.compare_exchange_weak(prevMax, stall)) { }
+    m_wdLastRecoveryNs = now;
+
+    // Runs on the node thread: a record for the trace writer, not a flush to the console
+    const auto stallMs = static_cast<uint32_t>(stall / T1ms);
+    if (rearmed) {
+        tracelog::Log(tracelog::Level::Warning, TRACE_ORIGIN, tracelog::Event::TimerRearmed, "Watchdog", 0, stallMs);
+        m_wdRearms++;
+    } else {
+        // Servicing takes the stack lock itself, timers the timer thread got to meanwhile are simply not due anymore
+        tracelog::Log(tracelog::Level::Warning, TRACE_ORIGIN, tracelog::Event::TimerServiced, "Watchdog", 0, stallMs);
+        m_wdDirectServices++;
+        ServiceStack(now);
+    }
+}
+
+co_timer_linux::WatchdogStats co_timer_linux::WatchdogStatistics()
+{
+    WatchdogStats stats {};
+    stats.checks = m_wdChecks.load();
+    stats.stalls = m_wdStalls.load();
+    stats.rearms = m_wdRearms.load();
+    stats.directServices = m_wdDirectServices.load();
+    stats.totalStallNs = m_wdTotalStallNs.load();
+    stats.maxStallNs = m_wdMaxStallNs.load();
+    stats.lastRecoveryNs = m_wdLastRecoveryNs.load();
+    return stats;
+}
+
+void co_timer_linux::Release()
+{
+    if (!IsOSTimerValid())
+        return;
+    RemoveOSTimer();
+    s_liveTimers--;
+    if (m_notifyFd >= 0)
+        close(m_notifyFd);
+    m_notifyFd = -1;
+
+    if (s_armMode == ArmMode::Absolute) {
+        const auto drift = Drift();
+        std::cout << LOG_MARKER << "Absolute arming avoided " << drift.driftAvoidedNs << " ns of drift over "
+                  << drift.anchoredArms << " reloads (worst " << drift.maxDriftNs << " ns)" << std::endl;
+    }
 }
 
 void co_timer_linux::Lock()
 {
-    s_lock.lock();
+    // Deferred servicing keeps every soft-timer operation on the node thread, there's nothing to serialize
+    if (s_serviceMode == ServiceMode::Deferred)
+        return;
+    if (s_current)
+        s_current->m_lock.lock();
+    else
+        UnscopedLock().lock();
 }
 
 void co_timer_linux::Unlock()
 {
-    s_lock.unlock();
+    if (s_serviceMode == ServiceMode::Deferred)
+        return;
+    if (s_current)
+        s_current->m_lock.unlock();
+    else
+        UnscopedLock().unlock();
 }
 
-const CO_IF_TIMER_DRV co_timer_linux::s_coTmrDrv {
-    co_timer_linux::Init,
-    co_timer_linux::Reload,
-    co_timer_linux::Delay,
-    co_timer_linux::Stop,
-    co_timer_linux::Start,
-    co_timer_linux::Update,
-};
-
-co_timer_linux::TimeUnit co_timer_linux::s_tickRateNanoSec { T1ms }; // 1ms by default
-CO_TMR* co_timer_linux::s_tmr { nullptr };
-std::mutex co_timer_linux::s_lock {};
-timer_t co_timer_linux::s_timerId {};
-co_timer_linux::TimeUnit co_timer_linux::s_tempSec { 0 };
-co_timer_linux::TimeUnit co_timer_linux::s_tempNanosec { 0 };
+rt_mutex& co_timer_linux::UnscopedLock()
+{
+    // Built on first use rather than during static initialization, by then the --pi-locks setting is in place
+    static rt_mutex s_lock {};
+    return s_lock;
+}
 
+co_timer_linux::Backend co_timer_linux::s_backend { Backend::TimerFd };
+double co_timer_linux::s_timeScale { 0. };
+co_timer_linux::ArmMode co_timer_linux::s_armMode { ArmMode::Relative };
+co_timer_linux::ServiceMode co_timer_linux::s_serviceMode { ServiceMode::Thread };
+co_timer_linux::DelaySource co_timer_linux::s_delaySource { DelaySource::Vdso };
+co_timer_linux::TimeUnit co_timer_linux::s_coalesceSlackNs { 0 };
+std::atomic<size_t> co_timer_linux::s_liveTimers { 0 };
+thread_local co_timer_linux* co_timer_linux::s_current { nullptr };
+thread_local bool co_timer_linux::s_inService { false };
+thread_local co_timer_linux::TimeUnit co_timer_linux::s_batchHorizon { 0 };
 void co_timer_linux::Init(uint32_t freq)
 {
     struct timespec timeRes { };
@@ -81,39 +603,86 @@ void co_timer_linux::Init(uint32_t freq)
         std::cerr << ERR_MARKER << LOG_MARKER << "clock_getres failed with errno " << tempErrno << std::endl;
     }
 
-    s_tickRateNanoSec = std::max(1UL, T1000ms / freq); // Frequency in hertz to period in ns
+    m_tickRateNanoSec = std::max(1UL, T1000ms / freq); // Frequency in hertz to period in ns
     std::cout << LOG_MARKER << "Expected tick frequency " << freq << " Hz, effective tick precision "
-              << s_tickRateNanoSec << " ns" << std::endl;
+              << m_tickRateNanoSec << " ns" << std::endl;
+
+    std::cout << LOG_MARKER << "Using " << BackendName(s_backend) << " backend, " << ArmModeName(s_armMode)
+              << " arming, " << ServiceModeName(s_serviceMode) << " servicing, " << DelaySourceName(s_delaySource)
+              << " delay" << std::endl;
+
+    // Pick up the lock protocol requested by the RT profile, nothing is running yet
+    if (IsOSTimerValid())
+        return;
+    m_lock.Reinitialize();
 
-    CreateOSTimer();
+    if (m_notifyFd < 0)
+        m_notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (CreateOSTimer() == 0)
+        s_liveTimers++;
 }
 
 void co_timer_linux::Reload(uint32_t reload)
 {
-    s_tempNanosec = (reload * s_tickRateNanoSec) % T1000ms;
-    s_tempSec = (reload * s_tickRateNanoSec) / T1000ms;
-    if (s_timerId)
-        ArmOSTimer(s_tempSec, s_tempNanosec);
+    const auto period = reload * m_tickRateNanoSec;
+    m_tempNanosec = period % T1000ms;
+    m_tempSec = period / T1000ms;
+
+    if (s_armMode == ArmMode::Absolute || s_coalesceSlackNs > 0) {
+        // While servicing an expiry, the stack hands over the delta to the next soft-timer, which is relative to the
+        // expired deadline: anchoring there keeps the service latency from piling up on every period. Coalescing
+        // needs the same, or a chained soft-timer would never fall within the batch of the previous one
+        const auto now = MonotonicNow();
+        auto anchor = now;
+        if (s_inService && m_lastExpiry != 0 && m_lastExpiry <= now) {
+            anchor = m_lastExpiry;
+            const auto drift = now - anchor;
+            m_anchoredArms++;
+            m_driftAvoidedNs += drift;
+            auto prevMax = m_maxDriftNs.load();
+            while (drift > prevMax && !m_maxDriftNs.compare_exchange_weak(prevMax, drift)) { }
+        }
+        m_tempDeadline = anchor + period;
+        if (IsOSTimerValid())
+            ArmOSTimerAt(m_tempDeadline);
+        return;
+    }
+
+    if (IsOSTimerValid())
+        ArmOSTimer(m_tempSec, m_tempNanosec);
 }
 
 uint32_t co_timer_linux::Delay()
 {
+    // The armed deadline is already known, reading the clock through the vDSO saves a syscall on every insertion
+    if (s_delaySource == DelaySource::Vdso) {
+        const auto deadline = m_armedDeadline.load();
+        const auto now = MonotonicNow();
+        return static_cast<uint32_t>((deadline > now) ? (deadline - now) / m_tickRateNanoSec : 0);
+    }
+
+    // The OS timer runs to the deadline plus whatever coalescing slack it got, the stack wants the one it asked for
     const auto remTime = RemainingOSTimer();
-    auto ticks = (remTime.it_value.tv_sec * T1000ms) / s_tickRateNanoSec;
-    ticks += (remTime.it_value.tv_nsec) / s_tickRateNanoSec;
-    return static_cast<uint32_t>(ticks);
+    const auto remaining = static_cast<TimeUnit>(remTime.it_value.tv_sec) * T1000ms
+        + static_cast<TimeUnit>(remTime.it_value.tv_nsec);
+    const auto slack = m_armedSlackNs.load();
+    return static_cast<uint32_t>((remaining > slack) ? (remaining - slack) / m_tickRateNanoSec : 0);
 }
 
 void co_timer_linux::Stop()
 {
-    if (!s_timerId)
+    if (!IsOSTimerValid())
         return;
     DisarmOSTimer();
 }
 
 void co_timer_linux::Start()
 {
-    ArmOSTimer(s_tempSec, s_tempNanosec);
+    if (s_armMode == ArmMode::Absolute || s_coalesceSlackNs > 0) {
+        ArmOSTimerAt(m_tempDeadline);
+        return;
+    }
+    ArmOSTimer(m_tempSec, m_tempNanosec);
 }
 
 uint8_t co_timer_linux::Update()
@@ -122,16 +691,50 @@ uint8_t co_timer_linux::Update()
 }
 
 int co_timer_linux::CreateOSTimer()
+{
+    switch (s_backend) {
+    case Backend::SigevThread:
+        return CreateSigevTimer();
+    case Backend::TimerFd:
+        return CreateTimerFd();
+    case Backend::Virtual:
+        return CreateVirtualTimer();
+    default:
+        return -1;
+    }
+}
+
+int co_timer_linux::CreateVirtualTimer()
+{
+    // Virtual timeline starts from the real one, so that timestamps are still comparable with steady_clock
+    struct timespec now { };
+    clock_gettime(CO_TIMER_OS_SOURCE, &now);
+    m_virtualNow = static_cast<TimeUnit>(now.tv_sec) * T1000ms + static_cast<TimeUnit>(now.tv_nsec);
+    m_lastStepReal = m_virtualNow.load();
+    m_virtualTarget = m_virtualNow.load();
+    return 0;
+}
+
+int co_timer_linux::CreateSigevTimer()
 {
     struct sigevent timerTrigger { };
     std::memset(&timerTrigger, 0, sizeof(timerTrigger));
     timerTrigger.sigev_notify = SIGEV_THREAD;
     timerTrigger.sigev_notify_function = &co_timer_linux::ISROSTimer;
+    timerTrigger.sigev_value.sival_ptr = this;
     timerTrigger.sigev_notify_attributes = nullptr;
 
+    // Helper threads are spawned by glibc, so the RT profile can only reach them through their attributes. They're
+    // copied by timer_create(), this timer's own can go right after.
+    pthread_attr_t helperAttr {};
+    pthread_attr_init(&helperAttr);
+    if (rt_profile::FillAttributes(rt_profile::Thread::Timer, helperAttr))
+        timerTrigger.sigev_notify_attributes = &helperAttr;
+
     // Allocate timer object and make it raise SIGALRM on trigger
-    auto rc = timer_create(CO_TIMER_OS_SOURCE, &timerTrigger, &s_timerId);
+    auto rc = timer_create(CO_TIMER_OS_SOURCE, &timerTrigger, &m_timerId);
     auto tempErrno = errno;
+    pthread_attr_destroy(&helperAttr);
     if (rc != 0) {
         std::cerr << ERR_MARKER << LOG_MARKER << "timer_create failed with errno " << tempErrno << std::endl;
     }
@@ -139,8 +742,70 @@ int co_timer_linux::CreateOSTimer()
     return rc;
 }
 
+int co_timer_linux::CreateTimerFd()
+{
+    // Non-blocking, so that a spurious wakeup never leaves the service thread stuck in read()
+    m_timerFd = timerfd_create(CO_TIMER_OS_SOURCE, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timerFd < 0) {
+        const auto tempErrno = errno;
+        std::cerr << ERR_MARKER << LOG_MARKER << "timerfd_create failed with errno " << tempErrno << std::endl;
+        return -1;
+    }
+
+    // Used only for waking up the service thread when the timer gets released
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_wakeFd < 0 || m_epollFd < 0) {
+        const auto tempErrno = errno;
+        std::cerr << ERR_MARKER << LOG_MARKER << "failed to allocate service descriptors, errno " << tempErrno
+                  << std::endl;
+        RemoveOSTimer();
+        return -1;
+    }
+
+    for (const auto fd : { m_timerFd, m_wakeFd }) {
+        struct epoll_event ev { };
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            const auto tempErrno = errno;
+            std::cerr << ERR_MARKER << LOG_MARKER << "epoll_ctl failed with errno " << tempErrno << std::endl;
+            RemoveOSTimer();
+            return -1;
+        }
+    }
+
+    m_stopService.store(false);
+    m_serviceThread = std::make_unique<std::thread>([this]() { ServiceLoop(); });
+    return 0;
+}
+
 int co_timer_linux::RemoveOSTimer()
 {
+    if (s_backend == Backend::Virtual) {
+        m_armedDeadline = 0;
+        m_virtualNow = 0;
+        return 0;
+    }
+
+    if (s_backend == Backend::TimerFd) {
+        m_stopService.store(true);
+        if (m_wakeFd >= 0) {
+            const uint64_t wake = 1;
+            [[maybe_unused]] const auto wr = write(m_wakeFd, &wake, sizeof(wake));
+        }
+        if (m_serviceThread && m_serviceThread->joinable())
+            m_serviceThread->join();
+        m_serviceThread.reset();
+
+        for (auto* fd : { &m_timerFd, &m_epollFd, &m_wakeFd }) {
+            if (*fd >= 0)
+                close(*fd);
+            *fd = -1;
+        }
+        return 0;
+    }
+
     struct sigaction timerAction { };
     std::memset(&timerAction, 0, sizeof(timerAction));
     timerAction.sa_handler = SIG_DFL;
@@ -154,15 +819,35 @@ int co_timer_linux::RemoveOSTimer()
     }
 
     // Disarm and drop timer
-    rc = timer_delete(&s_timerId);
+    rc = timer_delete(m_timerId);
     tempErrno = errno;
     if (rc != 0) {
         std::cerr << ERR_MARKER << LOG_MARKER << "timer_delete failed with errno " << tempErrno << std::endl;
     }
+    m_timerId = {};
 
     return rc;
 }
 
+bool co_timer_linux::IsOSTimerValid() const
+{
+    if (s_backend == Backend::TimerFd)
+        return m_timerFd >= 0;
+    if (s_backend == Backend::Virtual)
+        return m_virtualNow.load() != 0;
+    return !!m_timerId;
+}
+
+co_timer_linux::TimeUnit co_timer_linux::MonotonicNow() const
+{
+    if (s_backend == Backend::Virtual)
+        return m_virtualNow.load();
+
+    struct timespec now { };
+    clock_gettime(CO_TIMER_OS_SOURCE, &now);
+    return static_cast<TimeUnit>(now.tv_sec) * T1000ms + static_cast<TimeUnit>(now.tv_nsec);
+}
+
 int co_timer_linux::ArmOSTimer(TimeUnit periodSec, TimeUnit periodNanosec)
 {
     // A relatively verbose way to do a few things:
@@ -175,14 +860,90 @@ int co_timer_linux::ArmOSTimer(TimeUnit periodSec, TimeUnit periodNanosec)
     timerPeriod.it_value.tv_nsec
         = static_cast<decltype(timerPeriod.it_value.tv_nsec)>(std::clamp(periodNanosec, 0UL, T1000ms - 1));
 
-    auto rc = timer_settime(s_timerId, 0, &timerPeriod, nullptr);
+    // Coalescing works on absolute deadlines
+    if (s_coalesceSlackNs > 0 && (timerPeriod.it_value.tv_sec != 0 || timerPeriod.it_value.tv_nsec != 0))
+        return ArmOSTimerAt(MonotonicNow() + timerPeriod.it_value.tv_sec * T1000ms + timerPeriod.it_value.tv_nsec);
+
+    // Virtual clock has no OS timer at all, deadline tracking below is all it needs
+    int rc = 0;
+    if (s_backend == Backend::TimerFd)
+        rc = timerfd_settime(m_timerFd, 0, &timerPeriod, nullptr);
+    else if (s_backend == Backend::SigevThread)
+        rc = timer_settime(m_timerId, 0, &timerPeriod, nullptr);
+    auto tempErrno = errno;
+    if (rc != 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "timer settime failed with errno " << tempErrno << std::endl;
+    }
+
+    const auto period = timerPeriod.it_value.tv_sec * T1000ms + timerPeriod.it_value.tv_nsec;
+    const auto now = MonotonicNow();
+    TrackArm((period == 0) ? 0 : now + period, now);
+    return rc;
+}
+
+int co_timer_linux::ArmOSTimerAt(TimeUnit deadline)
+{
+    // Same as the relative flavour, a zeroed deadline means "disarm"
+    if (deadline == 0)
+        return DisarmOSTimer();
+
+    auto osDeadline = deadline;
+    if (s_coalesceSlackNs > 0) {
+        // Already due within the wakeup being serviced: ServiceExpiry() picks it up in the same batch
+        if (s_inService && deadline <= s_batchHorizon) {
+            TrackArm(deadline, MonotonicNow());
+            return 0;
+        }
+
+        // Hold the wakeup back to the last pending soft-timer within the slack window, the batch then takes them all.
+        // Called from the stack's own Reload/Start, so the list is already under COTmrLock
+        if (m_tmr && m_tmr->Use) {
+            TimeUnit cumulative = 0;
+            for (auto* next = m_tmr->Use->Next; next != nullptr; next = next->Next) {
+                cumulative += next->Delta * m_tickRateNanoSec;
+                if (cumulative > s_coalesceSlackNs)
+                    break;
+                osDeadline = deadline + cumulative;
+            }
+        }
+        const auto added = osDeadline - deadline;
+        auto prevMax = m_maxSlackAddedNs.load();
+        while (added > prevMax && !m_maxSlackAddedNs.compare_exchange_weak(prevMax, added)) { }
+    }
+
+    struct itimerspec timerDeadline { };
+    std::memset(&timerDeadline, 0, sizeof(timerDeadline));
+    timerDeadline.it_value.tv_sec = static_cast<decltype(timerDeadline.it_value.tv_sec)>(osDeadline / T1000ms);
+    timerDeadline.it_value.tv_nsec = static_cast<decltype(timerDeadline.it_value.tv_nsec)>(osDeadline % T1000ms);
+
+    int rc = 0;
+    if (s_backend == Backend::TimerFd)
+        rc = timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &timerDeadline, nullptr);
+    else if (s_backend == Backend::SigevThread)
+        rc = timer_settime(m_timerId, TIMER_ABSTIME, &timerDeadline, nullptr);
     auto tempErrno = errno;
     if (rc != 0) {
-        std::cerr << ERR_MARKER << LOG_MARKER << "timer_settime failed with errno " << tempErrno << std::endl;
+        std::cerr << ERR_MARKER << LOG_MARKER << "timer settime (absolute) failed with errno " << tempErrno
+                  << std::endl;
     }
+
+    TrackArm(deadline, MonotonicNow(), osDeadline - deadline);
     return rc;
 }
 
+void co_timer_linux::TrackArm(TimeUnit deadline, TimeUnit now, TimeUnit slackNs)
+{
+    m_arms++;
+    m_lastArmNs = now;
+    m_armedSlackNs = slackNs;
+
+    // A deadline that already passed and never reached ServiceOSTimer() is gone for good once overwritten: with
+    // timerfd the expiration counter gets cleared, with SIGEV_THREAD the late service will see the new deadline
+    const auto prevDeadline = m_armedDeadline.exchange(deadline);
+    if (prevDeadline != 0 && prevDeadline + DeadlineMissNs < now && m_lastServicedDeadline.load() != prevDeadline)
+        m_unservicedExpiries++;
+}
+
 int co_timer_linux::DisarmOSTimer()
 {
     return ArmOSTimer(0, 0);
@@ -193,16 +954,124 @@ struct itimerspec co_timer_linux::RemainingOSTimer()
     struct itimerspec timerRemaining { };
     std::memset(&timerRemaining, 0, sizeof(timerRemaining));
 
-    auto rc = timer_gettime(s_timerId, &timerRemaining);
+    if (s_backend == Backend::Virtual) {
+        const auto deadline = m_armedDeadline.load();
+        const auto now = MonotonicNow();
+        const auto remaining = (deadline > now) ? deadline - now : 0;
+        timerRemaining.it_value.tv_sec = static_cast<decltype(timerRemaining.it_value.tv_sec)>(remaining / T1000ms);
+        timerRemaining.it_value.tv_nsec = static_cast<decltype(timerRemaining.it_value.tv_nsec)>(remaining % T1000ms);
+        return timerRemaining;
+    }
+
+    auto rc = (s_backend == Backend::TimerFd) ? timerfd_gettime(m_timerFd, &timerRemaining)
+                                               : timer_gettime(m_timerId, &timerRemaining);
     auto tempErrno = errno;
     if (rc != 0) {
-        std::cerr << ERR_MARKER << LOG_MARKER << "timer_gettime failed with errno " << tempErrno << std::endl;
+        std::cerr << ERR_MARKER << LOG_MARKER << "timer gettime failed with errno " << tempErrno << std::endl;
     }
 
     return timerRemaining;
 }
 
-void co_timer_linux::ISROSTimer([[maybe_unused]] __sigval_t signum)
+void co_timer_linux::ISROSTimer(__sigval_t timer)
+{
+    static_cast<co_timer_linux*>(timer.sival_ptr)->ServiceOSTimer();
+}
+
+void co_timer_linux::ServiceLoop()
+{
+    rt_profile::ApplyToCurrentThread(rt_profile::Thread::Timer);
+
+    std::array<struct epoll_event, 2> events {};
+    while (!m_stopService.load()) {
+        const auto activeFds = epoll_wait(m_epollFd, events.data(), events.size(), -1);
+        if (activeFds < 0) {
+            const auto tempErrno = errno;
+            if (tempErrno == EINTR)
+                continue;
+            std::cerr << ERR_MARKER << LOG_MARKER << "epoll_wait failed with errno " << tempErrno << std::endl;
+            break;
+        }
+
+        for (int idx = 0; idx < activeFds; idx++) {
+            if (events[idx].data.fd != m_timerFd)
+                continue;
+
+            // One-shot timer, so expiration count is either 0 (disarmed/rearmed meanwhile) or 1
+            uint64_t expirations = 0;
+            if (read(m_timerFd, &expirations, sizeof(expirations)) != sizeof(expirations) || expirations == 0)
+                continue;
+            ServiceOSTimer();
+        }
+    }
+}
+
+void co_timer_linux::ServiceOSTimer()
+{
+    if (!m_tmr)
+        return;
+
+    if (s_serviceMode == ServiceMode::Deferred) {
+        // Post once, the node thread services whatever is due when it gets there
+        if (!m_servicePending.exchange(true)) {
+            const uint64_t post = 1;
+            [[maybe_unused]] const auto wr = write(m_notifyFd, &post, sizeof(post));
+        }
+        return;
+    }
+
+    ServiceExpiry();
+    if (m_notifyOnService.load(std::memory_order_relaxed)) {
+        const uint64_t post = 1;
+        [[maybe_unused]] const auto wr = write(m_notifyFd, &post, sizeof(post));
+    }
+}
+
+void co_timer_linux::ServiceExpiry()
+{
+    const auto now = MonotonicNow();
+    auto expiry = m_armedDeadline.load();
+    m_wakeups++;
+    RecordService(expiry, now);
+    m_unprocessedDeadline = expiry;
+
+    // With coalescing, every soft-timer the stack re-arms at or before this wakeup is serviced in the same batch
+    s_batchHorizon = (s_coalesceSlackNs > 0) ? std::max(now, expiry) : 0;
+    ServiceStack(expiry);
+    while (s_batchHorizon != 0) {
+        const auto next = m_armedDeadline.load();
+        if (next == 0 || next == expiry || next > s_batchHorizon)
+            break;
+
+        m_coalescedExpiries++;
+        RecordService(next, MonotonicNow());
+        expiry = next;
+        ServiceStack(expiry);
+    }
+    s_batchHorizon = 0;
+}
+
+void co_timer_linux::RecordService(TimeUnit expiry, TimeUnit now)
+{
+    m_lastServicedDeadline = expiry;
+    m_lastServiceNs = now;
+    m_services++;
+    if (expiry == 0 || now < expiry) {
+        m_earlyServices++;
+        return;
+    }
+
+    const auto lateness = now - expiry;
+    m_lateness.Record(lateness);
+    if (lateness > DeadlineMissNs)
+        m_missedDeadlines++;
+}
+
+void co_timer_linux::ServiceStack(TimeUnit expiry)
 {
-    COTmrService(s_tmr);
+    m_lastExpiry = expiry;
+    const Scope tmrScope { *this };
+    s_inService = true;
+    COTmrService(m_tmr);
+    s_inService = false;
 }
@@ -3,49 +3,233 @@
 
 #include "co_if_timer.h"
 #include "co_tmr.h"
+#include "driver_slots.hpp"
+#include "latency_histogram.hpp"
+#include "rt_profile.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <csignal>
 #include <ctime>
-#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
 
 class co_timer_linux {
 public:
     using TimeUnit = uint64_t;
 
-    static const CO_IF_TIMER_DRV& TimerDriver();
-    static void LinkTimer(CO_TMR* tmr);
+    enum class Backend {
+        SigevThread, // POSIX timer, expiry dispatched by glibc on a (possibly new) helper thread
+        TimerFd, // timerfd, expiry dispatched by a single long-lived epoll service thread
+        Virtual, // simulated clock, time only moves (and expiries only fire) through StepVirtual()
+    };
 
+    enum class ArmMode {
+        Relative, // every reload is counted from the moment the OS timer gets armed
+        Absolute, // reloads requested while servicing an expiry are anchored to that expiry's deadline
+    };
+
+    enum class ServiceMode {
+        Thread, // COTmrService runs on the thread that caught the expiry, serialized by Lock/Unlock
+        Deferred, // expiry only posts a wakeup, COTmrService runs on the node thread from ServicePending()
+    };
+
+    enum class DelaySource {
+        Syscall, // remaining time read back from the kernel with timer_gettime/timerfd_gettime
+        Vdso, // remaining time computed from the tracked deadline and a vDSO clock_gettime
+    };
+
+    struct DriftStats {
+        uint64_t anchoredArms { 0 }; // reloads anchored to the previous deadline instead of "now"
+        TimeUnit driftAvoidedNs { 0 }; // sum of the arming delays that would have been added to the periods
+        TimeUnit maxDriftNs { 0 }; // worst single arming delay
+    };
+
+    struct ExpiryStats {
+        LatencyHistogram::Snapshot latenessNs {}; // service call time minus armed deadline
+        LatencyHistogram::Snapshot processLatencyNs {}; // COTmrProcess (where TPDOs go out) time minus deadline
+        uint64_t arms { 0 }; // OS timer arm/disarm requests
+        uint64_t services { 0 }; // service calls that reached the stack
+        uint64_t missedDeadlines { 0 }; // services later than DeadlineMissNs
+        uint64_t earlyServices { 0 }; // services running before the deadline currently armed (stale expiry)
+        uint64_t unservicedExpiries { 0 }; // due deadlines overwritten by a re-arm/disarm before being serviced
+        TimeUnit lastArmNs { 0 }; // monotonic timestamp of the last arm request
+        TimeUnit lastServiceNs { 0 }; // monotonic timestamp of the last service call
+    };
+
+    struct CoalescingStats {
+        TimeUnit slackNs { 0 }; // configured slack window, 0 if coalescing is off
+        uint64_t wakeups { 0 }; // expiry wakeups that reached the stack
+        uint64_t coalescedExpiries { 0 }; // expiries serviced in the batch of an earlier wakeup, instead of their own
+        TimeUnit maxAddedNs { 0 }; // worst delay added to a deadline to share the wakeup of a later one
+    };
+
+    struct WatchdogStats {
+        uint64_t checks { 0 }; // Watchdog() calls
+        uint64_t stalls { 0 }; // pending soft-timers left without an armed OS timer for longer than WatchdogGraceNs
+        uint64_t rearms { 0 }; // recoveries done by re-arming the OS timer with the head soft-timer delta
+        uint64_t directServices { 0 }; // recoveries done by servicing the stack from the caller thread
+        TimeUnit totalStallNs { 0 }; // time spent stalled, summed over all recoveries
+        TimeUnit maxStallNs { 0 }; // longest stall before recovery
+        TimeUnit lastRecoveryNs { 0 }; // monotonic timestamp of the last recovery
+    };
+
+    static constexpr TimeUnit DeadlineMissNs { 1'000'000 };
+    static constexpr TimeUnit WatchdogGraceNs { 10'000'000 };
+
+    static constexpr size_t MaxInstances { 128 }; // timers alive at the same time, one per node
+
+    // Makes the stack's global COTmrLock()/COTmrUnlock() take this timer's lock on the calling thread, for as long
+    // as it's in scope. Every thread entering the stack on behalf of a node has to hold one.
+    class Scope {
+    public:
+        explicit Scope(co_timer_linux& timer);
+        ~Scope();
+
+    private:
+        co_timer_linux* m_previous { nullptr };
+    };
+
+    co_timer_linux();
+    ~co_timer_linux();
+    co_timer_linux(const co_timer_linux&) = delete;
+    co_timer_linux& operator=(const co_timer_linux&) = delete;
+
+    // Process-wide settings, picked up by timers initialized afterwards
+    static void SetBackend(Backend backend);
+    static bool SetBackend(const std::string& backendName);
+    static Backend ActiveBackend();
+    static std::string BackendName(Backend backend);
+    static void SetVirtualTimeScale(double scale);
+    static bool SetVirtualTimeScale(const std::string& scaleName);
+    static bool IsVirtual();
+    static void SetArmMode(ArmMode mode);
+    static bool SetArmMode(const std::string& modeName);
+    static std::string ArmModeName(ArmMode mode);
+    static void SetServiceMode(ServiceMode mode);
+    static bool SetServiceMode(const std::string& modeName);
+    static std::string ServiceModeName(ServiceMode mode);
+    static void SetDelaySource(DelaySource source);
+    static bool SetDelaySource(const std::string& sourceName);
+    static std::string DelaySourceName(DelaySource source);
+    static void SetCoalescingSlack(TimeUnit slackNs);
+    static void BenchmarkDelay(size_t iterations);
+
+    // Only with a driver slot of its own, nullptr once all MaxInstances are taken
+    const CO_IF_TIMER_DRV* TimerDriver() const;
+    void LinkTimer(CO_TMR* tmr);
+    std::chrono::steady_clock::time_point Now();
+    TimeUnit StepVirtual(TimeUnit idleStepNs); // returns how long (real ns) the caller can idle
+    bool ServicePending();
+    void MarkProcessed();
+    int NotifyFd();
+    void SetNotifyOnService(bool enable); // thread servicing posts NotifyFd() too, for COTmrProcess
+    CoalescingStats Coalescing();
+    DriftStats Drift();
+    ExpiryStats Statistics();
+    void DumpStatistics();
+    void Watchdog();
+    WatchdogStats WatchdogStatistics();
+    void Release();
+
+    // Current node's timer lock, see Scope
     static void Lock();
     static void Unlock();
 
 private:
-    static const CO_IF_TIMER_DRV s_coTmrDrv;
-
-    static TimeUnit s_tickRateNanoSec;
-    static CO_TMR* s_tmr;
-    static std::mutex s_lock;
-    static timer_t s_timerId;
-
-    static TimeUnit s_tempSec;
-    static TimeUnit s_tempNanosec;
-
-    static void Init(uint32_t freq);
-    static void Reload(uint32_t reload);
-    static uint32_t Delay();
-    static void Stop();
-    static void Start();
-    static uint8_t Update();
-
-    static int CreateOSTimer();
-    static int RemoveOSTimer();
-    static int ArmOSTimer(TimeUnit periodSec, TimeUnit periodNanosec);
-    static int DisarmOSTimer();
-    static struct itimerspec RemainingOSTimer();
-    static void ISROSTimer(__sigval_t signum);
-
-    // Make it purely static
-    co_timer_linux() = delete;
-    ~co_timer_linux() = delete;
+    using Slots = DriverSlots<co_timer_linux, MaxInstances>;
+
+    template <size_t Slot>
+    struct Trampolines;
+
+    static Backend s_backend;
+    static double s_timeScale;
+    static ArmMode s_armMode;
+    static ServiceMode s_serviceMode;
+    static DelaySource s_delaySource;
+    static TimeUnit s_coalesceSlackNs;
+    static std::atomic<size_t> s_liveTimers;
+    static thread_local co_timer_linux* s_current;
+    static thread_local bool s_inService;
+    static thread_local TimeUnit s_batchHorizon;
+
+    static rt_mutex& UnscopedLock();
+
+    int m_slot { Slots::InvalidSlot };
+    TimeUnit m_tickRateNanoSec { 1'000'000 }; // 1ms by default
+    CO_TMR* m_tmr { nullptr };
+    rt_mutex m_lock {};
+    timer_t m_timerId {};
+    int m_timerFd { -1 };
+    int m_epollFd { -1 };
+    int m_wakeFd { -1 };
+    std::unique_ptr<std::thread> m_serviceThread {};
+    std::atomic_bool m_stopService { false };
+    std::atomic<TimeUnit> m_virtualNow { 0 };
+    TimeUnit m_lastStepReal { 0 };
+    TimeUnit m_virtualTarget { 0 };
+    int m_notifyFd { -1 };
+    std::atomic_bool m_servicePending { false };
+    std::atomic_bool m_notifyOnService { false };
+    std::atomic<TimeUnit> m_unprocessedDeadline { 0 };
+    LatencyHistogram m_processLatency {};
+    std::atomic<TimeUnit> m_armedDeadline { 0 };
+    std::atomic<TimeUnit> m_armedSlackNs { 0 }; // coalescing slack the OS timer got armed with past m_armedDeadline
+    TimeUnit m_lastExpiry { 0 };
+    std::atomic<uint64_t> m_anchoredArms { 0 };
+    std::atomic<TimeUnit> m_driftAvoidedNs { 0 };
+    std::atomic<TimeUnit> m_maxDriftNs { 0 };
+    LatencyHistogram m_lateness {};
+    std::atomic<uint64_t> m_arms { 0 };
+    std::atomic<uint64_t> m_services { 0 };
+    std::atomic<uint64_t> m_missedDeadlines { 0 };
+    std::atomic<uint64_t> m_earlyServices { 0 };
+    std::atomic<uint64_t> m_unservicedExpiries { 0 };
+    std::atomic<TimeUnit> m_lastArmNs { 0 };
+    std::atomic<TimeUnit> m_lastServiceNs { 0 };
+    std::atomic<TimeUnit> m_lastServicedDeadline { 0 };
+    std::atomic<uint64_t> m_wakeups { 0 };
+    std::atomic<uint64_t> m_coalescedExpiries { 0 };
+    std::atomic<TimeUnit> m_maxSlackAddedNs { 0 };
+    TimeUnit m_stallSince { 0 };
+    std::atomic<uint64_t> m_wdChecks { 0 };
+    std::atomic<uint64_t> m_wdStalls { 0 };
+    std::atomic<uint64_t> m_wdRearms { 0 };
+    std::atomic<uint64_t> m_wdDirectServices { 0 };
+    std::atomic<TimeUnit> m_wdTotalStallNs { 0 };
+    std::atomic<TimeUnit> m_wdMaxStallNs { 0 };
+    std::atomic<TimeUnit> m_wdLastRecoveryNs { 0 };
+
+    TimeUnit m_tempSec { 0 };
+    TimeUnit m_tempNanosec { 0 };
+    TimeUnit m_tempDeadline { 0 };
+
+    void Init(uint32_t freq);
+    void Reload(uint32_t reload);
+    uint32_t Delay();
+    void Stop();
+    void Start();
+    uint8_t Update();
+
+    int CreateOSTimer();
+    int CreateSigevTimer();
+    int CreateTimerFd();
+    int CreateVirtualTimer();
+    int RemoveOSTimer();
+    bool IsOSTimerValid() const;
+    TimeUnit MonotonicNow() const;
+    int ArmOSTimer(TimeUnit periodSec, TimeUnit periodNanosec);
+    int ArmOSTimerAt(TimeUnit deadline);
+    void TrackArm(TimeUnit deadline, TimeUnit now, TimeUnit slackNs = 0);
+    int DisarmOSTimer();
+    struct itimerspec RemainingOSTimer();
+    static void ISROSTimer(__sigval_t timer);
+    void ServiceLoop();
+    void ServiceOSTimer();
+    void ServiceExpiry();
+    void RecordService(TimeUnit expiry, TimeUnit now);
+    void ServiceStack(TimeUnit expiry);
 };
 
 #endif // CANOPEN_TIMERS_SRC_CO_TIMER_LINUX_HPP_
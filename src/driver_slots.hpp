@@ -0,0 +1,56 @@
+#ifndef CANOPEN_TIMERS_SRC_DRIVER_SLOTS_HPP_
+#define CANOPEN_TIMERS_SRC_DRIVER_SLOTS_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// The stack's driver tables are plain C function pointers without a context argument. To host several nodes in one
+// process, every driver instance claims a slot and hands the stack the table compiled for that slot index, whose
+// trampolines look the instance up again on each call.
+template <typename Driver, size_t SlotCount>
+class DriverSlots {
+public:
+    static constexpr int InvalidSlot { -1 };
+
+    static int Claim(Driver* driver)
+    {
+        for (size_t slot = 0; slot < SlotCount; slot++) {
+            Driver* expected = nullptr;
+            if (s_drivers[slot].compare_exchange_strong(expected, driver))
+                return static_cast<int>(slot);
+        }
+        return InvalidSlot;
+    }
+
+    static void Release(int slot)
+    {
+        if (slot >= 0 && static_cast<size_t>(slot) < SlotCount)
+            s_drivers[slot].store(nullptr);
+    }
+
+    static inline Driver* At(size_t slot)
+    {
+        return s_drivers[slot].load(std::memory_order_acquire);
+    }
+
+    // Trampolines<N>::Table is the driver table forwarding to At(N)
+    template <typename Table, template <size_t> class Trampolines>
+    static const Table& TableFor(int slot)
+    {
+        static const auto s_tables = MakeTables<Table, Trampolines>(std::make_index_sequence<SlotCount> {});
+        return s_tables[slot];
+    }
+
+private:
+    static inline std::array<std::atomic<Driver*>, SlotCount> s_drivers {};
+
+    template <typename Table, template <size_t> class Trampolines, size_t... Slots>
+    static constexpr std::array<Table, SlotCount> MakeTables(std::index_sequence<Slots...>)
+    {
+        return { { Trampolines<Slots>::Table... } };
+    }
+};
+
+#endif // CANOPEN_TIMERS_SRC_DRIVER_SLOTS_HPP_
@@ -0,0 +1,120 @@
+#ifndef CANOPEN_TIMERS_SRC_LATENCY_HISTOGRAM_HPP_
+#define CANOPEN_TIMERS_SRC_LATENCY_HISTOGRAM_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// HDR-style log-linear histogram: every power of two is split in SubBucketCount linear slices, so the relative error
+// stays below 1/SubBucketCount across the whole uint64_t range. Recording is wait-free and safe from any thread,
+// snapshots are not atomic as a whole but every single counter is.
+class LatencyHistogram {
+public:
+    static constexpr size_t SubBucketBits { 3 };
+    static constexpr size_t SubBucketCount { 1 << SubBucketBits };
+    static constexpr size_t BucketCount { (64 - SubBucketBits + 1) * SubBucketCount };
+
+    struct Snapshot {
+        std::array<uint64_t, BucketCount> buckets {};
+        uint64_t count { 0 };
+        uint64_t sum { 0 };
+        uint64_t min { 0 };
+        uint64_t max { 0 };
+
+        inline double Mean() const
+        {
+            return count ? static_cast<double>(sum) / count : 0.;
+        }
+
+        // Returns the lower bound of the bucket holding the requested percentile (0..100)
+        inline uint64_t Percentile(double pct) const
+        {
+            if (count == 0)
+                return 0;
+
+            const auto target = static_cast<uint64_t>(std::clamp(pct, 0., 100.) / 100. * (count - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t idx = 0; idx < buckets.size(); idx++) {
+                seen += buckets[idx];
+                if (seen >= target)
+                    return std::clamp(BucketLowerBound(idx), min, max);
+            }
+            return max;
+        }
+    };
+
+    inline void Record(uint64_t value)
+    {
+        m_buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        auto prevMin = m_min.load(std::memory_order_relaxed);
+        while (value < prevMin && !m_min.compare_exchange_weak(prevMin, value, std::memory_order_relaxed)) { }
+        auto prevMax = m_max.load(std::memory_order_relaxed);
+        while (value > prevMax && !m_max.compare_exchange_weak(prevMax, value, std::memory_order_relaxed)) { }
+    }
+
+    inline Snapshot Take() const
+    {
+        Snapshot snap {};
+        for (size_t idx = 0; idx < BucketCount; idx++)
+            snap.buckets[idx] = m_buckets[idx].load(std::memory_order_relaxed);
+        snap.count = m_count.load(std::memory_order_relaxed);
+        snap.sum = m_sum.load(std::memory_order_relaxed);
+        snap.min = snap.count ? m_min.load(std::memory_order_relaxed) : 0;
+        snap.max = m_max.load(std::memory_order_relaxed);
+        return snap;
+    }
+
+    inline void Reset()
+    {
+        for (auto& bucket : m_buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        m_count.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_min.store(UINT64_MAX, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    static constexpr size_t BucketIndex(uint64_t value)
+    {
+        if (value < SubBucketCount)
+            return static_cast<size_t>(value);
+
+        const size_t msb = 63 - __builtin_clzll(value);
+        const size_t shift = msb - SubBucketBits;
+        const size_t sub = (value >> shift) & (SubBucketCount - 1);
+        return (shift + 1) * SubBucketCount + sub;
+    }
+
+    static constexpr uint64_t BucketLowerBound(size_t idx)
+    {
+        const size_t magnitude = idx / SubBucketCount;
+        const uint64_t sub = idx % SubBucketCount;
+        if (magnitude == 0)
+            return sub;
+        return (SubBucketCount + sub) << (magnitude - 1);
+    }
+
+    // Compact one-line summary, values are printed in the unit they were recorded with
+    friend std::ostream& operator<<(std::ostream& os, const Snapshot& snap)
+    {
+        os << "n=" << snap.count << " min=" << snap.min << " avg=" << static_cast<uint64_t>(snap.Mean())
+           << " p50=" << snap.Percentile(50) << " p99=" << snap.Percentile(99) << " p99.9=" << snap.Percentile(99.9)
+           << " max=" << snap.max;
+        return os;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BucketCount> m_buckets {};
+    std::atomic<uint64_t> m_count { 0 };
+    std::atomic<uint64_t> m_sum { 0 };
+    std::atomic<uint64_t> m_min { UINT64_MAX };
+    std::atomic<uint64_t> m_max { 0 };
+};
+
+#endif // CANOPEN_TIMERS_SRC_LATENCY_HISTOGRAM_HPP_
@@ -1,13 +1,26 @@
+#include "co_can_linux.hpp"
+#include "co_can_virtual.hpp"
+#include "co_timer_linux.hpp"
 #include "mystack.hpp"
+#include "nodeloop.hpp"
+#include "nodepool.hpp"
+#include "rt_profile.hpp"
+#include "tracelog.hpp"
 #include "utils.hpp"
 #include "varloop.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cctype>
+#include <cerrno>
 #include <csignal>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -26,6 +39,12 @@ void SignalHandler(int sigNum)
     reqExit.store(true);
 }
 
+void TraceToggleHandler(int sigNum)
+{
+    (void)sigNum;
+    tracelog::ToggleTrace();
+}
+
 void PrintVersion()
 {
     std::cout << "A minimum viable application for simulating timer clobbering using canopen-stack" << std::endl;
@@ -36,10 +55,37 @@ void PrintInfo()
     PrintVersion();
 
     std::cout << "\n"
-              << "     --iface=<port>    CAN interface to be used (eg, `can0')\n"
+              << "   --iface=<port,..>    CAN interfaces (eg, `can0,can1'), `virtual:<name>[:<bps>]' in-process\n"
+              << "         --nodes=<n>    CANopen nodes per interface, IDs from 10 up (default 1)\n"
+              << "       --workers=<n>    Node loops on <n> pooled threads, at most one per node (default 0, off)\n"
+              << "     --can-rx=<mode>    CAN reception, `batch' (default, recvmmsg) or `single' (one read per frame)\n"
+              << "     --can-tx=<mode>    CAN TX, `queue' (default, FIFO), `priority' (lowest ID first) or `direct'\n"
+              << " --can-fd=<bps[:tx]>    CAN FD, data phase at <bps>; own frames as `fd', `brs' or classic (default)\n"
+              << "           --tx-echo    Trace queue-to-wire latency per COB-ID from own echoed frames (queued TX)\n"
+              << "   --timer=<backend>    Timer HAL backend, `timerfd' (default), `sigev' or `virtual' (simulated)\n"
+              << "   --timer-scale=<x>    Virtual clock speed, `jump' (default, next deadline) or a time-scale factor\n"
+              << "  --timer-arm=<mode>    Timer arming, `relative' (default) or `absolute' (drift-free)\n"
+              << " --timer-service=<m>    Timer servicing, `thread' (default) or `deferred' (on the node thread)\n"
+              << " --timer-delay=<src>    Remaining time source, `vdso' (default, no syscall) or `syscall'\n"
+              << "  --timer-slack=<us>    Merge expiries within <us> microseconds into one wakeup (default 0, off)\n"
+              << " --rt-main=<profile>    Node threads and pool workers RT profile, <policy>[:<prio>[:<cpus>]]\n"
+              << "                        (eg, `fifo:80:2-3'), priority defaults to the policy's minimum\n"
+              << "   --rt-rx=<profile>    CAN RX poller RT profile, same format as above\n"
+              << "--rt-timer=<profile>    Timer service thread RT profile, same format as above\n"
+              << "          --mlockall    Lock process memory and pre-fault thread stacks\n"
+              << "          --pi-locks    Use priority-inheritance mutexes for the stack locks\n"
+              << "--rx-budget=<frames>    Max RX frames dispatched per tick (default 0, all queued ones)\n"
+              << "--rx-filter=<on|off>    Kernel-side receive filter built from the dictionary (default on)\n"
+              << "       --loop=<mode>    Node loop, `poll' (default, 500 us ticks) or `event' (only on work)\n"
+              << "       --stats=<sec>    Dump HAL statistics every <sec> seconds (default 0, disabled)\n"
+              << " --log-level=<level>    `trace' (every frame), `debug', `info', `warn', `error' or `off'; SIGUSR1\n"
+              << "                        toggles `trace' (default `trace' in debug builds, `info' otherwise)\n"
+              << "   --log-file=<path>    Write log records there in binary, print only warnings and errors\n"
+              << "      --bench=<name>    Run a benchmark and exit: `timer-delay', `rxqueue', `rxpath', `loop',\n"
+              << "                        `vbus', `nodes'\n"
               << "\n"
-              << "          --version    Print program version and exit\n"
-              << "             --help    Print this help and exit\n"
+              << "           --version    Print program version and exit\n"
+              << "              --help    Print this help and exit\n"
               << std::endl;
 }
 
@@ -60,10 +106,54 @@ std::pair<std::string, std::string> SplitArgument(const std::string& arg)
     }
 }
 
+// Plain decimal digits only: strtoul() alone would take a sign or leading blanks, and wrap `-1' around
+bool ParseUnsigned(const std::string& value, unsigned long max, unsigned long& output)
+{
+    if (value.empty() || !std::all_of(value.begin(), value.end(), [](unsigned char chr) { return std::isdigit(chr); }))
+        return false;
+
+    errno = 0;
+    const auto parsed = std::strtoul(value.c_str(), nullptr, 10);
+    if (errno == ERANGE || parsed > max)
+        return false;
+    output = parsed;
+    return true;
+}
+
+unsigned long ParseUnsigned(const std::string& value, unsigned long fallback)
+{
+    unsigned long parsed = 0;
+    return ParseUnsigned(value, std::numeric_limits<unsigned long>::max(), parsed) ? parsed : fallback;
+}
+
 void ParseArguments(int argc, char const* argv[], std::map<std::string, std::string, std::less<>>& output)
 {
     static const std::list<std::string> validArgs {
         "--iface",
+        "--nodes",
+        "--workers",
+        "--can-rx",
+        "--can-tx",
+        "--tx-echo",
+        "--can-fd",
+        "--timer",
+        "--timer-arm",
+        "--timer-scale",
+        "--timer-service",
+        "--timer-delay",
+        "--timer-slack",
+        "--bench",
+        "--rt-main",
+        "--rt-rx",
+        "--rt-timer",
+        "--mlockall",
+        "--pi-locks",
+        "--rx-budget",
+        "--rx-filter",
+        "--loop",
+        "--stats",
+        "--log-level",
+        "--log-file",
         "--help",
         "--version",
     };
@@ -96,6 +186,45 @@ void ParseArguments(int argc, char const* argv[], std::map<std::string, std::str
     }
 }
 
+bool RunBenchmark(const std::string& name)
+{
+    static constexpr size_t BenchIterations { 1'000'000 };
+    static constexpr std::chrono::milliseconds BenchDuration { 2000 };
+
+    if (name == "timer-delay") {
+        co_timer_linux::BenchmarkDelay(BenchIterations);
+        return true;
+    }
+
+    if (name == "rxqueue") {
+        co_can_linux::BenchmarkRxQueue(BenchDuration);
+        return true;
+    }
+
+    if (name == "rxpath") {
+        co_can_linux::BenchmarkRxPath(BenchIterations);
+        return true;
+    }
+
+    if (name == "vbus") {
+        co_can_virtual::Benchmark(BenchDuration);
+        return true;
+    }
+
+    if (name == "loop") {
+        nodeloop::Benchmark(BenchDuration);
+        return true;
+    }
+
+    if (name == "nodes") {
+        nodepool::Benchmark(BenchDuration);
+        return true;
+    }
+
+    std::cerr << ERR_MARKER << LOG_MARKER << "Unknown benchmark `" << name << "'!" << std::endl;
+    return false;
+}
+
 int main(int argc, char const* argv[])
 {
     std::cout << "canopen-timers - Enrico Zaghini - 2024" << std::endl;
@@ -104,25 +233,211 @@ int main(int argc, char const* argv[])
     std::map<std::string, std::string, std::less<>> launchArgs {};
     ParseArguments(argc, argv, launchArgs);
 
-    std::string canIface { "can0" };
+    std::vector<std::string> canIfaces { "can0" };
     if (launchArgs.count("--iface") > 0) {
-        canIface = launchArgs.at("--iface");
-    } else {
+        canIfaces = utils::Split(launchArgs.at("--iface"), ",");
+    } else if (launchArgs.count("--bench") == 0) {
         std::cerr << ERR_MARKER << LOG_MARKER << "Missing CAN interface argument (`--iface=...')!" << std::endl;
         PrintInfo();
         return 1;
     }
 
-    mystack coStack { canIface };
-    varloop loop { coStack };
-    static constexpr auto LoopTiming = std::chrono::microseconds(500);
-    coStack.NodeStart();
-    while (!reqExit.load()) {
-        const auto retrigger = std::chrono::steady_clock::now() + LoopTiming;
-        coStack.NodeTick();
-        loop.Tick();
-        std::this_thread::sleep_until(retrigger);
+    for (const auto& canIface : canIfaces) {
+        if (canIface.empty()
+            || (co_can_virtual::IsVirtualInterface(canIface) && !co_can_virtual::IsValidInterface(canIface))) {
+            std::cerr << ERR_MARKER << LOG_MARKER << "Invalid CAN interface `" << canIface << "'!" << std::endl;
+            PrintInfo();
+            return 1;
+        }
+    }
+
+    // Every driver instance takes a slot of its own, so that's as many nodes as one process can host
+    static constexpr size_t MaxNodes { co_timer_linux::MaxInstances };
+    const size_t nodesPerIface = (launchArgs.count("--nodes") > 0) ? ParseUnsigned(launchArgs.at("--nodes"), 0) : 1;
+    if (nodesPerIface == 0 || nodesPerIface > mystack::MaxNodeId || nodesPerIface * canIfaces.size() > MaxNodes) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Invalid node count, 1 to " << static_cast<int>(mystack::MaxNodeId)
+                  << " per interface and " << MaxNodes << " in total!" << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--can-rx") > 0 && !co_can_linux::SetRxMode(launchArgs.at("--can-rx"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown CAN reception mode `" << launchArgs.at("--can-rx") << "'!"
+                  << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--can-tx") > 0 && !co_can_linux::SetTxMode(launchArgs.at("--can-tx"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown CAN transmission mode `" << launchArgs.at("--can-tx") << "'!"
+                  << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--can-fd") > 0 && !co_can_linux::SetFdMode(launchArgs.at("--can-fd"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Invalid CAN FD setting `" << launchArgs.at("--can-fd") << "'!"
+                  << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--tx-echo") > 0)
+        co_can_linux::SetTxEcho(true);
+
+    if (launchArgs.count("--timer") > 0 && !co_timer_linux::SetBackend(launchArgs.at("--timer"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown timer backend `" << launchArgs.at("--timer") << "'!"
+                  << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--timer-arm") > 0 && !co_timer_linux::SetArmMode(launchArgs.at("--timer-arm"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown timer arming mode `" << launchArgs.at("--timer-arm") << "'!"
+                  << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--timer-service") > 0 && !co_timer_linux::SetServiceMode(launchArgs.at("--timer-service"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown timer service mode `" << launchArgs.at("--timer-service")
+                  << "'!" << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--timer-scale") > 0 && !co_timer_linux::SetVirtualTimeScale(launchArgs.at("--timer-scale"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Invalid virtual time scale `" << launchArgs.at("--timer-scale")
+                  << "'!" << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--timer-delay") > 0 && !co_timer_linux::SetDelaySource(launchArgs.at("--timer-delay"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown timer delay source `" << launchArgs.at("--timer-delay")
+                  << "'!" << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    // Bad input is refused rather than quietly taken as 0, which means `off' for all of these
+    const auto parseArgument = [&launchArgs](const std::string& arg, unsigned long max, unsigned long& output) {
+        if (launchArgs.count(arg) == 0 || ParseUnsigned(launchArgs.at(arg), max, output))
+            return true;
+        std::cerr << ERR_MARKER << LOG_MARKER << "Invalid value `" << launchArgs.at(arg) << "' for " << arg << ", 0 to "
+                  << max << "!" << std::endl;
+        PrintInfo();
+        return false;
+    };
+
+    unsigned long slackUs = 0;
+    unsigned long statsSec = 0;
+    unsigned long rxBudget = 0;
+    unsigned long workerCount = 0;
+    if (!parseArgument("--timer-slack", std::numeric_limits<co_timer_linux::TimeUnit>::max() / 1000, slackUs)
+        || !parseArgument("--stats", std::numeric_limits<int>::max(), statsSec)
+        || !parseArgument("--rx-budget", std::numeric_limits<size_t>::max(), rxBudget)
+        || !parseArgument("--workers", nodesPerIface * canIfaces.size(), workerCount))
+        return 1;
+    co_timer_linux::SetCoalescingSlack(slackUs * 1000);
+
+    auto loopMode = nodeloop::Mode::Poll;
+    if (launchArgs.count("--loop") > 0 && !nodeloop::ModeFromName(launchArgs.at("--loop"), loopMode)) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown loop mode `" << launchArgs.at("--loop") << "'!" << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    // Pooled nodes only run when they have events, simulated time needs the poll loop stepping it
+    if (workerCount > 0 && co_timer_linux::IsVirtual()) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "The worker pool can't run on the virtual timer backend!" << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--log-level") > 0 && !tracelog::SetLevel(launchArgs.at("--log-level"))) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Unknown log level `" << launchArgs.at("--log-level") << "'!"
+                  << std::endl;
+        PrintInfo();
+        return 1;
+    }
+
+    if (launchArgs.count("--bench") > 0)
+        return RunBenchmark(launchArgs.at("--bench")) ? 0 : 1;
+
+    static const std::map<std::string, rt_profile::Thread> rtArgs {
+        { "--rt-main", rt_profile::Thread::Main },
+        { "--rt-rx", rt_profile::Thread::CanRx },
+        { "--rt-timer", rt_profile::Thread::Timer },
+    };
+    for (const auto& [arg, thread] : rtArgs) {
+        if (launchArgs.count(arg) > 0 && !rt_profile::Configure(thread, launchArgs.at(arg))) {
+            std::cerr << ERR_MARKER << LOG_MARKER << "Invalid RT profile `" << launchArgs.at(arg) << "' for " << arg
+                      << "!" << std::endl;
+            PrintInfo();
+            return 1;
+        }
+    }
+    rt_profile::SetMemoryLock(launchArgs.count("--mlockall") > 0);
+    rt_profile::SetPriorityInheritance(launchArgs.count("--pi-locks") > 0);
+    rt_profile::LockMemory();
+
+    // From here on frames and HAL events are logged from the background thread
+    if (!tracelog::Start((launchArgs.count("--log-file") > 0) ? launchArgs.at("--log-file") : ""))
+        return 1;
+    signal(SIGUSR1, TraceToggleHandler);
+
+    const std::chrono::seconds statsPeriod { statsSec };
+
+    struct Node {
+        std::unique_ptr<mystack> coStack {};
+        std::unique_ptr<varloop> loop {};
+        std::unique_ptr<nodeloop> nodeLoop {};
+    };
+
+    std::vector<Node> nodes {};
+    for (const auto& canIface : canIfaces) {
+        for (size_t idx = 0; idx < nodesPerIface; idx++) {
+            Node node {};
+            node.coStack = std::make_unique<mystack>(canIface, mystack::NodeIdFor(idx));
+            node.coStack->SetRxBudget(rxBudget);
+            if (launchArgs.count("--rx-filter") > 0)
+                node.coStack->SetReceiveFiltering(launchArgs.at("--rx-filter") != "off");
+            node.loop = std::make_unique<varloop>(*node.coStack);
+            node.nodeLoop = std::make_unique<nodeloop>(*node.coStack, *node.loop);
+            node.nodeLoop->SetMode(loopMode);
+            // The pool reports on all nodes at once, a dump per node would drown it
+            node.nodeLoop->SetStatsPeriod((workerCount > 0) ? std::chrono::seconds(0) : statsPeriod);
+            if (!node.coStack->NodeStart()) {
+                tracelog::Stop();
+                return 1;
+            }
+            nodes.push_back(std::move(node));
+        }
+    }
+
+    if (workerCount > 0) {
+        nodepool pool { workerCount };
+        for (auto& node : nodes)
+            pool.Add(*node.nodeLoop, node.coStack->Interface() + "#" + std::to_string(node.coStack->NodeId()));
+        pool.SetStatsPeriod(statsPeriod);
+        pool.Run(reqExit);
+        tracelog::Stop();
+        return 0;
+    }
+
+    // One thread per node, each applying the main loop settings itself, so that the HAL threads spawned so far don't
+    // inherit them
+    std::vector<std::thread> nodeThreads {};
+    for (auto& node : nodes) {
+        nodeThreads.emplace_back([&node]() {
+            rt_profile::ApplyToCurrentThread(rt_profile::Thread::Main);
+            node.nodeLoop->Run(reqExit);
+        });
     }
+    for (auto& thread : nodeThreads)
+        thread.join();
 
+    tracelog::Stop();
     return 0;
 }
\ No newline at end of file
@@ -1,26 +1,44 @@
 #include "mystack.hpp"
 #include "co_can_linux.hpp"
+#include "co_can_virtual.hpp"
 #include "co_nvm_linux.hpp"
 #include "co_timer_linux.hpp"
 #include "utils.hpp"
 
 #include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <string>
 
 static const std::string LOG_MARKER { "[Stack] " };
 static const std::string ERR_MARKER { "E: " };
 static const std::string DBG_MARKER { "D: " };
 
-mystack::mystack(const std::string& canIface)
+mystack::mystack(const std::string& canIface, uint8_t nodeId)
+    : m_canIface(canIface)
 {
-    co_can_linux::SetCANInterface(canIface);
-    m_hw.Can = &co_can_linux::CANDriver();
-    m_hw.Timer = &co_timer_linux::TimerDriver();
-    m_hw.Nvm = &co_nvm_linux::NVMDriver();
+    m_virtualCan = co_can_virtual::IsVirtualInterface(canIface);
+    if (m_virtualCan) {
+        m_canVirtual = std::make_unique<co_can_virtual>(canIface);
+        m_hw.Can = m_canVirtual->CANDriver();
+    } else {
+        m_canLinux = std::make_unique<co_can_linux>(canIface);
+        m_hw.Can = m_canLinux->CANDriver();
+    }
+    m_hw.Timer = m_timer.TimerDriver();
+    m_hw.Nvm = m_nvm.NVMDriver();
+
+    // Out of driver slots: the stack never gets to see this node, rather than borrowing someone else's drivers
+    if (!HasDrivers()) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "No driver slots left for node " << static_cast<int>(nodeId) << " on "
+                  << canIface << ", it won't be initialized" << std::endl;
+        m_spec.NodeId = nodeId;
+        return;
+    }
 
     AllocateObjects();
 
-    m_spec.NodeId = 10; /* default Node-Id */
+    m_spec.NodeId = nodeId; /* Node-Id */
     m_spec.Baudrate = 250000; /* default Baudrate */
     m_spec.Dict = m_dict.data(); /* pointer to object dictionary */
     m_spec.DictLen = (uint16_t)m_dict.size(); /* object dictionary max length */
@@ -32,6 +50,7 @@ mystack::mystack(const std::string& canIface)
     m_spec.Drv = &m_hw; /* select drivers for application */
     m_spec.SdoBuf = m_sdoSwap.data(); /* SDO Transfer Buffer Memory */
 
+    const co_timer_linux::Scope tmrScope { m_timer };
     CONodeInit(&m_node, &m_spec);
     if (const auto initRc = CONodeGetErr(&m_node); initRc != CO_ERR_NONE) {
         std::cerr << ERR_MARKER << LOG_MARKER << "CANopen stack initialization failed with error code " << initRc
@@ -39,36 +58,233 @@ mystack::mystack(const std::string& canIface)
     }
 }
 
-void mystack::NodeStart()
+bool mystack::HasDrivers() const
+{
+    return m_hw.Can && m_hw.Timer && m_hw.Nvm;
+}
+
+bool mystack::NodeStart()
 {
-    std::cout << LOG_MARKER << "Starting CANopen node" << std::endl;
-    co_timer_linux::LinkTimer(&m_node.Tmr);
+    if (!HasDrivers()) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Node " << static_cast<int>(m_spec.NodeId) << " on " << m_canIface
+                  << " has no drivers, not starting it" << std::endl;
+        return false;
+    }
+
+    std::cout << LOG_MARKER << "Starting CANopen node " << static_cast<int>(m_node.NodeId) << " on " << m_canIface
+              << std::endl;
+    const co_timer_linux::Scope tmrScope { m_timer };
+    m_timer.LinkTimer(&m_node.Tmr);
     CONodeStart(&m_node);
     CONmtSetMode(&m_node.Nmt, CO_OPERATIONAL);
+    return true;
 }
 
 void mystack::NodeTick()
 {
+    if (!HasDrivers())
+        return;
+
     const auto currMode = CONmtGetMode(&m_node.Nmt);
-    if (currMode != m_lastMode) {
+    const bool modeChanged = (currMode != m_lastMode);
+    if (modeChanged) {
         std::cout << LOG_MARKER << "Status transition! " << NodeModeStr(m_lastMode) << " -> " << NodeModeStr(currMode)
                   << std::endl;
         m_lastMode = currMode;
     }
 
     std::scoped_lock dataGuard(m_dataMtx);
-    CONodeProcess(&m_node);
+    const co_timer_linux::Scope tmrScope { m_timer };
+
+    // Every CONodeProcess() pulls at most one frame through the driver, so loop over what's already queued. Frames
+    // arriving meanwhile wait for the next tick, keeping the time spent here bounded.
+    const auto depth = RxQueueDepth();
+    auto passes = std::max<size_t>(depth, 1);
+    if (m_rxBudget > 0 && passes > m_rxBudget) {
+        passes = m_rxBudget;
+        m_budgetHits++;
+    }
+
+    const auto drainStart = std::chrono::steady_clock::now();
+    for (size_t pass = 0; pass < passes; pass++)
+        CONodeProcess(&m_node);
+    m_tickDrainNs.Record(std::chrono::nanoseconds(std::chrono::steady_clock::now() - drainStart).count());
+    m_tickRxDepth.Record(depth);
+
+    m_timer.ServicePending();
+    m_timer.Watchdog();
     COTmrProcess(&m_node.Tmr);
+    m_timer.MarkProcessed();
+
+    // COB-IDs may have been rewritten over SDO, so keep the receive filter in sync with the dictionary
+    RefreshReceiveFilter(modeChanged);
 }
 
 void mystack::NodeStop()
 {
-    std::cout << LOG_MARKER << "Stopping CANopen node" << std::endl;
+    if (!HasDrivers())
+        return;
+
+    std::cout << LOG_MARKER << "Stopping CANopen node " << static_cast<int>(m_node.NodeId) << std::endl;
+    const co_timer_linux::Scope tmrScope { m_timer };
     CONodeStop(&m_node);
+    m_timer.Release();
+}
+
+uint8_t mystack::NodeIdFor(size_t index)
+{
+    return static_cast<uint8_t>((DefaultNodeId - 1 + index) % MaxNodeId + 1);
+}
+
+uint8_t mystack::NodeId() const
+{
+    return m_spec.NodeId;
+}
+
+const std::string& mystack::Interface() const
+{
+    return m_canIface;
+}
+
+co_timer_linux& mystack::Timer()
+{
+    return m_timer;
+}
+
+void mystack::DumpStatistics()
+{
+    std::cout << LOG_MARKER << "Node " << static_cast<int>(NodeId()) << " on " << m_canIface << std::endl;
+    m_timer.DumpStatistics();
+    if (m_virtualCan)
+        m_canVirtual->DumpStatistics();
+    else
+        m_canLinux->DumpStatistics();
+    std::cout << LOG_MARKER << "RX depth per tick [frames] " << m_tickRxDepth.Take() << "\n"
+              << LOG_MARKER << "RX drain per tick [ns] " << m_tickDrainNs.Take() << "\n"
+              << LOG_MARKER << "RX budget " << (m_rxBudget ? std::to_string(m_rxBudget) : "unlimited") << ", hit "
+              << m_budgetHits << " times" << std::endl;
+}
+
+int mystack::RxNotifyFd() const
+{
+    return m_virtualCan ? m_canVirtual->RxNotifyFd() : m_canLinux->RxNotifyFd();
+}
+
+void mystack::AcknowledgeRx() const
+{
+    if (m_virtualCan)
+        m_canVirtual->AcknowledgeRx();
+    else
+        m_canLinux->AcknowledgeRx();
+}
+
+size_t mystack::RxQueueDepth() const
+{
+    return m_virtualCan ? m_canVirtual->RxQueueDepth() : m_canLinux->RxQueueDepth();
+}
+
+void mystack::SetRxBudget(size_t frames)
+{
+    m_rxBudget = frames;
+}
+
+void mystack::SetReceiveFiltering(bool enable)
+{
+    std::scoped_lock dataGuard(m_dataMtx);
+    m_rxFiltering = enable;
+    if (!enable)
+        ApplyReceiveFilter({});
+}
+
+void mystack::RefreshReceiveFilter(bool force)
+{
+    if (!m_rxFiltering)
+        return;
+
+    const auto now = std::chrono::steady_clock::now();
+    if (!force && now < m_nextFilterRefresh)
+        return;
+
+    // SocketCAN only touches the socket when the set actually changed
+    m_nextFilterRefresh = now + FilterRefreshPeriod;
+    ApplyReceiveFilter(ReceiveSet());
+}
+
+void mystack::ApplyReceiveFilter(const std::vector<SocketCAN::RxFilter>& filters)
+{
+    if (m_virtualCan)
+        m_canVirtual->SetReceiveFilter(filters);
+    else
+        m_canLinux->SetReceiveFilter(filters);
+}
+
+std::vector<SocketCAN::RxFilter> mystack::ReceiveSet()
+{
+    static constexpr uint32_t CobIdInvalid { 0x80000000 };
+    static constexpr uint32_t CobIdSyncProducer { 0x40000000 };
+    static constexpr uint32_t CobIdExtended { 0x20000000 };
+
+    std::vector<SocketCAN::RxFilter> rxSet {};
+    const auto addCobId = [&rxSet](uint32_t cobId) {
+        const bool id29Bit = (cobId & CobIdExtended) != 0;
+        const SocketCAN::RxFilter filter { cobId & (id29Bit ? 0x1FFFFFFFU : 0x7FFU), id29Bit };
+        if (std::find(rxSet.begin(), rxSet.end(), filter) == rxSet.end())
+            rxSet.push_back(filter);
+    };
+    const auto readCobId = [this](const ObjectAddress& addr, uint32_t& value) {
+        return CODictRdLong(&m_node.Dict, CO_DEV(addr.Index(), addr.Subindex()), &value) == CO_ERR_NONE;
+    };
+
+    // NMT commands are always for us
+    addCobId(0x000);
+
+    uint32_t value = 0;
+    if (readCobId(Addresses::Std_SyncCOBID, value) && (value & CobIdSyncProducer) == 0)
+        addCobId(value & ~CobIdInvalid);
+
+    for (int num = 0; num < CO_SSDO_N; num++) {
+        if (readCobId(Addresses::Std_SDOServerRequestCOBID(num), value) && (value & CobIdInvalid) == 0)
+            addCobId(value);
+    }
+
+    for (int num = 0; num < CO_RPDO_N; num++) {
+        if (readCobId(Addresses::Std_RPDOCommCOBID(num), value) && (value & CobIdInvalid) == 0)
+            addCobId(value);
+    }
+
+    // Consumer entries hold the producer node ID in bits 16-23 and the timeout in bits 0-15, 0 for either is unused
+    uint8_t hbConsumers = 0;
+    const auto hbCount = Addresses::Std_HeartbeatConsumerCount;
+    if (CODictRdByte(&m_node.Dict, CO_DEV(hbCount.Index(), hbCount.Subindex()), &hbConsumers) == CO_ERR_NONE) {
+        for (int num = 0; num < hbConsumers; num++) {
+            if (!readCobId(Addresses::Std_HeartbeatConsumer(num), value))
+                continue;
+            const auto nodeId = (value >> 16) & 0x7F;
+            if (nodeId != 0 && (value & 0xFFFF) != 0)
+                addCobId(0x700 + nodeId);
+        }
+    }
+
+    // CAN_RAW_FILTER applies to our own echoes as well, so tracing them means letting what we send back in
+    if (!m_virtualCan && co_can_linux::TxEchoEnabled()) {
+        for (int num = 0; num < CO_TPDO_N; num++) {
+            if (readCobId(Addresses::Std_TPDOCommCOBID(num), value) && (value & CobIdInvalid) == 0)
+                addCobId(value);
+        }
+        for (int num = 0; num < CO_SSDO_N; num++) {
+            if (readCobId(Addresses::Std_SDOServerResponseCOBID(num), value) && (value & CobIdInvalid) == 0)
+                addCobId(value);
+        }
+        addCobId(0x080 + m_node.NodeId);
+        addCobId(0x700 + m_node.NodeId);
+    }
+
+    return rxSet;
 }
 
 void mystack::TriggerTPDO(const ObjectAddress& objAddr)
 {
+    const co_timer_linux::Scope tmrScope { m_timer };
     auto obj = CODictFind(&m_node.Dict, CO_DEV(objAddr.Index(), objAddr.Subindex()));
     if (!obj)
         return;
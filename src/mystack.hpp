@@ -5,9 +5,15 @@
 #include "co_core.h"
 #include "co_err.h"
 #include "co_nmt.h"
+#include "co_nvm_linux.hpp"
+#include "co_timer_linux.hpp"
+#include "latency_histogram.hpp"
+#include "rt_profile.hpp"
+#include "socketcan/socketcan.hpp"
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <iomanip>
 #include <iostream>
@@ -15,17 +21,46 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <vector>
 
-// C++ wrapper for the main C library
+class co_can_linux;
+class co_can_virtual;
+
+// C++ wrapper for the main C library. Every node owns its drivers, so several of them can live in one process, on
+// the same interface or on different ones.
 class mystack {
 public:
-    explicit mystack(const std::string& canIface);
+    static constexpr uint8_t DefaultNodeId { 10 };
+    static constexpr uint8_t MaxNodeId { 127 };
+
+    // IDs for several nodes sharing an interface: DefaultNodeId first, then up to MaxNodeId and around from 1
+    static uint8_t NodeIdFor(size_t index);
+
+    explicit mystack(const std::string& canIface, uint8_t nodeId = DefaultNodeId);
     ~mystack();
 
-    void NodeStart();
+    uint8_t NodeId() const;
+    const std::string& Interface() const;
+    co_timer_linux& Timer();
+
+    // False when any of the node's drivers is missing its slot, the node then never gets initialized nor started
+    bool HasDrivers() const;
+    bool NodeStart();
     void NodeTick();
     void NodeStop();
+    void DumpStatistics();
+
+    // RX readiness of whichever CAN driver the interface name picked, for the node loop to block on
+    int RxNotifyFd() const;
+    void AcknowledgeRx() const;
+    size_t RxQueueDepth() const;
+
+    // Max received frames dispatched per NodeTick(), 0 drains whatever was queued when the tick began
+    void SetRxBudget(size_t frames);
+
+    // Install a kernel-side receive filter matching the COB-IDs the dictionary actually consumes
+    void SetReceiveFiltering(bool enable);
 
     template <typename T>
     void SetObject(const ObjectAddress& objAddr, T value)
@@ -33,6 +68,7 @@ public:
         // Type checking and sizeof comparison are done directly within COObjWrValue, so the stack should be able
         // to filter out if I'm doing dumb things when updating values
         std::scoped_lock dataGuard(m_dataMtx);
+        const co_timer_linux::Scope tmrScope { m_timer };
         auto obj = CODictFind(&m_node.Dict, CO_DEV(objAddr.Index(), objAddr.Subindex()));
         if (!obj)
             return;
@@ -43,7 +79,14 @@ public:
 private:
     static constexpr size_t EmergencyCodeCount { 1 };
     static constexpr size_t TimersCount { 64 };
+    static constexpr std::chrono::milliseconds FilterRefreshPeriod { 100 };
 
+    const std::string m_canIface;
+    bool m_virtualCan { false };
+    std::unique_ptr<co_can_linux> m_canLinux {};
+    std::unique_ptr<co_can_virtual> m_canVirtual {};
+    co_timer_linux m_timer {};
+    co_nvm_linux m_nvm {};
     CO_NODE m_node {};
     struct CO_IF_DRV_T m_hw { };
     struct CO_NODE_SPEC_T m_spec { };
@@ -53,7 +96,13 @@ private:
     std::array<uint8_t, CO_SSDO_N * CO_SDO_BUF_BYTE> m_sdoSwap {};
     CO_MODE m_lastMode { CO_INVALID };
     std::map<ObjectAddress, std::shared_ptr<void>> m_objStorage {};
-    std::mutex m_dataMtx {};
+    rt_mutex m_dataMtx {};
+    size_t m_rxBudget { 0 };
+    LatencyHistogram m_tickRxDepth {};
+    LatencyHistogram m_tickDrainNs {};
+    uint64_t m_budgetHits { 0 };
+    bool m_rxFiltering { true };
+    std::chrono::steady_clock::time_point m_nextFilterRefresh {};
 
     template <typename T>
     void AddObject(
@@ -78,6 +127,10 @@ private:
 
     static std::string NodeModeStr(const CO_MODE m);
 
+    void RefreshReceiveFilter(bool force);
+    void ApplyReceiveFilter(const std::vector<SocketCAN::RxFilter>& filters);
+    std::vector<SocketCAN::RxFilter> ReceiveSet();
+
     void AllocateObjects();
     void DumpMemoryMap() const;
     void DefineTPDO(const uint16_t index, const uint8_t eventType, const uint16_t inhibitTime,
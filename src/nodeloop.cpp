@@ -0,0 +1,403 @@
+#include "nodeloop.hpp"
+#include "co_timer_linux.hpp"
+#include "latency_histogram.hpp"
+#include "virtual_can_bus.hpp"
+
+#include <array>
+#include <cerrno>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static const std::string LOG_MARKER { "[Loop] " };
+static const std::string ERR_MARKER { "E: " };
+static const std::string DBG_MARKER { "D: " };
+
+static uint64_t ThreadCpuNs()
+{
+    struct timespec cpuTime { };
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTime) != 0)
+        return 0;
+    return cpuTime.tv_sec * 1'000'000'000ULL + cpuTime.tv_nsec;
+}
+
+nodeloop::nodeloop(mystack& coStack, varloop& appLoop)
+    : m_coStack(coStack)
+    , m_appLoop(appLoop)
+{
+}
+
+nodeloop::~nodeloop()
+{
+    if (m_epollFd >= 0)
+        close(m_epollFd);
+    if (m_housekeepingFd >= 0)
+        close(m_housekeepingFd);
+}
+
+void nodeloop::SetMode(Mode mode)
+{
+    m_mode = mode;
+}
+
+bool nodeloop::SetMode(const std::string& name)
+{
+    Mode mode {};
+    if (!ModeFromName(name, mode))
+        return false;
+
+    SetMode(mode);
+    return true;
+}
+
+bool nodeloop::ModeFromName(const std::string& name, Mode& mode)
+{
+    static const std::map<std::string, Mode, std::less<>> modes {
+        { "poll", Mode::Poll },
+        { "event", Mode::Event },
+    };
+
+    const auto found = modes.find(name);
+    if (found == modes.end())
+        return false;
+
+    mode = found->second;
+    return true;
+}
+
+std::string nodeloop::ModeName(Mode mode)
+{
+    switch (mode) {
+    case Mode::Poll:
+        return "poll";
+    case Mode::Event:
+        return "event";
+    default:
+        return "unknown";
+    }
+}
+
+void nodeloop::SetStatsPeriod(std::chrono::seconds period)
+{
+    m_statsPeriod = period;
+}
+
+void nodeloop::Run(const std::atomic_bool& exitRequest)
+{
+    // Simulated time only moves when the loop steps it, there's nothing a blocked thread could wait for
+    if (m_mode == Mode::Event && co_timer_linux::IsVirtual()) {
+        std::cerr << "W: " << LOG_MARKER << "virtual timer backend needs the poll loop, switching to it" << std::endl;
+        m_mode = Mode::Poll;
+    }
+
+    std::cout << LOG_MARKER << "Running the " << ModeName(m_mode) << " loop" << std::endl;
+    m_started = std::chrono::steady_clock::now();
+    m_nextStats = m_started + m_statsPeriod;
+    if (m_mode == Mode::Event)
+        RunEvents(exitRequest);
+    else
+        RunPolling(exitRequest);
+}
+
+void nodeloop::RunPolling(const std::atomic_bool& exitRequest)
+{
+    while (!exitRequest.load()) {
+        const auto retrigger = std::chrono::steady_clock::now() + PollPeriod;
+        m_stats.wakeups++;
+        m_stats.ticks++;
+        m_coStack.NodeTick();
+        m_appLoop.Tick();
+        StatisticsDue(retrigger);
+
+        // Simulated clock steps to the next deadline instead, and tells how long we're allowed to idle
+        if (co_timer_linux::IsVirtual()) {
+            const auto idle = m_coStack.Timer().StepVirtual(std::chrono::nanoseconds(PollPeriod).count());
+            if (idle > 0)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(idle));
+            continue;
+        }
+        std::this_thread::sleep_until(retrigger);
+    }
+}
+
+void nodeloop::RunEvents(const std::atomic_bool& exitRequest)
+{
+    if (EventFd(false) < 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Falling back to the poll loop" << std::endl;
+        m_mode = Mode::Poll;
+        RunPolling(exitRequest);
+        return;
+    }
+
+    const auto housekeepingMs = std::chrono::duration_cast<std::chrono::milliseconds>(HousekeepingPeriod).count();
+    while (!exitRequest.load()) {
+        // Frames left over by the RX budget don't post again, go straight back to them
+        if (!ServiceEvents(HasPendingWork() ? 0 : static_cast<int>(housekeepingMs)))
+            break;
+    }
+
+    m_coStack.Timer().SetNotifyOnService(false);
+}
+
+int nodeloop::EventFd(bool housekeepingTimer)
+{
+    if (m_epollFd >= 0)
+        return m_epollFd;
+
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Failed to create epoll set, error code " << errno << std::endl;
+        return -1;
+    }
+
+    // Without a thread blocking on the set, nothing would time out for the watchdog and the filter refresh
+    if (housekeepingTimer) {
+        m_housekeepingFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        const auto periodNs = std::chrono::nanoseconds(HousekeepingPeriod).count();
+        struct itimerspec period { };
+        period.it_interval.tv_sec = periodNs / 1'000'000'000;
+        period.it_interval.tv_nsec = periodNs % 1'000'000'000;
+        period.it_value = period.it_interval;
+        if (m_housekeepingFd >= 0)
+            timerfd_settime(m_housekeepingFd, 0, &period, nullptr);
+    }
+
+    // Expiries serviced on the timer thread still need COTmrProcess on this one, which is where TPDOs go out
+    m_coStack.Timer().SetNotifyOnService(true);
+    m_rxFd = m_coStack.RxNotifyFd();
+    m_timerFd = m_coStack.Timer().NotifyFd();
+    m_appFd = m_appLoop.UpdateFd();
+
+    std::vector<std::pair<int, const char*>> sources {
+        { m_rxFd, "CAN RX" },
+        { m_timerFd, "timer" },
+        { m_appFd, "application" },
+    };
+    if (housekeepingTimer)
+        sources.emplace_back(m_housekeepingFd, "housekeeping");
+    for (const auto& [fd, name] : sources) {
+        struct epoll_event ev { };
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (fd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            std::cerr << ERR_MARKER << LOG_MARKER << "Failed to wait on " << name << " readiness" << std::endl;
+            close(epollFd);
+            return -1;
+        }
+    }
+
+    m_epollFd = epollFd;
+    if (m_started == std::chrono::steady_clock::time_point {}) {
+        m_started = std::chrono::steady_clock::now();
+        m_nextStats = m_started + m_statsPeriod;
+    }
+    return m_epollFd;
+}
+
+bool nodeloop::ServiceEvents(int timeoutMs)
+{
+    std::array<struct epoll_event, 4> events {};
+    const int activeFds = epoll_wait(m_epollFd, events.data(), events.size(), timeoutMs);
+    if (activeFds < 0) {
+        if (errno == EINTR)
+            return true;
+        std::cerr << ERR_MARKER << LOG_MARKER << "epoll_wait failed with errno " << errno << std::endl;
+        return false;
+    }
+
+    m_stats.wakeups++;
+    bool appDue = false;
+    bool housekeeping = (activeFds == 0 && timeoutMs > 0);
+    for (int idx = 0; idx < activeFds; idx++) {
+        const auto fd = events[idx].data.fd;
+        if (fd == m_rxFd) {
+            m_coStack.AcknowledgeRx();
+            m_stats.rxWakeups++;
+        } else if (fd == m_timerFd) {
+            // Drained here, whatever the servicing mode: ServicePending() only reads it when it has work to do
+            uint64_t posted = 0;
+            [[maybe_unused]] const auto rd = read(m_timerFd, &posted, sizeof(posted));
+            m_stats.timerWakeups++;
+        } else if (fd == m_appFd) {
+            appDue = m_appLoop.UpdateDue();
+            m_stats.appWakeups++;
+        } else if (fd == m_housekeepingFd) {
+            uint64_t expirations = 0;
+            [[maybe_unused]] const auto rd = read(m_housekeepingFd, &expirations, sizeof(expirations));
+            housekeeping |= (activeFds == 1);
+        }
+    }
+    if (housekeeping)
+        m_stats.housekeeping++;
+
+    m_stats.ticks++;
+    m_coStack.NodeTick();
+    if (appDue)
+        m_appLoop.Update();
+    StatisticsDue(std::chrono::steady_clock::now());
+    return true;
+}
+
+bool nodeloop::HasPendingWork() const
+{
+    return m_coStack.RxQueueDepth() > 0;
+}
+
+void nodeloop::StatisticsDue(std::chrono::steady_clock::time_point now)
+{
+    if (m_statsPeriod.count() == 0 || now < m_nextStats)
+        return;
+
+    m_coStack.DumpStatistics();
+    DumpStatistics();
+    m_nextStats += m_statsPeriod;
+}
+
+void nodeloop::SampleTimes()
+{
+    m_stats.cpuNs = ThreadCpuNs();
+    m_stats.wallNs = std::chrono::nanoseconds(std::chrono::steady_clock::now() - m_started).count();
+}
+
+nodeloop::Stats nodeloop::Statistics() const
+{
+    return m_stats;
+}
+
+void nodeloop::DumpStatistics()
+{
+    // Rates over the last period, so that both modes can be compared with the same traffic
+    SampleTimes();
+    const auto wallNs = m_stats.wallNs - m_lastDump.wallNs;
+    const auto cpuPct = wallNs ? (m_stats.cpuNs - m_lastDump.cpuNs) * 100. / wallNs : 0.;
+    const auto perSec = [wallNs](uint64_t count) { return wallNs ? count * 1'000'000'000ULL / wallNs : 0; };
+    std::cout << LOG_MARKER << ModeName(m_mode) << " loop: " << perSec(m_stats.wakeups - m_lastDump.wakeups)
+              << " wakeups/s, " << perSec(m_stats.ticks - m_lastDump.ticks) << " ticks/s, node thread CPU "
+              << std::fixed << std::setprecision(2) << cpuPct << std::defaultfloat << "%" << std::endl;
+    if (m_mode == Mode::Event) {
+        std::cout << LOG_MARKER << "Woken by RX " << m_stats.rxWakeups - m_lastDump.rxWakeups << ", timer "
+                  << m_stats.timerWakeups - m_lastDump.timerWakeups << ", application "
+                  << m_stats.appWakeups - m_lastDump.appWakeups << ", housekeeping "
+                  << m_stats.housekeeping - m_lastDump.housekeeping << std::endl;
+    }
+    m_lastDump = m_stats;
+}
+
+namespace {
+
+struct LoopBenchResult {
+    LatencyHistogram::Snapshot responseNs {};
+    uint64_t requests { 0 };
+    uint64_t timeouts { 0 };
+    nodeloop::Stats loop {};
+    uint64_t cpuNs { 0 }; // node thread only
+    uint64_t wallNs { 0 };
+};
+
+// A full node in the given mode on an unlimited virtual bus, with a tester port sending it SDO uploads of 0x1000 at
+// the given period, none for an idle bus. Response latency covers the frame reaching the node's queue, the loop
+// picking it up, NodeTick() and the answer making it back.
+LoopBenchResult RunLoopBench(
+    nodeloop::Mode mode, std::chrono::microseconds requestPeriod, std::chrono::milliseconds duration)
+{
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds ResponseTimeout { 100 };
+    const uint8_t nodeId = mystack::NodeIdFor(0);
+
+    const auto busName = "loop-" + nodeloop::ModeName(mode) + "-" + std::to_string(requestPeriod.count());
+    auto bus = VirtualCanBus::Get(busName);
+    mystack stack { "virtual:" + busName, nodeId };
+    varloop app { stack };
+    nodeloop loop { stack, app };
+    loop.SetMode(mode);
+    stack.NodeStart();
+
+    LoopBenchResult result {};
+    std::atomic_bool exitRequest { false };
+    std::thread nodeThread([&]() {
+        const auto cpuStart = ThreadCpuNs();
+        const auto wallStart = Clock::now();
+        loop.Run(exitRequest);
+        result.cpuNs = ThreadCpuNs() - cpuStart;
+        result.wallNs = std::chrono::nanoseconds(Clock::now() - wallStart).count();
+    });
+
+    const int port = bus->Attach();
+    bus->SetFilters(port, { { static_cast<uint32_t>(0x580 + nodeId), false } });
+    struct pollfd wake { bus->NotifyFd(port), POLLIN, 0 };
+    VirtualCanBus::Frame request {};
+    request.id = 0x600 + nodeId;
+    request.dlc = 8;
+    request.data = { 0x40, 0x00, 0x10, 0x00 };
+    VirtualCanBus::Frame response {};
+    LatencyHistogram responseNs {};
+
+    const auto end = Clock::now() + duration;
+    auto next = Clock::now();
+    while (requestPeriod.count() > 0 && next + requestPeriod < end) {
+        next += requestPeriod;
+        std::this_thread::sleep_until(next);
+        const auto sent = Clock::now();
+        bus->Send(port, request);
+        result.requests++;
+
+        bool answered = false;
+        while (!answered && Clock::now() < sent + ResponseTimeout) {
+            if (poll(&wake, 1, static_cast<int>(ResponseTimeout.count())) > 0)
+                bus->Acknowledge(port);
+            while (bus->Receive(port, response))
+                answered |= (response.id == request.id - 0x80);
+        }
+        if (answered)
+            responseNs.Record(std::chrono::nanoseconds(Clock::now() - sent).count());
+        else
+            result.timeouts++;
+    }
+    std::this_thread::sleep_until(end);
+    bus->Detach(port);
+
+    exitRequest.store(true);
+    nodeThread.join();
+    result.loop = loop.Statistics();
+    result.responseNs = responseNs.Take();
+    return result;
+}
+
+}
+
+void nodeloop::Benchmark(std::chrono::milliseconds duration)
+{
+    // Idle bus first, then a steady 1 kHz request stream
+    std::vector<std::pair<std::string, LoopBenchResult>> results {};
+    for (const auto requestPeriod : { std::chrono::microseconds(0), std::chrono::microseconds(1000) }) {
+        for (const auto mode : { Mode::Poll, Mode::Event }) {
+            const auto label = ModeName(mode) + (requestPeriod.count() ? " 1 kHz" : " idle");
+            results.emplace_back(label, RunLoopBench(mode, requestPeriod, duration));
+        }
+    }
+
+    // Printed at the end, the node coming and going is rather chatty
+    std::cout << LOG_MARKER << "Node loop benchmark, one node on an unlimited virtual bus answering SDO uploads, "
+              << duration.count() << " ms per run" << std::endl;
+    for (const auto& [label, res] : results) {
+        const auto cpuPct = res.wallNs ? res.cpuNs * 100. / res.wallNs : 0.;
+        std::cout << LOG_MARKER << std::setw(12) << std::left << label << std::right << " " << res.loop.wakeups
+                  << " wakeups, " << res.loop.ticks << " ticks, node thread CPU " << std::fixed << std::setprecision(3)
+                  << cpuPct << std::defaultfloat << "%";
+        if (res.requests > 0) {
+            std::cout << ", " << res.requests << " requests, " << res.timeouts << " timed out\n"
+                      << LOG_MARKER << std::setw(12) << std::left << label << std::right << " request to response [ns] "
+                      << res.responseNs;
+        }
+        std::cout << std::endl;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef CANOPEN_TIMERS_SRC_NODELOOP_HPP_
+#define CANOPEN_TIMERS_SRC_NODELOOP_HPP_
+
+#include "mystack.hpp"
+#include "varloop.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Drives the node thread: NodeTick() for the stack, varloop updates for the application and periodic statistics
+class nodeloop {
+public:
+    enum class Mode {
+        Poll, // NodeTick() and the application every PollPeriod, whether anything happened or not
+        Event, // blocks on RX, timer and application readiness, NodeTick() only when there's work
+    };
+
+    struct Stats {
+        uint64_t wakeups { 0 };
+        uint64_t ticks { 0 };
+        uint64_t rxWakeups { 0 }; // frames queued by the CAN poller
+        uint64_t timerWakeups { 0 }; // expiries left for COTmrProcess by the timer HAL
+        uint64_t appWakeups { 0 }; // application update due
+        uint64_t housekeeping { 0 }; // nothing happened, ticking for the watchdog and the filter refresh only
+        uint64_t cpuNs { 0 }; // node thread CPU time
+        uint64_t wallNs { 0 };
+    };
+
+    static constexpr std::chrono::microseconds PollPeriod { 500 };
+    static constexpr std::chrono::milliseconds HousekeepingPeriod { 10 }; // as often as the timer watchdog needs
+
+    nodeloop(mystack& coStack, varloop& appLoop);
+    ~nodeloop();
+    nodeloop(const nodeloop&) = delete;
+    nodeloop& operator=(const nodeloop&) = delete;
+
+    void SetMode(Mode mode);
+    bool SetMode(const std::string& name);
+    static bool ModeFromName(const std::string& name, Mode& mode);
+    static std::string ModeName(Mode mode);
+    void SetStatsPeriod(std::chrono::seconds period);
+
+    // Returns once exitRequest gets set
+    void Run(const std::atomic_bool& exitRequest);
+    Stats Statistics() const;
+    void DumpStatistics();
+
+    // For running the node as a task instead: the returned set is readable whenever ServiceEvents() has work, the
+    // housekeeping timer makes it so every HousekeepingPeriod too. ServiceEvents() waits up to timeoutMs for any
+    // of it, ticks the node once and returns false if the set broke. Any thread, but never two at once.
+    int EventFd(bool housekeepingTimer);
+    bool ServiceEvents(int timeoutMs);
+    bool HasPendingWork() const; // frames left over by the RX budget, they don't make the set readable again
+
+    // Node thread CPU and request to response latency of both modes, for a real node on a virtual bus
+    static void Benchmark(std::chrono::milliseconds duration);
+
+private:
+    mystack& m_coStack;
+    varloop& m_appLoop;
+    Mode m_mode { Mode::Poll };
+    std::chrono::seconds m_statsPeriod { 0 };
+    std::chrono::steady_clock::time_point m_nextStats {};
+    Stats m_stats {};
+    Stats m_lastDump {};
+    std::chrono::steady_clock::time_point m_started {};
+    int m_epollFd { -1 };
+    int m_rxFd { -1 };
+    int m_timerFd { -1 };
+    int m_appFd { -1 };
+    int m_housekeepingFd { -1 };
+
+    void RunPolling(const std::atomic_bool& exitRequest);
+    void RunEvents(const std::atomic_bool& exitRequest);
+    void StatisticsDue(std::chrono::steady_clock::time_point now);
+    void SampleTimes();
+};
+
+#endif // CANOPEN_TIMERS_SRC_NODELOOP_HPP_
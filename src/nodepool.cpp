@@ -0,0 +1,452 @@
+#include "nodepool.hpp"
+#include "co_timer_linux.hpp"
+#include "mystack.hpp"
+#include "varloop.hpp"
+#include "virtual_can_bus.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static const std::string LOG_MARKER { "[Pool] " };
+static const std::string ERR_MARKER { "E: " };
+static const std::string DBG_MARKER { "D: " };
+
+static uint64_t ProcessCpuNs()
+{
+    struct timespec cpuTime { };
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuTime) != 0)
+        return 0;
+    return cpuTime.tv_sec * 1'000'000'000ULL + cpuTime.tv_nsec;
+}
+
+nodepool::nodepool(size_t workerCount)
+    : m_workerCount(std::max<size_t>(workerCount, 1))
+{
+    for (size_t idx = 0; idx < m_workerCount; idx++)
+        m_workers.push_back(std::make_unique<Worker>());
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_stealFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollFd < 0 || m_stealFd < 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Failed to create the pool's epoll set, error code " << errno
+                  << std::endl;
+        return;
+    }
+
+    // Level triggered and never handed out once: every idle worker gets to look for something to steal
+    struct epoll_event ev { };
+    ev.events = EPOLLIN;
+    ev.data.u64 = UINT64_MAX;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_stealFd, &ev);
+}
+
+nodepool::~nodepool()
+{
+    if (m_stealFd >= 0)
+        close(m_stealFd);
+    if (m_epollFd >= 0)
+        close(m_epollFd);
+}
+
+bool nodepool::Add(nodeloop& loop, const std::string& label)
+{
+    const int eventFd = loop.EventFd(true);
+    if (m_epollFd < 0 || eventFd < 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Can't wait on " << label << ", leaving it out" << std::endl;
+        return false;
+    }
+
+    auto node = std::make_unique<Node>();
+    node->loop = &loop;
+    node->label = label;
+    node->eventFd = eventFd;
+    m_nodes.push_back(std::move(node));
+
+    // One shot: a node is either armed here, queued on a worker or running, never two of them at once
+    struct epoll_event ev { };
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = m_nodes.size() - 1;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, eventFd, &ev) != 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Failed to wait on " << label << ", error code " << errno << std::endl;
+        m_nodes.pop_back();
+        return false;
+    }
+    return true;
+}
+
+void nodepool::SetStatsPeriod(std::chrono::seconds period)
+{
+    m_statsPeriod = period;
+}
+
+void nodepool::Run(const std::atomic_bool& exitRequest)
+{
+    std::cout << LOG_MARKER << "Running " << m_nodes.size() << " nodes on " << m_workerCount << " workers"
+              << std::endl;
+
+    std::vector<std::thread> workers {};
+    for (size_t idx = 0; idx < m_workerCount; idx++) {
+        workers.emplace_back([this, idx, &exitRequest]() {
+            rt_profile::ApplyToCurrentThread(rt_profile::Thread::Main);
+            WorkerLoop(idx, exitRequest);
+        });
+    }
+
+    auto nextStats = Clock::now() + m_statsPeriod;
+    while (!exitRequest.load()) {
+        std::this_thread::sleep_for(IdleTimeout);
+        if (m_statsPeriod.count() > 0 && Clock::now() >= nextStats) {
+            DumpStatistics();
+            nextStats += m_statsPeriod;
+        }
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void nodepool::WorkerLoop(size_t self, const std::atomic_bool& exitRequest)
+{
+    Task task {};
+    while (!exitRequest.load(std::memory_order_relaxed)) {
+        if (PopLocal(self, task) || Steal(self, task)) {
+            Execute(self, task);
+            continue;
+        }
+        Harvest(self);
+    }
+}
+
+bool nodepool::PopLocal(size_t self, Task& task)
+{
+    auto& worker = *m_workers[self];
+    std::scoped_lock guard(worker.lock);
+    if (worker.tasks.empty())
+        return false;
+    task = worker.tasks.back();
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool nodepool::Steal(size_t self, Task& task)
+{
+    // Starting from the next one over, so that thieves don't all go for the same victim
+    for (size_t offset = 1; offset < m_workerCount; offset++) {
+        auto& victim = *m_workers[(self + offset) % m_workerCount];
+        std::scoped_lock guard(victim.lock);
+        if (victim.tasks.empty())
+            continue;
+        task = victim.tasks.front();
+        victim.tasks.pop_front();
+        m_workers[self]->stolen.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void nodepool::Harvest(size_t self)
+{
+    std::array<struct epoll_event, HarvestBatch> events {};
+    m_idleWorkers.fetch_add(1);
+    const int activeFds = epoll_wait(m_epollFd, events.data(), events.size(), static_cast<int>(IdleTimeout.count()));
+    m_idleWorkers.fetch_sub(1);
+    if (activeFds < 0) {
+        if (errno != EINTR) {
+            std::cerr << ERR_MARKER << LOG_MARKER << "epoll_wait failed with errno " << errno << std::endl;
+            std::this_thread::sleep_for(IdleTimeout);
+        }
+        return;
+    }
+
+    const auto now = Clock::now();
+    size_t harvested = 0;
+    for (int idx = 0; idx < activeFds; idx++) {
+        if (events[idx].data.u64 == UINT64_MAX) {
+            uint64_t posted = 0;
+            [[maybe_unused]] const auto rd = read(m_stealFd, &posted, sizeof(posted));
+            continue;
+        }
+        Push(self, Task { static_cast<size_t>(events[idx].data.u64), now }, false);
+        harvested++;
+    }
+    m_workers[self]->harvested.fetch_add(harvested, std::memory_order_relaxed);
+
+    // This worker runs one of them next, the rest is up for grabs
+    if (harvested > 1)
+        OfferSteal();
+}
+
+void nodepool::Execute(size_t self, const Task& task)
+{
+    auto& node = *m_nodes[task.node];
+    const auto start = Clock::now();
+    const auto wakeNs = std::chrono::nanoseconds(start - task.ready).count();
+    node.wakeNs.Record(wakeNs);
+    m_wakeNs.Record(wakeNs);
+
+    const bool healthy = node.loop->ServiceEvents(0);
+    node.serviceNs.Record(std::chrono::nanoseconds(Clock::now() - start).count());
+    node.runs.fetch_add(1, std::memory_order_relaxed);
+    m_workers[self]->runs.fetch_add(1, std::memory_order_relaxed);
+
+    if (!healthy) {
+        std::cerr << ERR_MARKER << LOG_MARKER << node.label << " lost its event set, dropping it" << std::endl;
+        return;
+    }
+
+    // Frames left over by the RX budget don't make the set readable again. Back in the queue, behind everything
+    // that's already waiting, instead of hogging this worker.
+    if (node.loop->HasPendingWork()) {
+        Push(self, Task { task.node, Clock::now() }, true);
+        OfferSteal();
+        return;
+    }
+    Rearm(task.node);
+}
+
+void nodepool::Push(size_t self, const Task& task, bool front)
+{
+    auto& worker = *m_workers[self];
+    std::scoped_lock guard(worker.lock);
+    if (front)
+        worker.tasks.push_front(task);
+    else
+        worker.tasks.push_back(task);
+}
+
+void nodepool::OfferSteal()
+{
+    if (m_workerCount < 2 || m_idleWorkers.load() == 0)
+        return;
+
+    const uint64_t post = 1;
+    [[maybe_unused]] const auto wr = write(m_stealFd, &post, sizeof(post));
+}
+
+void nodepool::Rearm(size_t node)
+{
+    // Reports it straight away if anything came in while the node was running
+    struct epoll_event ev { };
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = node;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, m_nodes[node]->eventFd, &ev) != 0)
+        std::cerr << ERR_MARKER << LOG_MARKER << "Failed to rearm " << m_nodes[node]->label << ", error code "
+                  << errno << std::endl;
+}
+
+std::vector<nodepool::NodeStats> nodepool::Statistics() const
+{
+    std::vector<NodeStats> stats {};
+    for (const auto& node : m_nodes)
+        stats.push_back({ node->label, node->runs.load(), node->wakeNs.Take(), node->serviceNs.Take() });
+    return stats;
+}
+
+std::vector<nodepool::WorkerStats> nodepool::WorkerStatistics() const
+{
+    std::vector<WorkerStats> stats {};
+    for (const auto& worker : m_workers)
+        stats.push_back({ worker->runs.load(), worker->harvested.load(), worker->stolen.load() });
+    return stats;
+}
+
+void nodepool::DumpStatistics() const
+{
+    std::cout << LOG_MARKER << m_nodes.size() << " nodes on " << m_workerCount << " workers, ready to running [ns] "
+              << m_wakeNs.Take() << std::endl;
+
+    const auto workers = WorkerStatistics();
+    for (size_t idx = 0; idx < workers.size(); idx++) {
+        std::cout << LOG_MARKER << "Worker " << idx << ": " << workers[idx].runs << " runs, " << workers[idx].harvested
+                  << " harvested, " << workers[idx].stolen << " stolen" << std::endl;
+    }
+
+    for (const auto& node : Statistics()) {
+        std::cout << LOG_MARKER << node.label << ": " << node.runs << " runs, ready to running [ns] p50 "
+                  << node.wakeNs.Percentile(50) << " p99 " << node.wakeNs.Percentile(99) << " max " << node.wakeNs.max
+                  << ", service [ns] p50 " << node.serviceNs.Percentile(50) << " p99 "
+                  << node.serviceNs.Percentile(99) << std::endl;
+    }
+}
+
+namespace {
+
+struct ScalingBenchResult {
+    LatencyHistogram::Snapshot roundTripNs {};
+    uint64_t requests { 0 };
+    uint64_t timeouts { 0 };
+    uint64_t busFrames { 0 };
+    uint64_t cpuNs { 0 };
+    uint64_t wallNs { 0 };
+    LatencyHistogram::Snapshot slowestNodeNs {}; // wake latency of the node with the worst 99th percentile, pool only
+};
+
+LatencyHistogram::Snapshot SlowestNode(const std::vector<nodepool::NodeStats>& nodes)
+{
+    LatencyHistogram::Snapshot slowest {};
+    for (const auto& node : nodes) {
+        if (node.wakeNs.Percentile(99) >= slowest.Percentile(99))
+            slowest = node.wakeNs;
+    }
+    return slowest;
+}
+
+// Full nodes on unlimited virtual buses, plus a tester port per bus cycling through them with SDO uploads of 0x1000.
+// The round trip covers the bus, the node waking up, the stack and the response on its way back. The nodes run on a
+// pool of that many workers, or on a thread each without one.
+ScalingBenchResult RunScalingBench(
+    size_t busCount, size_t nodesPerBus, size_t workerCount, std::chrono::milliseconds duration)
+{
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds ResponseTimeout { 100 };
+    static constexpr std::chrono::microseconds RequestPeriod { 1000 };
+
+    struct Node {
+        std::unique_ptr<mystack> stack {};
+        std::unique_ptr<varloop> app {};
+        std::unique_ptr<nodeloop> loop {};
+    };
+
+    std::vector<std::shared_ptr<VirtualCanBus>> buses {};
+    std::vector<Node> nodes {};
+    for (size_t bus = 0; bus < busCount; bus++) {
+        const auto iface = "scale-" + std::to_string(bus);
+        buses.push_back(VirtualCanBus::Get(iface));
+        for (size_t idx = 0; idx < nodesPerBus; idx++) {
+            Node node {};
+            node.stack = std::make_unique<mystack>("virtual:" + iface, mystack::NodeIdFor(idx));
+            node.app = std::make_unique<varloop>(*node.stack);
+            node.loop = std::make_unique<nodeloop>(*node.stack, *node.app);
+            node.loop->SetMode(nodeloop::Mode::Event);
+            node.stack->NodeStart();
+            nodes.push_back(std::move(node));
+        }
+    }
+
+    std::atomic_bool exitRequest { false };
+    std::vector<std::thread> nodeThreads {};
+    std::unique_ptr<nodepool> pool {};
+    if (workerCount > 0) {
+        pool = std::make_unique<nodepool>(workerCount);
+        for (auto& node : nodes)
+            pool->Add(*node.loop, node.stack->Interface() + "#" + std::to_string(node.stack->NodeId()));
+        nodeThreads.emplace_back([&pool, &exitRequest]() { pool->Run(exitRequest); });
+    } else {
+        for (auto& node : nodes)
+            nodeThreads.emplace_back([&node, &exitRequest]() { node.loop->Run(exitRequest); });
+    }
+
+    LatencyHistogram roundTripNs {};
+    std::atomic<uint64_t> requests { 0 };
+    std::atomic<uint64_t> timeouts { 0 };
+    const auto cpuStart = ProcessCpuNs();
+    const auto start = Clock::now();
+    const auto end = start + duration;
+    std::vector<std::thread> testers {};
+    for (const auto& bus : buses) {
+        testers.emplace_back([&, bus]() {
+            const int port = bus->Attach();
+            std::vector<SocketCAN::RxFilter> responses {};
+            for (size_t idx = 0; idx < nodesPerBus; idx++)
+                responses.push_back({ static_cast<uint32_t>(0x580 + mystack::NodeIdFor(idx)), false });
+            bus->SetFilters(port, responses);
+            struct pollfd wake { bus->NotifyFd(port), POLLIN, 0 };
+
+            VirtualCanBus::Frame request {};
+            request.dlc = 8;
+            request.data = { 0x40, 0x00, 0x10, 0x00 };
+            VirtualCanBus::Frame response {};
+            auto next = Clock::now();
+            for (size_t idx = 0; Clock::now() < end; idx = (idx + 1) % nodesPerBus) {
+                next += RequestPeriod;
+                std::this_thread::sleep_until(next);
+                request.id = static_cast<uint32_t>(0x600 + mystack::NodeIdFor(idx));
+                const auto sent = Clock::now();
+                bus->Send(port, request);
+                requests.fetch_add(1, std::memory_order_relaxed);
+
+                bool answered = false;
+                while (!answered && Clock::now() < sent + ResponseTimeout) {
+                    if (poll(&wake, 1, static_cast<int>(ResponseTimeout.count())) > 0)
+                        bus->Acknowledge(port);
+                    while (bus->Receive(port, response))
+                        answered |= (response.id == request.id - 0x80);
+                }
+                if (answered)
+                    roundTripNs.Record(std::chrono::nanoseconds(Clock::now() - sent).count());
+                else
+                    timeouts.fetch_add(1, std::memory_order_relaxed);
+            }
+            bus->Detach(port);
+        });
+    }
+    for (auto& tester : testers)
+        tester.join();
+
+    ScalingBenchResult result {};
+    result.cpuNs = ProcessCpuNs() - cpuStart;
+    result.wallNs = std::chrono::nanoseconds(Clock::now() - start).count();
+    for (const auto& bus : buses)
+        result.busFrames += bus->Statistics().frames;
+
+    exitRequest.store(true);
+    for (auto& thread : nodeThreads)
+        thread.join();
+    if (pool)
+        result.slowestNodeNs = SlowestNode(pool->Statistics());
+    pool.reset();
+    nodes.clear();
+
+    result.roundTripNs = roundTripNs.Take();
+    result.requests = requests.load();
+    result.timeouts = timeouts.load();
+    return result;
+}
+
+}
+
+void nodepool::Benchmark(std::chrono::milliseconds duration)
+{
+    // Up to a full CANopen network on a single bus, as many nodes as the driver slots allow
+    static constexpr std::array<std::pair<size_t, size_t>, 3> Layouts { {
+        { 4, 2 },
+        { 4, 16 },
+        { 1, mystack::MaxNodeId },
+    } };
+    const size_t poolWorkers = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 4);
+
+    std::vector<std::pair<std::string, ScalingBenchResult>> results {};
+    for (const auto& [busCount, nodesPerBus] : Layouts) {
+        const auto layout = std::to_string(busCount) + "x" + std::to_string(nodesPerBus);
+        results.emplace_back(layout + " threads", RunScalingBench(busCount, nodesPerBus, 0, duration));
+        results.emplace_back(layout + " pool/" + std::to_string(poolWorkers),
+            RunScalingBench(busCount, nodesPerBus, poolWorkers, duration));
+    }
+
+    // Printed at the end, the nodes coming and going are rather chatty
+    std::cout << LOG_MARKER << "Node scaling benchmark, buses x nodes per bus on unlimited virtual buses, event "
+              << "loops on a thread each or on the pool, " << duration.count() << " ms per run" << std::endl;
+    for (const auto& [label, res] : results) {
+        const auto cpuPct = res.wallNs ? res.cpuNs * 100. / res.wallNs : 0.;
+        const auto framesPerSec = res.wallNs ? res.busFrames * 1'000'000'000ULL / res.wallNs : 0;
+        std::cout << LOG_MARKER << std::setw(16) << std::left << label << std::right << " process CPU " << std::fixed
+                  << std::setprecision(2) << cpuPct << std::defaultfloat << "%, " << framesPerSec << " frames/s, "
+                  << res.requests << " SDO requests, " << res.timeouts << " timed out\n"
+                  << LOG_MARKER << std::setw(16) << std::left << label << std::right << " SDO round trip [ns] "
+                  << res.roundTripNs << std::endl;
+        if (res.slowestNodeNs.count > 0) {
+            std::cout << LOG_MARKER << std::setw(16) << std::left << label << std::right
+                      << " slowest node, ready to running [ns] " << res.slowestNodeNs << std::endl;
+        }
+    }
+}
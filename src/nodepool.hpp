@@ -0,0 +1,101 @@
+#ifndef CANOPEN_TIMERS_SRC_NODEPOOL_HPP_
+#define CANOPEN_TIMERS_SRC_NODEPOOL_HPP_
+
+#include "latency_histogram.hpp"
+#include "nodeloop.hpp"
+#include "rt_profile.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs nodes as tasks on a few worker threads, instead of a thread per node. A node gets queued once its event set
+// (nodeloop::EventFd) is readable and runs on one worker at a time: the pool's epoll set hands it out once and only
+// rearms it when the node is done. Workers pick up ready nodes in batches into their own deque and run them newest
+// first, idle ones steal the oldest from the others.
+class nodepool {
+public:
+    struct NodeStats {
+        std::string label {};
+        uint64_t runs { 0 };
+        LatencyHistogram::Snapshot wakeNs {}; // picked up as ready to running on a worker
+        LatencyHistogram::Snapshot serviceNs {}; // one nodeloop::ServiceEvents()
+    };
+
+    struct WorkerStats {
+        uint64_t runs { 0 };
+        uint64_t harvested { 0 }; // ready nodes picked up from the epoll set
+        uint64_t stolen { 0 }; // nodes taken from another worker's deque
+    };
+
+    static constexpr size_t HarvestBatch { 16 };
+    static constexpr std::chrono::milliseconds IdleTimeout { 100 }; // how late an idle worker notices the exit request
+
+    explicit nodepool(size_t workerCount);
+    ~nodepool();
+    nodepool(const nodepool&) = delete;
+    nodepool& operator=(const nodepool&) = delete;
+
+    // Before Run() only, the loop has to outlive the pool
+    bool Add(nodeloop& loop, const std::string& label);
+    void SetStatsPeriod(std::chrono::seconds period);
+
+    // Returns once exitRequest gets set and every worker is done
+    void Run(const std::atomic_bool& exitRequest);
+    std::vector<NodeStats> Statistics() const;
+    std::vector<WorkerStats> WorkerStatistics() const;
+    void DumpStatistics() const;
+
+    // Process CPU and SDO round trips as nodes and virtual buses are added, a thread per node against the pool
+    static void Benchmark(std::chrono::milliseconds duration);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Task {
+        size_t node { 0 };
+        Clock::time_point ready {};
+    };
+
+    struct Node {
+        nodeloop* loop { nullptr };
+        std::string label {};
+        int eventFd { -1 };
+        std::atomic<uint64_t> runs { 0 };
+        LatencyHistogram wakeNs {};
+        LatencyHistogram serviceNs {};
+    };
+
+    struct alignas(64) Worker {
+        rt_mutex lock {};
+        std::deque<Task> tasks {}; // owner at the back, thieves at the front
+        std::atomic<uint64_t> runs { 0 };
+        std::atomic<uint64_t> harvested { 0 };
+        std::atomic<uint64_t> stolen { 0 };
+    };
+
+    const size_t m_workerCount;
+    std::vector<std::unique_ptr<Node>> m_nodes {};
+    std::vector<std::unique_ptr<Worker>> m_workers {};
+    int m_epollFd { -1 };
+    int m_stealFd { -1 }; // posted when a deque has more than its owner can run right away
+    std::atomic<size_t> m_idleWorkers { 0 };
+    std::chrono::seconds m_statsPeriod { 0 };
+    LatencyHistogram m_wakeNs {}; // all nodes together
+
+    void WorkerLoop(size_t self, const std::atomic_bool& exitRequest);
+    bool PopLocal(size_t self, Task& task);
+    bool Steal(size_t self, Task& task);
+    void Harvest(size_t self);
+    void Execute(size_t self, const Task& task);
+    void Push(size_t self, const Task& task, bool front);
+    void OfferSteal();
+    void Rearm(size_t node);
+};
+
+#endif // CANOPEN_TIMERS_SRC_NODEPOOL_HPP_
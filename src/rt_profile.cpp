@@ -0,0 +1,251 @@
+#include "rt_profile.hpp"
+#include "utils.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const std::string LOG_MARKER { "[RT] " };
+static const std::string ERR_MARKER { "E: " };
+static const std::string DBG_MARKER { "D: " };
+
+std::array<rt_profile::ThreadSettings, rt_profile::ThreadCount> rt_profile::s_settings {};
+bool rt_profile::s_memoryLock { false };
+bool rt_profile::s_priorityInheritance { false };
+
+bool rt_profile::Configure(Thread thread, const std::string& spec)
+{
+    const auto parts = utils::Split(spec, ":", false);
+    if (parts.empty() || parts.size() > 3)
+        return false;
+
+    ThreadSettings settings {};
+    if (!ParsePolicy(parts[0], settings.policy))
+        return false;
+
+    // Without one, the lowest priority the policy allows: 1 for the real-time ones, 0 otherwise
+    const auto minPrio = sched_get_priority_min(settings.policy);
+    const auto maxPrio = sched_get_priority_max(settings.policy);
+    settings.priority = minPrio;
+    if (parts.size() > 1 && !parts[1].empty()) {
+        char* end = nullptr;
+        settings.priority = static_cast<int>(std::strtol(parts[1].c_str(), &end, 10));
+        if (*end != '\0')
+            return false;
+    }
+
+    if (settings.priority < minPrio || settings.priority > maxPrio) {
+        std::cerr << ERR_MARKER << LOG_MARKER << ThreadName(thread) << ": priority must be within [" << minPrio << ", "
+                  << maxPrio << "] for this policy" << std::endl;
+        return false;
+    }
+
+    if (parts.size() > 2 && !ParseCPUs(parts[2], settings.cpus))
+        return false;
+
+    settings.configured = true;
+    s_settings[static_cast<size_t>(thread)] = settings;
+    return true;
+}
+
+void rt_profile::SetMemoryLock(bool enable)
+{
+    s_memoryLock = enable;
+}
+
+void rt_profile::SetPriorityInheritance(bool enable)
+{
+    s_priorityInheritance = enable;
+}
+
+bool rt_profile::PriorityInheritance()
+{
+    return s_priorityInheritance;
+}
+
+bool rt_profile::ApplyToCurrentThread(Thread thread)
+{
+    // Stack pages must be touched from the thread owning them, and only matter when they stay locked afterwards
+    if (s_memoryLock)
+        PrefaultStack();
+
+    const auto& settings = s_settings[static_cast<size_t>(thread)];
+    if (!settings.configured)
+        return true;
+
+    bool ok = true;
+    struct sched_param param { };
+    param.sched_priority = settings.priority;
+    auto rc = pthread_setschedparam(pthread_self(), settings.policy, &param);
+    if (rc != 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << ThreadName(thread) << ": failed to set scheduling policy, error code "
+                  << rc << std::endl;
+        ok = false;
+    }
+
+    if (!settings.cpus.empty()) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (const auto cpu : settings.cpus)
+            CPU_SET(cpu, &cpuSet);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (rc != 0) {
+            std::cerr << ERR_MARKER << LOG_MARKER << ThreadName(thread) << ": failed to set CPU affinity, error code "
+                      << rc << std::endl;
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        std::cout << LOG_MARKER << ThreadName(thread) << ": policy " << settings.policy << ", priority "
+                  << settings.priority << ", " << (settings.cpus.empty() ? "any" : std::to_string(settings.cpus.size()))
+                  << " CPU(s)" << std::endl;
+    }
+    return ok;
+}
+
+bool rt_profile::FillAttributes(Thread thread, pthread_attr_t& attr)
+{
+    // For threads we don't spawn ourselves (eg, SIGEV_THREAD helpers), so the settings must be baked in beforehand
+    const auto& settings = s_settings[static_cast<size_t>(thread)];
+    if (!settings.configured)
+        return false;
+
+    struct sched_param param { };
+    param.sched_priority = settings.priority;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, settings.policy);
+    pthread_attr_setschedparam(&attr, &param);
+
+    if (!settings.cpus.empty()) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (const auto cpu : settings.cpus)
+            CPU_SET(cpu, &cpuSet);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuSet), &cpuSet);
+    }
+    return true;
+}
+
+bool rt_profile::LockMemory()
+{
+    if (!s_memoryLock)
+        return true;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        const auto tempErrno = errno;
+        std::cerr << ERR_MARKER << LOG_MARKER << "mlockall failed with errno " << tempErrno << std::endl;
+        return false;
+    }
+
+    std::cout << LOG_MARKER << "Process memory locked" << std::endl;
+    return true;
+}
+
+std::string rt_profile::ThreadName(Thread thread)
+{
+    switch (thread) {
+    case Thread::Main:
+        return "main";
+    case Thread::CanRx:
+        return "can-rx";
+    case Thread::Timer:
+        return "timer";
+    default:
+        return "unknown";
+    }
+}
+
+bool rt_profile::ParsePolicy(const std::string& name, int& policy)
+{
+    if (name == "other")
+        policy = SCHED_OTHER;
+    else if (name == "fifo")
+        policy = SCHED_FIFO;
+    else if (name == "rr")
+        policy = SCHED_RR;
+    else if (name == "batch")
+        policy = SCHED_BATCH;
+    else if (name == "idle")
+        policy = SCHED_IDLE;
+    else
+        return false;
+    return true;
+}
+
+bool rt_profile::ParseCPUs(const std::string& list, std::vector<int>& cpus)
+{
+    const auto cpuCount = static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
+    for (const auto& range : utils::Split(list, ",")) {
+        const auto bounds = utils::Split(range, "-");
+        if (bounds.empty() || bounds.size() > 2)
+            return false;
+
+        char* end = nullptr;
+        const auto first = static_cast<int>(std::strtol(bounds.front().c_str(), &end, 10));
+        if (*end != '\0')
+            return false;
+        const auto last = static_cast<int>(std::strtol(bounds.back().c_str(), &end, 10));
+        if (*end != '\0' || first > last || first < 0 || last >= cpuCount)
+            return false;
+
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return !cpus.empty();
+}
+
+void rt_profile::PrefaultStack()
+{
+    // Touch a chunk of stack once, so that with MCL_FUTURE it gets locked in before any time-critical work
+    volatile uint8_t stackChunk[PrefaultStackBytes];
+    const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    for (size_t off = 0; off < sizeof(stackChunk); off += pageSize)
+        stackChunk[off] = 0;
+}
+
+rt_mutex::rt_mutex()
+{
+    Initialize();
+}
+
+rt_mutex::~rt_mutex()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void rt_mutex::lock()
+{
+    pthread_mutex_lock(&m_mutex);
+}
+
+bool rt_mutex::try_lock()
+{
+    return pthread_mutex_trylock(&m_mutex) == 0;
+}
+
+void rt_mutex::unlock()
+{
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void rt_mutex::Reinitialize()
+{
+    pthread_mutex_destroy(&m_mutex);
+    Initialize();
+}
+
+void rt_mutex::Initialize()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (rt_profile::PriorityInheritance())
+        pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&m_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
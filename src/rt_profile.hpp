@@ -0,0 +1,80 @@
+#ifndef CANOPEN_TIMERS_SRC_RT_PROFILE_HPP_
+#define CANOPEN_TIMERS_SRC_RT_PROFILE_HPP_
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+// Runtime-configurable real-time profile: scheduling policy, priority and CPU set for every thread the application
+// owns, plus memory locking and priority-inheritance for the stack locks. Everything defaults to "leave it alone".
+class rt_profile {
+public:
+    enum class Thread {
+        Main, // node loops, each node thread or pool worker running mystack::NodeTick
+        CanRx, // SocketCAN poller spawned by co_can_linux
+        Timer, // timer HAL service thread(s)
+    };
+
+    struct ThreadSettings {
+        bool configured { false };
+        int policy { SCHED_OTHER };
+        int priority { 0 };
+        std::vector<int> cpus {};
+    };
+
+    // Spec format: <policy>[:<priority>[:<cpu list>]], eg `fifo:80:2-3' or `other::1'. Priority defaults to the
+    // policy's minimum.
+    static bool Configure(Thread thread, const std::string& spec);
+    static void SetMemoryLock(bool enable);
+    static void SetPriorityInheritance(bool enable);
+    static bool PriorityInheritance();
+
+    static bool ApplyToCurrentThread(Thread thread);
+    static bool FillAttributes(Thread thread, pthread_attr_t& attr);
+    static bool LockMemory();
+    static std::string ThreadName(Thread thread);
+
+private:
+    static constexpr size_t ThreadCount { 3 };
+    static constexpr size_t PrefaultStackBytes { 256 * 1024 };
+
+    static std::array<ThreadSettings, ThreadCount> s_settings;
+    static bool s_memoryLock;
+    static bool s_priorityInheritance;
+
+    static bool ParsePolicy(const std::string& name, int& policy);
+    static bool ParseCPUs(const std::string& list, std::vector<int>& cpus);
+    static void PrefaultStack();
+
+    // Make it purely static
+    rt_profile() = delete;
+    ~rt_profile() = delete;
+};
+
+// Drop-in replacement for std::mutex, optionally using PTHREAD_PRIO_INHERIT. Protocol is picked from rt_profile when
+// constructed, or later through Reinitialize() as long as nobody is using the lock yet.
+class rt_mutex {
+public:
+    rt_mutex();
+    ~rt_mutex();
+
+    rt_mutex(const rt_mutex&) = delete;
+    rt_mutex& operator=(const rt_mutex&) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    void Reinitialize();
+
+private:
+    pthread_mutex_t m_mutex {};
+
+    void Initialize();
+};
+
+#endif // CANOPEN_TIMERS_SRC_RT_PROFILE_HPP_
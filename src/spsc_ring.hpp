@@ -0,0 +1,135 @@
+#ifndef CANOPEN_TIMERS_SRC_SPSC_RING_HPP_
+#define CANOPEN_TIMERS_SRC_SPSC_RING_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Fixed-capacity lock-free ring for exactly one producer thread and one consumer thread. Storage is allocated once
+// with the ring, head and tail live on separate cache lines and each side keeps a cached copy of the other index, so
+// in steady state a push or a pop touches no shared line but the slot itself and its own index.
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static_assert(std::is_copy_assignable_v<T>, "Elements are copied in and out of the ring");
+
+public:
+    static constexpr size_t CacheLine { 64 };
+
+    // Producer side only. A full ring drops the element and counts it as an overflow.
+    inline bool TryPush(const T& item)
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cachedHead >= Capacity) {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail - m_cachedHead >= Capacity) {
+                m_overflows.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        m_slots[tail & Mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side only
+    inline bool TryPop(T& item)
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cachedTail) {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cachedTail)
+                return false;
+        }
+
+        item = m_slots[head & Mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side only, in-place counterpart of TryPush(): hands out up to `count' free slots from the tail to be
+    // written directly, the consumer only sees them once published. Publish() may take fewer than were reserved.
+    inline size_t Reserve(T** slots, size_t count)
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (Capacity - (tail - m_cachedHead) < count)
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+
+        const auto reserved = std::min<size_t>(Capacity - (tail - m_cachedHead), count);
+        for (size_t idx = 0; idx < reserved; idx++)
+            slots[idx] = &m_slots[(tail + idx) & Mask];
+        return reserved;
+    }
+
+    inline void Publish(size_t count)
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    // Producer side only, for elements dropped without even trying TryPush()
+    inline void CountOverflows(size_t count)
+    {
+        m_overflows.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // Consumer side only, in-place counterpart of TryPop(): the oldest element stays valid until Release()
+    inline const T* Front()
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cachedTail) {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cachedTail)
+                return nullptr;
+        }
+        return &m_slots[head & Mask];
+    }
+
+    inline void Release()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side only, drops whatever has been queued so far
+    inline void Clear()
+    {
+        m_head.store(m_tail.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // Approximate when called while the other side is running, exact otherwise
+    inline size_t Size() const
+    {
+        const auto head = m_head.load(std::memory_order_acquire);
+        const auto tail = m_tail.load(std::memory_order_acquire);
+        return static_cast<size_t>(tail - head);
+    }
+
+    inline bool Empty() const
+    {
+        return Size() == 0;
+    }
+
+    inline uint64_t Overflows() const
+    {
+        return m_overflows.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t Mask { Capacity - 1 };
+
+    // Producer-owned line
+    alignas(CacheLine) std::atomic<size_t> m_tail { 0 };
+    size_t m_cachedHead { 0 };
+    std::atomic<uint64_t> m_overflows { 0 };
+
+    // Consumer-owned line
+    alignas(CacheLine) std::atomic<size_t> m_head { 0 };
+    size_t m_cachedTail { 0 };
+
+    alignas(CacheLine) std::array<T, Capacity> m_slots {};
+};
+
+#endif // CANOPEN_TIMERS_SRC_SPSC_RING_HPP_
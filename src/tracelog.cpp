@@ -0,0 +1,385 @@
+#include "tracelog.hpp"
+#include "socketcan/socketcan.hpp"
+#include "spsc_ring.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <linux/can.h>
+
+static const std::string LOG_MARKER { "[Trace] " };
+static const std::string ERR_MARKER { "E: " };
+static const std::string DBG_MARKER { "D: " };
+
+static_assert(sizeof(tracelog::Record) == 48, "Records are written to file as they are");
+static_assert(std::atomic<tracelog::Level>::is_always_lock_free, "ToggleTrace() runs in signal handlers");
+
+#ifndef NDEBUG
+std::atomic<tracelog::Level> tracelog::s_level { tracelog::Level::Trace };
+std::atomic<tracelog::Level> tracelog::s_baseLevel { tracelog::Level::Trace };
+#else
+std::atomic<tracelog::Level> tracelog::s_level { tracelog::Level::Info };
+std::atomic<tracelog::Level> tracelog::s_baseLevel { tracelog::Level::Info };
+#endif
+
+namespace {
+
+using Ring = SpscRing<tracelog::Record, tracelog::RingCapacity>;
+
+struct ThreadRing {
+    Ring ring {};
+    std::atomic_bool retired { false }; // its thread is gone, dropped once drained
+};
+
+struct State {
+    std::mutex lock {}; // rings and origins, never taken when logging into an existing ring
+    std::vector<std::shared_ptr<ThreadRing>> rings {};
+    std::array<std::string, tracelog::MaxOrigins> origins {};
+    std::atomic<size_t> originCount { 0 };
+    std::atomic_bool running { false };
+    std::atomic_bool stopRequest { false };
+    std::thread writer {};
+    std::FILE* file { nullptr };
+    uint64_t retiredDrops { 0 }; // overflows of rings already dropped
+};
+
+// Constructed on first use, origins get registered during static initialization
+State& GetState()
+{
+    static State s_state {};
+    return s_state;
+}
+
+// A thread's ring, registered with its first record and retired when the thread exits
+struct ThreadRingHandle {
+    std::shared_ptr<ThreadRing> ring {};
+
+    ~ThreadRingHandle()
+    {
+        if (ring)
+            ring->retired.store(true, std::memory_order_release);
+    }
+};
+
+thread_local ThreadRingHandle t_ring {};
+
+uint64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+const std::string& LevelMarker(tracelog::Level level)
+{
+    static const std::string info { "" };
+    static const std::string warning { "W: " };
+    switch (level) {
+    case tracelog::Level::Trace:
+    case tracelog::Level::Debug:
+        return DBG_MARKER;
+    case tracelog::Level::Warning:
+        return warning;
+    case tracelog::Level::Error:
+        return ERR_MARKER;
+    default:
+        return info;
+    }
+}
+
+void Format(std::ostream& out, const tracelog::Record& record)
+{
+    const auto& state = GetState();
+    out << LevelMarker(record.level);
+    if (record.origin < state.originCount.load(std::memory_order_acquire))
+        out << state.origins[record.origin];
+
+    switch (record.event) {
+    case tracelog::Event::CanTx:
+        out << "> TX " << utils::ToHex(record.id, true) << " " << utils::DumpBuffer(record.data, record.len);
+        break;
+    case tracelog::Event::CanRx:
+        out << "< RX " << utils::ToHex(record.id, true) << " " << utils::DumpBuffer(record.data, record.len);
+        break;
+    case tracelog::Event::CanErrorFrame: {
+        can_frame frame {};
+        frame.can_id = record.id;
+        frame.can_dlc = record.len;
+        std::memcpy(frame.data, record.data, sizeof(frame.data));
+        out << record.tag << ": frame error!\n" << SocketCAN::TranslateErrorFrame(frame);
+        break;
+    }
+    case tracelog::Event::RxQueueFull:
+        out << record.tag << ": rx queue full (" << record.arg << " frames), dropping frames!";
+        break;
+    case tracelog::Event::RxBacklog:
+        out << record.tag << ": rx queue has collected >" << record.arg << " frames! Expect dispatch delays!";
+        break;
+    case tracelog::Event::TimerRearmed:
+        out << record.tag << ": " << record.arg << " ms with soft-timers pending and nothing armed, re-armed";
+        break;
+    case tracelog::Event::TimerServiced:
+        out << record.tag << ": " << record.arg << " ms with expired soft-timers never serviced, servicing now";
+        break;
+    default:
+        out << record.tag << ": unknown event " << static_cast<unsigned>(record.event);
+        break;
+    }
+}
+
+std::ostream& StreamFor(const tracelog::Record& record)
+{
+    return (record.level >= tracelog::Level::Error) ? std::cerr : std::cout;
+}
+
+// Takes whatever the rings hold right now, and forgets the rings of threads that are gone once they're empty
+void Collect(std::vector<tracelog::Record>& batch)
+{
+    auto& state = GetState();
+    std::vector<std::shared_ptr<ThreadRing>> rings {};
+    {
+        std::scoped_lock lock(state.lock);
+        rings = state.rings;
+    }
+
+    bool anyRetired = false;
+    for (const auto& ring : rings) {
+        // Read before draining, whatever a retired ring held by then is all it'll ever hold
+        const bool retired = ring->retired.load(std::memory_order_acquire);
+        tracelog::Record record {};
+        while (ring->ring.TryPop(record))
+            batch.push_back(record);
+        anyRetired = anyRetired || retired;
+    }
+    if (!anyRetired)
+        return;
+
+    std::scoped_lock lock(state.lock);
+    for (auto ring = state.rings.begin(); ring != state.rings.end();) {
+        if ((*ring)->retired.load(std::memory_order_acquire) && (*ring)->ring.Empty()) {
+            state.retiredDrops += (*ring)->ring.Overflows();
+            ring = state.rings.erase(ring);
+        } else {
+            ring++;
+        }
+    }
+}
+
+void Emit(std::vector<tracelog::Record>& batch)
+{
+    if (batch.empty())
+        return;
+
+    // Each ring is in order already, interleave them
+    std::stable_sort(batch.begin(), batch.end(), [](const tracelog::Record& lhs, const tracelog::Record& rhs) {
+        return lhs.timestampNs < rhs.timestampNs;
+    });
+
+    auto& state = GetState();
+    for (const auto& record : batch) {
+        if (state.file) {
+            std::fwrite(&record, sizeof(record), 1, state.file);
+            if (record.level < tracelog::Level::Warning)
+                continue;
+        }
+        auto& out = StreamFor(record);
+        Format(out, record);
+        out << '\n';
+    }
+    std::cout.flush();
+    std::cerr.flush();
+    batch.clear();
+}
+
+void WriterLoop()
+{
+    auto& state = GetState();
+    std::vector<tracelog::Record> batch {};
+    batch.reserve(tracelog::RingCapacity);
+    while (!state.stopRequest.load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(tracelog::FlushPeriod);
+        Collect(batch);
+        Emit(batch);
+    }
+}
+
+bool WriteFileHeader(std::FILE* file)
+{
+    const auto& state = GetState();
+    const uint32_t recordSize = sizeof(tracelog::Record);
+    const uint32_t originCount = state.originCount.load(std::memory_order_acquire);
+    bool ok = (std::fwrite(tracelog::FileMagic, sizeof(tracelog::FileMagic), 1, file) == 1)
+        && (std::fwrite(&recordSize, sizeof(recordSize), 1, file) == 1)
+        && (std::fwrite(&originCount, sizeof(originCount), 1, file) == 1);
+    for (size_t origin = 0; ok && origin < originCount; origin++)
+        ok = (std::fwrite(state.origins[origin].c_str(), state.origins[origin].size() + 1, 1, file) == 1);
+    return ok;
+}
+
+} // namespace
+
+tracelog::Origin tracelog::RegisterOrigin(const std::string& marker)
+{
+    auto& state = GetState();
+    std::scoped_lock lock(state.lock);
+    const auto count = state.originCount.load(std::memory_order_relaxed);
+    for (size_t origin = 0; origin < count; origin++) {
+        if (state.origins[origin] == marker)
+            return static_cast<Origin>(origin);
+    }
+    if (count == MaxOrigins) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Too many origins, `" << marker << "' logs as the last one"
+                  << std::endl;
+        return static_cast<Origin>(MaxOrigins - 1);
+    }
+
+    state.origins[count] = marker;
+    state.originCount.store(count + 1, std::memory_order_release);
+    return static_cast<Origin>(count);
+}
+
+bool tracelog::SetLevel(const std::string& name)
+{
+    static const std::map<std::string, Level, std::less<>> levels {
+        { "trace", Level::Trace },
+        { "debug", Level::Debug },
+        { "info", Level::Info },
+        { "warn", Level::Warning },
+        { "error", Level::Error },
+        { "off", Level::Off },
+    };
+
+    const auto level = levels.find(name);
+    if (level == levels.end())
+        return false;
+
+    SetLevel(level->second);
+    return true;
+}
+
+void tracelog::SetLevel(Level level)
+{
+    s_baseLevel.store(level, std::memory_order_relaxed);
+    s_level.store(level, std::memory_order_relaxed);
+}
+
+tracelog::Level tracelog::CurrentLevel()
+{
+    return s_level.load(std::memory_order_relaxed);
+}
+
+void tracelog::ToggleTrace()
+{
+    const auto base = s_baseLevel.load(std::memory_order_relaxed);
+    const auto current = s_level.load(std::memory_order_relaxed);
+    s_level.store((current == Level::Trace) ? base : Level::Trace, std::memory_order_relaxed);
+}
+
+bool tracelog::Start(const std::string& filePath)
+{
+    auto& state = GetState();
+    if (state.running.load(std::memory_order_acquire))
+        return true;
+
+    if (!filePath.empty()) {
+        state.file = std::fopen(filePath.c_str(), "wb");
+        if (!state.file) {
+            std::cerr << ERR_MARKER << LOG_MARKER << "Failed to open " << filePath << ", error code " << errno
+                      << std::endl;
+            return false;
+        }
+        if (!WriteFileHeader(state.file)) {
+            std::cerr << ERR_MARKER << LOG_MARKER << "Failed to write to " << filePath << std::endl;
+            std::fclose(state.file);
+            state.file = nullptr;
+            return false;
+        }
+        std::cout << LOG_MARKER << "Binary records go to " << filePath << std::endl;
+    }
+
+    state.stopRequest.store(false, std::memory_order_release);
+    state.writer = std::thread(WriterLoop);
+    state.running.store(true, std::memory_order_release);
+    return true;
+}
+
+void tracelog::Stop()
+{
+    auto& state = GetState();
+    if (!state.running.exchange(false, std::memory_order_acq_rel))
+        return;
+
+    state.stopRequest.store(true, std::memory_order_release);
+    state.writer.join();
+
+    // Whatever came in after the writer's last round
+    std::vector<tracelog::Record> batch {};
+    Collect(batch);
+    Emit(batch);
+    if (state.file) {
+        std::fclose(state.file);
+        state.file = nullptr;
+    }
+
+    const auto dropped = Dropped();
+    if (dropped > 0)
+        std::cerr << "W: " << LOG_MARKER << dropped << " records dropped, rings were full" << std::endl;
+}
+
+uint64_t tracelog::Dropped()
+{
+    auto& state = GetState();
+    std::scoped_lock lock(state.lock);
+    uint64_t dropped = state.retiredDrops;
+    for (const auto& ring : state.rings)
+        dropped += ring->ring.Overflows();
+    return dropped;
+}
+
+void tracelog::Append(Level level, Origin origin, Event event, const std::string& tag, uint32_t id, uint32_t arg,
+    const uint8_t* data, size_t len)
+{
+    // Without the writer, tracing would mean formatting and flushing in the hot path: only events get through
+    auto& state = GetState();
+    const bool running = state.running.load(std::memory_order_acquire);
+    if (!running && level < Level::Info)
+        return;
+
+    Record record {};
+    record.timestampNs = NowNs();
+    record.id = id;
+    record.arg = arg;
+    record.event = event;
+    record.level = level;
+    record.origin = origin;
+    record.len = static_cast<uint8_t>(std::min(len, sizeof(record.data)));
+    if (data)
+        std::memcpy(record.data, data, record.len);
+    std::strncpy(record.tag, tag.c_str(), sizeof(record.tag) - 1);
+
+    if (!running) {
+        auto& out = StreamFor(record);
+        Format(out, record);
+        out << std::endl;
+        return;
+    }
+
+    // Only a thread's very first record takes the lock
+    if (!t_ring.ring) {
+        auto ring = std::make_shared<ThreadRing>();
+        std::scoped_lock lock(state.lock);
+        state.rings.push_back(ring);
+        t_ring.ring = ring;
+    }
+    t_ring.ring->ring.TryPush(record);
+}
@@ -0,0 +1,98 @@
+#ifndef CANOPEN_TIMERS_SRC_TRACELOG_HPP_
+#define CANOPEN_TIMERS_SRC_TRACELOG_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Logging for the hot paths: every event is a fixed-size binary record copied into a lock-free ring owned by the
+// thread logging it, a background thread collects them every FlushPeriod and formats them, or writes them to a file as
+// they are, in timestamp order. A record below the current level costs a relaxed load, any other one a copy into the
+// ring: no formatting, no locks, no syscalls. Until Start() records from Info up get formatted right away on the
+// calling thread, Trace and Debug ones are dropped.
+class tracelog {
+public:
+    enum class Level : uint8_t {
+        Trace, // every frame in and out
+        Debug,
+        Info,
+        Warning,
+        Error,
+        Off,
+    };
+
+    enum class Event : uint8_t {
+        CanTx, // id and payload of a frame the stack sent
+        CanRx, // id and payload of a frame handed to the stack
+        CanErrorFrame, // can_id and data of the error frame as received
+        RxQueueFull, // arg: queue capacity, frames get dropped
+        RxBacklog, // arg: frames queued above which dispatching falls behind
+        TimerRearmed, // arg: ms the soft-timers were pending with no OS timer armed
+        TimerServiced, // arg: ms expired soft-timers were left unserviced
+    };
+
+    using Origin = uint8_t;
+
+    // Same layout in memory and in the binary file, host byte order
+    struct Record {
+        uint64_t timestampNs { 0 }; // steady clock
+        uint32_t id { 0 };
+        uint32_t arg { 0 };
+        Event event {};
+        Level level {};
+        Origin origin { 0 };
+        uint8_t len { 0 };
+        uint8_t data[8] {};
+        char tag[16] {}; // interface or bus name, truncated
+        uint8_t reserved[4] {};
+    };
+
+    static constexpr size_t RingCapacity { 1024 }; // records per logging thread, more get dropped and counted
+    static constexpr size_t MaxOrigins { 32 };
+    static constexpr std::chrono::milliseconds FlushPeriod { 20 };
+    static constexpr char FileMagic[8] { 'C', 'O', 'T', 'R', 'A', 'C', 'E', '1' };
+
+    // Once per module, at static initialization with its LOG_MARKER: records carry the index, not the text
+    static Origin RegisterOrigin(const std::string& marker);
+
+    // `trace', `debug', `info', `warn', `error' or `off'
+    static bool SetLevel(const std::string& name);
+    static void SetLevel(Level level);
+    static Level CurrentLevel();
+
+    // Async-signal-safe, flips between Trace and whatever level was set last
+    static void ToggleTrace();
+
+    // With a file, records go there in binary, behind a header with the magic, the record size and the origins, and
+    // only warnings and errors still get printed
+    static bool Start(const std::string& filePath = "");
+    static void Stop();
+    static uint64_t Dropped();
+
+    static inline bool Enabled(Level level)
+    {
+        return level >= s_level.load(std::memory_order_relaxed);
+    }
+
+    static inline void Log(Level level, Origin origin, Event event, const std::string& tag, uint32_t id,
+        uint32_t arg = 0, const uint8_t* data = nullptr, size_t len = 0)
+    {
+        if (Enabled(level))
+            Append(level, origin, event, tag, id, arg, data, len);
+    }
+
+private:
+    static std::atomic<Level> s_level;
+    static std::atomic<Level> s_baseLevel; // the one ToggleTrace() returns to
+
+    static void Append(Level level, Origin origin, Event event, const std::string& tag, uint32_t id, uint32_t arg,
+        const uint8_t* data, size_t len);
+
+    // Make it purely static
+    tracelog() = delete;
+    ~tracelog() = delete;
+};
+
+#endif // CANOPEN_TIMERS_SRC_TRACELOG_HPP_
@@ -1,25 +1,79 @@
 #include "varloop.hpp"
 #include "co_addr.hpp"
+#include "co_timer_linux.hpp"
+
+#include <cerrno>
+#include <iostream>
+#include <string>
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static const std::string LOG_MARKER { "[App] " };
+static const std::string ERR_MARKER { "E: " };
 
 varloop::varloop(mystack& coStack)
     : m_coStack(coStack)
 {
 }
 
+varloop::~varloop()
+{
+    if (m_updateFd >= 0)
+        close(m_updateFd);
+}
+
 void varloop::Tick()
 {
-    if (std::chrono::steady_clock::now() > m_lastUpdate + TickRate) {
-        m_dataPoint1++;
-        m_dataPoint2--;
-        if (m_dataPoint3 != 0x8000000)
-            m_dataPoint3 *= 2;
-        else
-            m_dataPoint3 = 1;
-
-        m_coStack.SetObject(Addresses::App_Data1, m_dataPoint1);
-        m_coStack.SetObject(Addresses::App_Data2, m_dataPoint2);
-        m_coStack.SetObject(Addresses::App_Data3, m_dataPoint3);
-
-        m_lastUpdate = std::chrono::steady_clock::now();
+    // Follow the timer HAL clock, so that simulated runs keep the same update pace as the stack
+    if (m_coStack.Timer().Now() > m_lastUpdate + TickRate)
+        Update();
+}
+
+void varloop::Update()
+{
+    m_dataPoint1++;
+    m_dataPoint2--;
+    if (m_dataPoint3 != 0x8000000)
+        m_dataPoint3 *= 2;
+    else
+        m_dataPoint3 = 1;
+
+    m_coStack.SetObject(Addresses::App_Data1, m_dataPoint1);
+    m_coStack.SetObject(Addresses::App_Data2, m_dataPoint2);
+    m_coStack.SetObject(Addresses::App_Data3, m_dataPoint3);
+
+    m_lastUpdate = m_coStack.Timer().Now();
+}
+
+int varloop::UpdateFd()
+{
+    if (m_updateFd >= 0)
+        return m_updateFd;
+
+    m_updateFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_updateFd < 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Failed to create update timer, error code " << errno << std::endl;
+        return -1;
+    }
+
+    // Periodic, so the pace doesn't depend on how late each update gets picked up
+    const auto periodNs = std::chrono::duration_cast<std::chrono::nanoseconds>(TickRate).count();
+    struct itimerspec spec { };
+    spec.it_interval.tv_sec = periodNs / 1'000'000'000;
+    spec.it_interval.tv_nsec = periodNs % 1'000'000'000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(m_updateFd, 0, &spec, nullptr) != 0) {
+        std::cerr << ERR_MARKER << LOG_MARKER << "Failed to arm update timer, error code " << errno << std::endl;
+        close(m_updateFd);
+        m_updateFd = -1;
     }
-}
\ No newline at end of file
+    return m_updateFd;
+}
+
+bool varloop::UpdateDue()
+{
+    uint64_t expirations = 0;
+    return m_updateFd >= 0 && read(m_updateFd, &expirations, sizeof(expirations)) == sizeof(expirations)
+        && expirations > 0;
+}
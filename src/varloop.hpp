@@ -9,8 +9,14 @@
 class varloop {
 public:
     explicit varloop(mystack& coStack);
+    ~varloop();
 
-    void Tick();
+    void Tick(); // updates the data points once TickRate went by since the last time
+    void Update();
+
+    // Periodic timerfd firing every TickRate, for loops that block instead of calling Tick() all the time
+    int UpdateFd();
+    bool UpdateDue();
 
 private:
     static constexpr std::chrono::milliseconds TickRate { 500 };
@@ -20,6 +26,7 @@ private:
     uint32_t m_dataPoint1 { 0 };
     uint32_t m_dataPoint2 { UINT32_MAX };
     uint32_t m_dataPoint3 { 1 };
+    int m_updateFd { -1 };
 };
 
 #endif // CANOPEN_TIMERS_SRC_VARLOOP_HPP_
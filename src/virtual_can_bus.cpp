@@ -0,0 +1,421 @@
+#include "virtual_can_bus.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static const std::string LOG_MARKER { "[VBus] " };
+static const std::string ERR_MARKER { "E: " };
+static const std::string DBG_MARKER { "D: " };
+
+// Slot header layout
+static constexpr uint64_t HeaderId29Bit { 1ULL << 29 };
+static constexpr size_t HeaderDlcShift { 32 };
+static constexpr size_t HeaderSenderShift { 40 };
+
+std::shared_ptr<VirtualCanBus> VirtualCanBus::Get(const std::string& name, int bitrate)
+{
+    // Setup path only, the frames themselves never go near this lock
+    static std::mutex s_registryMtx {};
+    static std::map<std::string, std::weak_ptr<VirtualCanBus>> s_registry {};
+
+    std::scoped_lock registryGuard(s_registryMtx);
+    if (auto bus = s_registry[name].lock()) {
+        if (bitrate != bus->m_bitrate) {
+            std::cout << "W: " << LOG_MARKER << name << ": already running at "
+                      << (bus->m_bitrate ? std::to_string(bus->m_bitrate) + " bps" : "unlimited speed")
+                      << ", ignoring the requested " << bitrate << " bps" << std::endl;
+        }
+        return bus;
+    }
+
+    std::shared_ptr<VirtualCanBus> bus { new VirtualCanBus(name, bitrate) };
+    s_registry[name] = bus;
+    return bus;
+}
+
+VirtualCanBus::VirtualCanBus(const std::string& name, int bitrate)
+    : m_name(name)
+    , m_bitrate(std::max(bitrate, 0))
+{
+    if (m_bitrate == 0)
+        return;
+
+    m_wireWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wireWakeFd < 0)
+        std::cerr << ERR_MARKER << LOG_MARKER << m_name << ": failed to create wire wakeup, error code " << errno
+                  << std::endl;
+    m_wire = std::make_unique<std::thread>([this]() { RunWire(); });
+}
+
+VirtualCanBus::~VirtualCanBus()
+{
+    if (m_wire && m_wire->joinable()) {
+        m_stopWire.store(true);
+        const uint64_t post = 1;
+        [[maybe_unused]] const auto wr = write(m_wireWakeFd, &post, sizeof(post));
+        m_wire->join();
+    }
+    if (m_wireWakeFd >= 0)
+        close(m_wireWakeFd);
+
+    for (auto& port : m_ports) {
+        if (const auto notifyFd = port.notifyFd.load(); notifyFd >= 0)
+            close(notifyFd);
+    }
+}
+
+const std::string& VirtualCanBus::Name() const
+{
+    return m_name;
+}
+
+int VirtualCanBus::Bitrate() const
+{
+    return m_bitrate;
+}
+
+int VirtualCanBus::Attach()
+{
+    for (size_t idx = 0; idx < MaxPorts; idx++) {
+        auto& port = m_ports[idx];
+        bool expected = false;
+        if (!port.attached.compare_exchange_strong(expected, true))
+            continue;
+
+        // Starts listening from here on, nothing sent before it attached
+        port.cursor.store(m_tail.load(std::memory_order_acquire), std::memory_order_release);
+        port.filters.clear();
+        port.sent.store(0, std::memory_order_relaxed);
+        port.received.store(0, std::memory_order_relaxed);
+        port.filtered.store(0, std::memory_order_relaxed);
+        port.overruns.store(0, std::memory_order_relaxed);
+        port.txDelayNs.Reset();
+        // Frames the previous user left queued are the wire thread's to pop, it drops them as not ours
+        port.owner.fetch_add(1, std::memory_order_release);
+        Acknowledge(static_cast<int>(idx));
+
+        auto used = m_portsUsed.load();
+        while (used < idx + 1 && !m_portsUsed.compare_exchange_weak(used, idx + 1)) { }
+        return static_cast<int>(idx);
+    }
+
+    std::cerr << ERR_MARKER << LOG_MARKER << m_name << ": all " << MaxPorts << " ports in use" << std::endl;
+    return InvalidPort;
+}
+
+void VirtualCanBus::Detach(int port)
+{
+    // The notification fd stays around for the next user of the port, senders may still be posting to it
+    if (Valid(port))
+        m_ports[port].attached.store(false);
+}
+
+bool VirtualCanBus::Valid(int port) const
+{
+    return port >= 0 && static_cast<size_t>(port) < MaxPorts && m_ports[port].attached.load(std::memory_order_relaxed);
+}
+
+bool VirtualCanBus::Send(int port, const Frame& frame)
+{
+    if (!Valid(port) || frame.dlc > SocketCAN::MaxClassicPayloadLen)
+        return false;
+
+    auto& tx = m_ports[port];
+    if (m_bitrate == 0) {
+        Publish(port, frame, NowNs());
+        tx.sent.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (!tx.txQueue.TryPush(TxEntry { frame, NowNs(), tx.owner.load(std::memory_order_relaxed) }))
+        return false;
+
+    // One wakeup is enough until the wire thread gets around to it
+    if (!m_wireWakePending.exchange(true) && m_wireWakeFd >= 0) {
+        const uint64_t post = 1;
+        [[maybe_unused]] const auto wr = write(m_wireWakeFd, &post, sizeof(post));
+    }
+    return true;
+}
+
+bool VirtualCanBus::Receive(int port, Frame& frame)
+{
+    if (!Valid(port))
+        return false;
+
+    auto& rx = m_ports[port];
+    auto cursor = rx.cursor.load(std::memory_order_relaxed);
+    while (true) {
+        const auto& slot = m_ring[cursor & RingMask];
+        const auto published = 2 * cursor + 2;
+        const auto seq = slot.seq.load(std::memory_order_acquire);
+        if (seq < published)
+            break; // not sent yet, or still being written
+
+        if (seq == published) {
+            const auto header = slot.header.load(std::memory_order_relaxed);
+            const auto payload = slot.payload.load(std::memory_order_relaxed);
+            const auto timestampNs = slot.timestampNs.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                cursor++;
+                const auto sender = static_cast<int>((header >> HeaderSenderShift) & 0xFF);
+                const auto id = static_cast<uint32_t>(header & CAN_EFF_MASK);
+                const bool id29Bit = (header & HeaderId29Bit) != 0;
+                if (sender == port)
+                    continue;
+                if (!Accepts(rx, id, id29Bit)) {
+                    rx.filtered.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+
+                frame.id = id;
+                frame.id29Bit = id29Bit;
+                frame.dlc = static_cast<uint8_t>((header >> HeaderDlcShift) & 0xFF);
+                std::memcpy(frame.data.data(), &payload, frame.data.size());
+                frame.timestamp = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(timestampNs));
+                rx.cursor.store(cursor, std::memory_order_relaxed);
+                rx.received.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+
+        // Lapped by the senders, carry on from the oldest frame still in the ring
+        const auto tail = m_tail.load(std::memory_order_acquire);
+        const auto oldest = (tail > RingCapacity) ? tail - RingCapacity : 0;
+        const auto resume = std::max(cursor + 1, oldest);
+        rx.overruns.fetch_add(resume - cursor, std::memory_order_relaxed);
+        cursor = resume;
+    }
+
+    rx.cursor.store(cursor, std::memory_order_relaxed);
+    return false;
+}
+
+size_t VirtualCanBus::Pending(int port) const
+{
+    if (!Valid(port))
+        return 0;
+
+    const auto tail = m_tail.load(std::memory_order_acquire);
+    const auto cursor = m_ports[port].cursor.load(std::memory_order_relaxed);
+    return (tail > cursor) ? static_cast<size_t>(std::min<uint64_t>(tail - cursor, RingCapacity)) : 0;
+}
+
+static bool FilterLess(const SocketCAN::RxFilter& lhs, const SocketCAN::RxFilter& rhs)
+{
+    return (lhs.id29Bit != rhs.id29Bit) ? !lhs.id29Bit : lhs.id < rhs.id;
+}
+
+void VirtualCanBus::SetFilters(int port, const std::vector<SocketCAN::RxFilter>& filters)
+{
+    if (!Valid(port))
+        return;
+
+    auto& rx = m_ports[port];
+    rx.filters = filters;
+    std::sort(rx.filters.begin(), rx.filters.end(), FilterLess);
+}
+
+bool VirtualCanBus::Accepts(const Port& port, uint32_t id, bool id29Bit) const
+{
+    if (port.filters.empty())
+        return true;
+    const SocketCAN::RxFilter filter { id, id29Bit };
+    return std::binary_search(port.filters.begin(), port.filters.end(), filter, FilterLess);
+}
+
+int VirtualCanBus::NotifyFd(int port)
+{
+    if (!Valid(port))
+        return -1;
+
+    auto& rx = m_ports[port];
+    auto notifyFd = rx.notifyFd.load();
+    if (notifyFd < 0) {
+        notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (notifyFd < 0) {
+            std::cerr << ERR_MARKER << LOG_MARKER << m_name << ": failed to create RX notification, error code "
+                      << errno << std::endl;
+            return -1;
+        }
+        rx.notifyFd.store(notifyFd, std::memory_order_release);
+    }
+    return notifyFd;
+}
+
+void VirtualCanBus::Acknowledge(int port)
+{
+    // Cleared before reading, so that a frame published from here on posts again
+    auto& rx = m_ports[port];
+    rx.notifyPending.store(false);
+    const auto notifyFd = rx.notifyFd.load(std::memory_order_acquire);
+    if (notifyFd < 0)
+        return;
+
+    uint64_t posted = 0;
+    [[maybe_unused]] const auto rd = read(notifyFd, &posted, sizeof(posted));
+}
+
+void VirtualCanBus::Publish(int sender, const Frame& frame, int64_t timestampNs)
+{
+    uint64_t payload = 0;
+    std::memcpy(&payload, frame.data.data(), sizeof(payload));
+    const uint64_t header = (frame.id & CAN_EFF_MASK) | (frame.id29Bit ? HeaderId29Bit : 0)
+        | (static_cast<uint64_t>(frame.dlc) << HeaderDlcShift) | (static_cast<uint64_t>(sender) << HeaderSenderShift);
+
+    // Claiming the position is the only contended step, the slot itself belongs to this sender until published
+    const auto pos = m_tail.fetch_add(1, std::memory_order_acq_rel);
+    auto& slot = m_ring[pos & RingMask];
+    slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.header.store(header, std::memory_order_relaxed);
+    slot.payload.store(payload, std::memory_order_relaxed);
+    slot.timestampNs.store(timestampNs, std::memory_order_relaxed);
+    slot.seq.store(2 * pos + 2, std::memory_order_release);
+
+    m_frames.fetch_add(1, std::memory_order_relaxed);
+    NotifyPorts(sender);
+}
+
+void VirtualCanBus::NotifyPorts(int sender)
+{
+    // One post per port until its receiver acknowledges it, however many frames go by meanwhile
+    const auto portsUsed = m_portsUsed.load(std::memory_order_acquire);
+    for (size_t idx = 0; idx < portsUsed; idx++) {
+        auto& rx = m_ports[idx];
+        if (static_cast<int>(idx) == sender || !rx.attached.load(std::memory_order_relaxed))
+            continue;
+
+        const auto notifyFd = rx.notifyFd.load(std::memory_order_acquire);
+        if (notifyFd < 0 || rx.notifyPending.load(std::memory_order_relaxed) || rx.notifyPending.exchange(true))
+            continue;
+
+        const uint64_t post = 1;
+        [[maybe_unused]] const auto wr = write(notifyFd, &post, sizeof(post));
+    }
+}
+
+void VirtualCanBus::RunWire()
+{
+    // Each port's oldest frame is up for arbitration, the rest wait behind it like in a single TX mailbox. Time on
+    // the wire is accounted from when the bus got free, not from when this thread got around to it, so scheduling
+    // hiccups delay delivery but never cost bus bandwidth.
+    std::array<TxEntry, MaxPorts> heads {};
+    std::array<bool, MaxPorts> headValid {};
+    int64_t busFreeNs = NowNs();
+
+    while (!m_stopWire.load()) {
+        const auto portsUsed = m_portsUsed.load(std::memory_order_acquire);
+        int64_t earliestNs = INT64_MAX;
+        for (size_t idx = 0; idx < portsUsed; idx++) {
+            // Whatever a port's previous user left behind never goes out under the new one. Entries newer than the
+            // owner read here are from an Attach() that came right after it, not stale
+            auto& port = m_ports[idx];
+            const auto owner = port.owner.load(std::memory_order_acquire);
+            if (headValid[idx] && heads[idx].owner < owner)
+                headValid[idx] = false;
+            while (!headValid[idx] && port.txQueue.TryPop(heads[idx]))
+                headValid[idx] = (heads[idx].owner >= owner);
+            if (headValid[idx])
+                earliestNs = std::min(earliestNs, heads[idx].queuedNs);
+        }
+
+        if (earliestNs == INT64_MAX) {
+            // Anything posted since the last look gets another one, otherwise the next Send() wakes us up
+            if (m_wireWakePending.exchange(false))
+                continue;
+
+            struct pollfd wake { m_wireWakeFd, POLLIN, 0 };
+            if (poll(&wake, 1, 100) > 0) {
+                uint64_t posted = 0;
+                [[maybe_unused]] const auto rd = read(m_wireWakeFd, &posted, sizeof(posted));
+            }
+            continue;
+        }
+
+        // Only frames already waiting when the bus got free take part in the arbitration
+        const auto startNs = std::max(busFreeNs, earliestNs);
+        int winner = -1;
+        uint64_t winnerKey = UINT64_MAX;
+        for (size_t idx = 0; idx < portsUsed; idx++) {
+            if (!headValid[idx] || heads[idx].queuedNs > startNs)
+                continue;
+            const auto key = ArbitrationKey(heads[idx].frame);
+            if (key < winnerKey) {
+                winner = static_cast<int>(idx);
+                winnerKey = key;
+            }
+        }
+
+        const auto& entry = heads[winner];
+        const auto frameNs = FrameNs(entry.frame, m_bitrate);
+        const auto endNs = startNs + static_cast<int64_t>(frameNs);
+        m_ports[winner].txDelayNs.Record(static_cast<uint64_t>(startNs - entry.queuedNs));
+
+        // Receivers get it at the end of frame, like on a real bus
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(endNs)));
+        Publish(winner, entry.frame, endNs);
+        m_ports[winner].sent.fetch_add(1, std::memory_order_relaxed);
+        m_busyNs.fetch_add(frameNs, std::memory_order_relaxed);
+        headValid[winner] = false;
+        busFreeNs = endNs;
+    }
+}
+
+VirtualCanBus::PortStats VirtualCanBus::PortStatistics(int port) const
+{
+    PortStats stats {};
+    if (port < 0 || static_cast<size_t>(port) >= MaxPorts)
+        return stats;
+
+    const auto& rx = m_ports[port];
+    stats.sent = rx.sent.load(std::memory_order_relaxed);
+    stats.received = rx.received.load(std::memory_order_relaxed);
+    stats.filtered = rx.filtered.load(std::memory_order_relaxed);
+    stats.overruns = rx.overruns.load(std::memory_order_relaxed);
+    stats.txDropped = rx.txQueue.Overflows();
+    stats.txDelayNs = rx.txDelayNs.Take();
+    return stats;
+}
+
+VirtualCanBus::BusStats VirtualCanBus::Statistics() const
+{
+    BusStats stats {};
+    stats.bitrate = m_bitrate;
+    const auto portsUsed = m_portsUsed.load(std::memory_order_acquire);
+    for (size_t idx = 0; idx < portsUsed; idx++)
+        stats.ports += m_ports[idx].attached.load(std::memory_order_relaxed) ? 1 : 0;
+    stats.frames = m_frames.load(std::memory_order_relaxed);
+    stats.busyNs = m_busyNs.load(std::memory_order_relaxed);
+    return stats;
+}
+
+uint64_t VirtualCanBus::FrameNs(const Frame& frame, int bitrate)
+{
+    const auto bits = SocketCAN::FrameBitLength(frame.id29Bit, frame.dlc, CAN_MTU).arbitration;
+    return bits * 1'000'000'000ULL / static_cast<uint64_t>(bitrate);
+}
+
+uint64_t VirtualCanBus::ArbitrationKey(const Frame& frame)
+{
+    canfd_frame wireFrame {};
+    wireFrame.can_id = frame.id29Bit ? ((frame.id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (frame.id & CAN_SFF_MASK);
+    return SocketCAN::ArbitrationKey(wireFrame);
+}
+
+int64_t VirtualCanBus::NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
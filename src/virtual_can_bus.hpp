@@ -0,0 +1,138 @@
+#ifndef CANOPEN_TIMERS_SRC_VIRTUAL_CAN_BUS_HPP_
+#define CANOPEN_TIMERS_SRC_VIRTUAL_CAN_BUS_HPP_
+
+#include "latency_histogram.hpp"
+#include "socketcan/socketcan.hpp"
+#include "spsc_ring.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// In-process CAN bus: every attached port sees the frames all the others send. Frames go through one broadcast ring,
+// written lock-free by the senders (by the wire thread when a bitrate is simulated) and read by each port at its own
+// pace through a private cursor. Senders never wait on receivers, a port falling a whole ring behind loses the oldest
+// frames and counts an overrun, like a real controller would.
+class VirtualCanBus {
+public:
+    static constexpr size_t MaxPorts { 128 }; // a full CANopen network and a tester
+    static constexpr size_t RingCapacity { 4096 };
+    static constexpr size_t TxQueueCapacity { 256 };
+    static constexpr int InvalidPort { -1 };
+
+    struct Frame {
+        uint32_t id {};
+        bool id29Bit {};
+        uint8_t dlc {};
+        std::array<uint8_t, SocketCAN::MaxClassicPayloadLen> data {};
+        std::chrono::steady_clock::time_point timestamp {}; // end of frame on the bus, RX only
+    };
+
+    struct PortStats {
+        uint64_t sent { 0 }; // made it on the bus
+        uint64_t received { 0 };
+        uint64_t filtered { 0 }; // skipped by the acceptance filter
+        uint64_t overruns { 0 }; // overwritten before the port got to them
+        uint64_t txDropped { 0 }; // TX queue full, simulated bitrate only
+        LatencyHistogram::Snapshot txDelayNs {}; // Send() to start of frame, simulated bitrate only
+    };
+
+    struct BusStats {
+        int bitrate { 0 };
+        size_t ports { 0 };
+        uint64_t frames { 0 };
+        uint64_t busyNs { 0 }; // simulated bitrate only
+    };
+
+    // Same name, same bus, for as long as a port stays attached. The first one to ask for it picks the bitrate: 0
+    // hands frames over as soon as they're sent, anything else puts them on a simulated wire one at a time, lowest
+    // arbitration ID first, taking as long as they would at that bitrate.
+    static std::shared_ptr<VirtualCanBus> Get(const std::string& name, int bitrate = 0);
+    ~VirtualCanBus();
+
+    const std::string& Name() const;
+    int Bitrate() const;
+
+    // Returns InvalidPort once MaxPorts are in use. Every port has one sender thread and one receiver thread at most.
+    int Attach();
+    void Detach(int port);
+
+    bool Send(int port, const Frame& frame);
+    bool Receive(int port, Frame& frame);
+    size_t Pending(int port) const; // upper bound, own and filtered out frames included
+
+    // Receiver side, an empty set lets everything through
+    void SetFilters(int port, const std::vector<SocketCAN::RxFilter>& filters);
+
+    // Readable once frames are pending for the port, acknowledged by the receiver before draining them
+    int NotifyFd(int port);
+    void Acknowledge(int port);
+
+    PortStats PortStatistics(int port) const;
+    BusStats Statistics() const;
+
+private:
+    static constexpr size_t RingMask { RingCapacity - 1 };
+
+    struct TxEntry {
+        Frame frame {};
+        int64_t queuedNs { 0 };
+        uint64_t owner { 0 }; // the port's attachment it was sent from
+    };
+
+    // Seqlock per slot: 2 * position + 1 while being written, 2 * position + 2 once published
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> seq { 0 };
+        std::atomic<uint64_t> header { 0 }; // identifier, format, length and sender port
+        std::atomic<uint64_t> payload { 0 };
+        std::atomic<int64_t> timestampNs { 0 };
+    };
+
+    struct Port {
+        std::atomic_bool attached { false };
+        std::atomic<uint64_t> cursor { 0 }; // next ring position, advanced by the receiver only
+        std::vector<SocketCAN::RxFilter> filters {}; // sorted, receiver only
+        std::atomic<int> notifyFd { -1 };
+        std::atomic_bool notifyPending { false };
+        SpscRing<TxEntry, TxQueueCapacity> txQueue {}; // sender to wire thread
+        std::atomic<uint64_t> owner { 0 }; // bumped on every Attach(), the wire thread drops older entries
+        std::atomic<uint64_t> sent { 0 };
+        std::atomic<uint64_t> received { 0 };
+        std::atomic<uint64_t> filtered { 0 };
+        std::atomic<uint64_t> overruns { 0 };
+        LatencyHistogram txDelayNs {};
+    };
+
+    const std::string m_name;
+    const int m_bitrate;
+    std::array<Slot, RingCapacity> m_ring {};
+    alignas(64) std::atomic<uint64_t> m_tail { 0 };
+    std::array<Port, MaxPorts> m_ports {};
+    std::atomic<size_t> m_portsUsed { 0 }; // highest port ever attached plus one
+    std::atomic<uint64_t> m_frames { 0 };
+    std::atomic<uint64_t> m_busyNs { 0 };
+
+    // Simulated bitrate only
+    std::unique_ptr<std::thread> m_wire {};
+    std::atomic_bool m_stopWire { false };
+    std::atomic_bool m_wireWakePending { false };
+    int m_wireWakeFd { -1 };
+
+    VirtualCanBus(const std::string& name, int bitrate);
+
+    bool Valid(int port) const;
+    void Publish(int sender, const Frame& frame, int64_t timestampNs);
+    void NotifyPorts(int sender);
+    void RunWire();
+    bool Accepts(const Port& port, uint32_t id, bool id29Bit) const;
+    static uint64_t FrameNs(const Frame& frame, int bitrate);
+    static uint64_t ArbitrationKey(const Frame& frame);
+    static int64_t NowNs();
+};
+
+#endif // CANOPEN_TIMERS_SRC_VIRTUAL_CAN_BUS_HPP_